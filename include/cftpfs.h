@@ -23,10 +23,12 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <pthread.h>
 #include <time.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #define CFTPFS_VERSION "1.0.0"
 #define MAX_PATH_LEN 4096
@@ -36,7 +38,58 @@
 #define CACHE_TIMEOUT_MIN 5
 #define CACHE_TIMEOUT_MAX 300
 #define MAX_FTP_LINE 4096
-#define MAX_HANDLES 1024
+#define HANDLE_SLAB_SIZE 256        // Handle slots allocated per slab
+#define HANDLE_TABLE_MAX (1 << 20)  // Hard cap on simultaneously open handles
+#define INTERN_BUCKETS_INITIAL 256
+#define OPEN_FILE_BUCKETS 1024
+#define STAGING_INITIAL_CAPACITY 4096
+#define STAGING_MEM_DEFAULT (1024 * 1024)  // Spill to disk past 1 MiB (configurable with --mem-staging)
+#define STAGING_ADMISSION_TIMEOUT 60       // Seconds to wait for temp_dir quota before ENOSPC
+#define CONTENT_CACHE_DEFAULT (64 * 1024 * 1024)  // Clean content kept after close (--content-cache)
+#define CONTENT_SKETCH_ROWS 4      // Hash functions of the content cache's open-frequency sketch
+#define CONTENT_SKETCH_WIDTH 4096  // Counters per row, a power of two
+#define CONTENT_SKETCH_MAX 15      // Counters saturate here
+#define CONTENT_SKETCH_PERIOD (10 * CONTENT_SKETCH_WIDTH)  // Opens between halvings of every counter
+#define FTP_CONNECT_TIMEOUT 30     // Seconds, control and data connections
+#define FTP_REPLY_TIMEOUT 60       // Seconds to wait for a reply on the control connection
+#define FTP_COMMAND_TIMEOUT 60     // Deadline for operations without a data transfer
+#define FTP_STALL_SPEED 1024       // Bytes/s a transfer must average over FTP_STALL_TIME...
+#define FTP_STALL_TIME 30          // ...seconds, or it is aborted as stalled
+#define FTP_PIPELINE_PROBE_TIMEOUT 5  // Seconds to wait for the second reply of the probe
+#define FTP_ABORT_TIMEOUT 5        // Seconds to wait for the server to acknowledge ABOR
+#define FTP_BATCH_WINDOW 32        // Pipelined commands written before reading replies
+#define REVALIDATE_BATCH_MAX 32    // Cached files checked together, two commands each
+#define FTP_CONNECTIONS_DEFAULT 3  // Pool size before a limit is learned, one third reserved for metadata
+#define FTP_CONNECTIONS_MIN 2
+#define FTP_CONNECTIONS_MAX_DEFAULT 8  // Ceiling for the automatic connection count (--max-connections)
+#define FTP_TUNE_WINDOW 5          // Seconds of transfer throughput compared by the autotuner
+#define FTP_TUNE_GAIN 0.05         // Throughput gain that justifies one more connection
+#define FTP_TUNE_HOLD 12           // Windows without growth after the pool shrank
+#define FTP_TUNE_RTT_FACTOR 3.0    // Command latency over this many times its minimum...
+#define FTP_TUNE_RTT_SLACK 0.05    // ...and at least this many seconds over it, shrinks the pool
+#define FTP_TUNE_STATE_FILE "cftpfs/connections"  // Learned limits, under $XDG_STATE_HOME
+#define FTP_JOURNAL_DIR "cftpfs/journal"  // Uploads waiting for their server, under $XDG_STATE_HOME
+#define FTP_PORT_DEFAULT 21
+#define FTPS_PORT_DEFAULT 990      // Implicit TLS (--ftps)
+#define FTP_DNS_TTL 60             // Seconds the server's addresses are reused, as libcurl's DNS cache
+#define FTP_DNS_MAX_ADDRS 8
+#define FTP_SERVERS_MAX 8          // The host plus its --mirror endpoints
+#define FTP_MIRROR_LAG 30          // Seconds after a write during which reads stay on the primary
+#define FTP_SHARE_LOCKS 8          // One mutex per curl_lock_data value shared between handles
+#define FTP_URL_MAX (320 + 3 * MAX_PATH_LEN)  // Base plus a fully percent-encoded path
+#define FTP_BULK_BUFFER (512 * 1024)  // Bytes per read/write call of a file transfer
+#define FTP_RATE_MIN (16 * 1024)   // Lowest bandwidth limit, bytes/s, well above FTP_STALL_SPEED
+#define FTP_RATE_XATTR "user.cftpfs.rate_limit"  // Bandwidth limits, read and set on the mount root
+#define FTP_PIN_XATTR "user.cftpfs.pin"  // Set to 1 to keep a file or subtree in the content cache
+#define FTP_CACHED_XATTR "user.cftpfs.cached"  // How much of a path the content cache holds
+#define FTP_KEEPALIVE_DEFAULT 60   // Seconds an idle connection waits for a NOOP, until a drop is observed
+#define FTP_KEEPALIVE_MIN 5
+#define FTP_RETRY_MAX 3            // Retries after the first attempt of an FTP operation
+#define FTP_RETRY_BASE_MS 200      // Backoff before the first retry, doubled for each further one
+#define FTP_RETRY_CAP_MS 5000
+#define FTP_BREAKER_THRESHOLD 5    // Consecutive connection failures that open the circuit breaker
+#define FTP_BREAKER_COOLDOWN_MIN 2 // Seconds before the first probe, doubled while probes fail
+#define FTP_BREAKER_COOLDOWN_MAX 60
 #define TEMP_DIR_PREFIX "/tmp/cftpfs_"
 
 typedef enum {
@@ -62,16 +115,202 @@ typedef struct cache_entry {
     struct cache_entry *next;
 } cache_entry_t;
 
+// Local copy of file content: a heap buffer that spills to a temp file
+// once it grows past ctx->staging_mem_max
 typedef struct {
-    int fd;
-    char path[MAX_PATH_LEN];
-    char temp_path[MAX_PATH_LEN];
-    int flags;
+    char *data;             // Memory tier, NULL once spilled
+    size_t size;            // Content size in either tier
+    size_t capacity;
+    int fd;                 // Disk tier, -1 while memory-backed
+    char *temp_path;
+    size_t disk_charged;    // Bytes charged against the staging quota (high-water mark)
+    bool no_wait;           // Set while a transfer fills it: fail instead of waiting for quota
+    bool shared;            // Other requests wait for the transfer filling it
+} staging_t;
+
+// Content of an open path, shared by every handle open on that path.
+// The first opener downloads it; concurrent openers wait for that download.
+// When the last handle closes, clean content stays in the table (refs == 0,
+// cached == true) on an LRU list so a reopen within cache_timeout is free.
+typedef struct open_file {
+    const char *path;       // Interned, also the table key
+    staging_t data;
+    int refs;               // Handles referencing this object
+    bool loaded;            // Content is present in data
+    bool loading;           // A download is in flight
+    int load_error;
     bool dirty;
     bool is_new;
+    bool cached;            // Retained after close, linked on the content LRU
+    uint64_t cached_seq;    // When it was, for eviction across contexts (shared.c)
+    bool pinned;            // Cached and never evicted (see pin.c)
+    bool revalidate;        // Expired cached content: check MDTM/SIZE before use
+    time_t loaded_at;
+    time_t remote_mtime;    // MDTM at download time, 0 if unknown
     pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct open_file *next; // Hash chain
+    struct open_file *lru_prev;
+    struct open_file *lru_next;
+} open_file_t;
+
+typedef struct {
+    uint64_t id;            // Value handed to FUSE in fi->fh
+    const char *path;       // Interned, see path_intern()
+    open_file_t *of;
+    int flags;
 } file_handle_t;
 
+// Handle IDs are (generation << 32) | slot index. The generation is bumped
+// every time a slot is released, so a stale fi->fh never matches a reused slot.
+typedef struct {
+    file_handle_t fh;
+    uint32_t generation;
+    uint32_t next_free;     // Next slot in the free list (valid when !in_use)
+    bool in_use;
+} handle_slot_t;
+
+// Refcounted interned string; the text lives inline after the header
+typedef struct intern_entry {
+    struct intern_entry *next;
+    uint32_t hash;
+    int refs;
+    char str[];
+} intern_entry_t;
+
+// One command of a metadata batch (see ftp_batch)
+typedef struct {
+    const char *verb;       // "SIZE" or "MDTM": read-only, so safe to repeat
+    const char *path;       // Filesystem path argument
+    int code;               // Reply code, -1 if no reply was received
+    char reply[128];        // Last line of the reply
+} ftp_batch_cmd_t;
+
+// An upload made while the server could not be reached, in
+// ctx->journal_dir as <seq>.data and <seq>.meta (see journal.c)
+typedef struct journal_entry {
+    unsigned seq;
+    char *path;
+    time_t base_mtime;      // MDTM of the content it was edited from, 0 if unknown
+    bool is_new;            // Created while offline
+    struct journal_entry *next;  // Oldest first
+} journal_entry_t;
+
+// Native FTP control connection (see ftp_native.c)
+typedef struct ftp_conn {
+    int fd;
+    char rbuf[MAX_FTP_LINE];    // Buffered control-channel input
+    size_t rlen;
+    char reply[MAX_FTP_LINE];   // Text of the last reply
+    char home[MAX_PATH_LEN];    // Login directory, prefixed to every path
+    time_t last_used;
+    bool no_epsv;               // Server rejected EPSV, use PASV
+    bool pipelined;             // Server passed the pipelining probe
+    bool broken;                // I/O error, must not be reused
+    bool cancelled;             // Transfer abandoned for an interrupted request
+} ftp_conn_t;
+
+// Why an FTP operation failed, which decides whether it is retried (retry.c)
+typedef enum {
+    FTP_ERR_NONE = 0,
+    FTP_ERR_PERMANENT,      // 5xx reply or local error: retrying cannot help
+    FTP_ERR_BUSY,           // 4xx reply: the server is up but refused for now
+    FTP_ERR_TRANSIENT,      // Connection lost or timed out mid-operation
+    FTP_ERR_UNREACHABLE,    // No connection could be made, nothing was sent
+    FTP_ERR_REFUSED,        // 421 at login: the server has too many sessions
+    FTP_ERR_CANCELLED       // The FUSE request was interrupted
+} ftp_err_t;
+
+typedef enum {
+    BREAKER_CLOSED = 0,     // Operations run normally
+    BREAKER_OPEN,           // Server considered down: operations fail fast
+    BREAKER_HALF_OPEN       // Cooldown over, one probe operation in flight
+} breaker_state_t;
+
+// Connection lanes (see lanes.c)
+typedef enum {
+    FTP_LANE_META = 0,      // Listings and single-command operations
+    FTP_LANE_BULK,          // Downloads and uploads
+    FTP_LANE_COUNT
+} ftp_lane_id_t;
+
+// Transport security of control and data connections
+typedef enum {
+    FTP_TLS_NONE = 0,
+    FTP_TLS_IMPLICIT,       // --ftps: TLS from the first byte, ftps:// on port 990
+    FTP_TLS_EXPLICIT        // --ftpes: AUTH TLS on the plain port
+} ftp_tls_t;
+
+// Bandwidth limit buckets (see ratelimit.c)
+typedef enum {
+    RATE_TOTAL = 0,         // Every transfer
+    RATE_DOWNLOAD,
+    RATE_UPLOAD,
+    RATE_BULK,              // File content
+    RATE_META,              // Directory listings
+    RATE_BUCKET_COUNT
+} rate_bucket_id_t;
+
+typedef struct {
+    double rate;            // Bytes/s, 0 = unlimited
+    double tokens;          // Up to one second of rate, negative while transfers owe it
+    struct timespec last;   // Last refill
+} rate_bucket_t;
+
+// An endpoint of the mount: the primary host, which takes every write, or
+// a read-only mirror of it (see mirror.c)
+typedef struct {
+    char host[256];
+    int port;
+    char url_base[320];          // "ftp://host:port", prefix of every URL
+    size_t url_base_len;
+    
+    struct sockaddr_storage dns_addrs[FTP_DNS_MAX_ADDRS];  // Addresses for the native engine
+    socklen_t dns_lens[FTP_DNS_MAX_ADDRS];
+    int dns_count;               // 0 until looked up, or after every address failed
+    time_t dns_time;             // Lookup time, for FTP_DNS_TTL
+    pthread_mutex_t dns_lock;    // Held during a lookup, so concurrent connects wait for it
+    int pipelining;              // 1 server tolerates pipelined commands, -1 not, 0 not probed
+    
+    double rtt;                  // Moving average of command latency in seconds, 0 until sampled
+    int active;                  // Operations in flight
+    int failures;                // Consecutive connection failures
+    int cooldown;                // Seconds a failed mirror is skipped, doubled while it stays down
+    time_t down_until;           // Mirrors only: not used for reads before this
+} ftp_server_t;
+
+// One connection: a curl handle or a native control connection, created
+// on first use and kept open across operations
+typedef struct {
+    void *curl;             // CURL* when using libcurl
+    ftp_conn_t *conn;       // Native engine connection
+    int server;             // Index in ctx->servers of the endpoint it is connected to
+    ftp_lane_id_t lane;
+    bool busy;
+    uint32_t owner;         // Path hash of the operation using the slot
+    time_t last_used;       // Last release, 0 if never used
+    ftp_err_t error;        // Why the last operation on the slot failed
+    bool fresh;             // The last operation had to log in first
+} ftp_slot_t;
+
+typedef struct lane_waiter {
+    uint32_t owner;
+    ftp_slot_t *slot;       // Set by lane_release when granted
+    struct lane_waiter *next;
+    pthread_cond_t cond;
+} lane_waiter_t;
+
+typedef struct {
+    ftp_slot_t *slots;
+    int count;
+    int limit;              // Slots in use, the rest are retired (see autotune.c)
+    int queued;             // Requests that had to wait since autotune last looked
+    lane_waiter_t *waiters; // Arrival order
+} ftp_lane_t;
+
+struct shard;
+struct cftpfs_shared;
+
 typedef struct {
     char host[256];
     int port;
@@ -79,61 +318,368 @@ typedef struct {
     char password[128];
     char encoding[32];
     bool debug;
+    ftp_tls_t tls;
+    char resolve[256];  // Addresses pinned for host (--resolve), "" to look it up
+    char cacert[MAX_PATH_LEN];  // CA bundle to verify the server with, "" for the system's
     int cache_timeout;  // Cache timeout in seconds
+    size_t staging_mem_max;  // Largest content kept in memory before spilling to temp_dir
     
-    bool conn_active;   // Indicates if the FTP connection is active
+    ftp_lane_t lanes[FTP_LANE_COUNT];
+    pthread_mutex_t lanes_lock;
     
-    void *curl;  // CURL* when using libcurl
-    pthread_mutex_t ftp_lock;
+    void *curl_share;            // CURLSH* shared by every slot's handle (see ftp_init)
+    pthread_mutex_t curl_share_locks[FTP_SHARE_LOCKS];
+    void *curl_resolve;          // curl_slist with the --resolve entry, NULL without
+    
+    ftp_server_t servers[FTP_SERVERS_MAX];  // [0] is host:port, then the mirrors
+    int server_count;
+    int mirror_writes;           // Writes in progress on the primary
+    time_t mirror_write_at;      // End of the last one
+    unsigned mirror_next;        // Where mirror_pick starts, for round robin among equals
+    pthread_mutex_t mirror_lock;
+    
+    int keepalive_interval;      // Seconds, shortened when the server drops idle connections
+    bool keepalive_running;      // On the shared keepalive thread's list
+    bool keepalive_warm;         // The pool has been logged in
+    unsigned keepalive_round;    // Last pass of the thread over this context
+    
+    breaker_state_t breaker_state;
+    int breaker_failures;        // Consecutive connection failures
+    int breaker_cooldown;        // Seconds the breaker stays open
+    time_t breaker_until;        // End of the current cooldown
+    pthread_mutex_t breaker_lock;
+    
+    bool autotune;               // Adjust the bulk lane's limit, off with a fixed --connections
+    time_t tune_window;          // Start of the current throughput window
+    uint64_t tune_bytes;         // Transferred during it
+    double tune_rate_before;     // Bytes/s before the last growth step, 0 if none pending
+    int tune_hold;               // Windows left before the pool may grow again
+    time_t tune_cut_at;          // Last multiplicative decrease
+    double tune_rtt_min;         // Command latency in seconds: lowest seen...
+    double tune_rtt_avg;         // ...and moving average, 0 until sampled
+    pthread_mutex_t tune_lock;
+    
+    rate_bucket_t rate_buckets[RATE_BUCKET_COUNT];
+    pthread_mutex_t rate_lock;
+    
+    bool native_ftp;             // Use the built-in FTP engine instead of libcurl
+    size_t tcp_buffer;           // Socket buffers of transfer connections, 0 = kernel autotuning
+    char tcp_congestion[16];     // TCP_CONGESTION of transfer connections, "" = system default
     
     cache_entry_t *dir_cache;
     pthread_mutex_t cache_lock;
     
-    file_handle_t *file_handles[MAX_HANDLES];
+    handle_slot_t **handle_slabs;  // Slabs never move once allocated
+    uint32_t handle_slab_count;
+    uint32_t handle_slab_capacity;
+    uint32_t handle_free;          // Head of the free list, UINT32_MAX if empty
+    uint32_t handle_count;
     pthread_mutex_t handles_lock;
-    int next_handle;
+    
+    open_file_t *open_files[OPEN_FILE_BUCKETS];
+    pthread_mutex_t open_files_lock;  // Also protects the content LRU
+    open_file_t *content_lru_head;    // Most recently closed
+    open_file_t *content_lru_tail;
+    size_t content_cached_bytes;      // This context's part of the shared content cache
+    
+    struct cftpfs_shared *shared;     // Budgets and threads shared with other contexts
+    
+    intern_entry_t **intern_buckets;
+    size_t intern_bucket_count;
+    size_t intern_count;
+    pthread_mutex_t intern_lock;
     
     char temp_dir[MAX_PATH_LEN];
+    
+    char journal_dir[MAX_PATH_LEN];  // Upload journal, "" without a state directory
+    journal_entry_t *journal;        // Uploads waiting for the server
+    unsigned journal_seq;            // Number of the next entry
+    pthread_mutex_t journal_lock;
+    
+    char **pins;                     // Paths pinned in the content cache
+    int pin_count;
+    pthread_mutex_t pin_lock;
+    
+    struct shard *shards;        // Mount table, on the root context only
+    int shard_count;
 } cftpfs_context_t;
 
+// A top-level directory of the mount served by a backend of its own, with
+// its own connections, caches and staging (see shard.c)
+typedef struct shard {
+    char name[256];              // Directory name at the root
+    size_t name_len;
+    char host[256];
+    int port;
+    char user[128];              // Login, "" for the command line's
+    char password[128];
+    char resolve[256];           // As --resolve, "" to look the host up
+    char mirrors[FTP_SERVERS_MAX - 1][272];
+    int mirror_count;
+    cftpfs_context_t *ctx;       // Created from the entry by main
+} shard_t;
+
+// Resources shared by every context of the process: the host's and its
+// mount table's, or those of every mount of a daemon (see shared.c)
+typedef struct cftpfs_shared {
+    cftpfs_context_t **contexts;
+    int context_count;
+    int context_serial;          // Tells the contexts' temporary directories apart
+    pthread_mutex_t lock;        // Protects the above, taken before any context's locks
+    
+    size_t content_cache_max;    // Clean content kept after close, across all contexts
+    size_t content_cached_bytes;
+    uint64_t content_clock;      // Stamps content as it is cached; the oldest goes first
+    uint8_t content_sketch[CONTENT_SKETCH_ROWS][CONTENT_SKETCH_WIDTH];  // How often paths are opened
+    unsigned content_sketch_samples;  // Opens counted since the last halving
+    pthread_mutex_t content_lock;     // Also protects the sketch
+    
+    size_t staging_quota;        // Max bytes in the temp directories, 0 = unlimited
+    size_t staging_disk_used;
+    pthread_mutex_t quota_lock;
+    pthread_cond_t quota_cond;
+    
+    cftpfs_context_t **keepalive_contexts;  // One thread keeps every pool alive
+    int keepalive_count;
+    cftpfs_context_t *keepalive_current;    // Context the thread is working on
+    unsigned keepalive_round;
+    bool keepalive_started;
+    bool keepalive_stopping;
+    pthread_t keepalive_thread;
+    pthread_mutex_t keepalive_lock;
+    pthread_cond_t keepalive_cond;
+} cftpfs_shared_t;
+
 typedef struct {
     char *data;
     size_t size;
     size_t capacity;
+    cftpfs_context_t *ctx;  // Charged to the listing bandwidth limits, NULL for none
 } response_buffer_t;
 
+// Transfer position in a staging_t for the download/upload callbacks
+typedef struct {
+    cftpfs_context_t *ctx;
+    staging_t *st;
+    off_t offset;
+} staging_cursor_t;
+
 extern cftpfs_context_t *g_context;
 
 // FTP Functions
+int ftp_init(cftpfs_context_t *ctx);
+void ftp_cleanup(cftpfs_context_t *ctx);
 int ftp_connect(cftpfs_context_t *ctx);
 void ftp_disconnect(cftpfs_context_t *ctx);
 int ftp_list_dir(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, int *count);
-int ftp_download(cftpfs_context_t *ctx, const char *remote_path, const char *local_path);
-int ftp_upload(cftpfs_context_t *ctx, const char *local_path, const char *remote_path);
+int ftp_download(cftpfs_context_t *ctx, const char *remote_path, staging_t *st, time_t *mtime);
+int ftp_upload(cftpfs_context_t *ctx, staging_t *st, const char *remote_path);
 int ftp_delete(cftpfs_context_t *ctx, const char *path);
 int ftp_mkdir(cftpfs_context_t *ctx, const char *path);
 int ftp_rmdir(cftpfs_context_t *ctx, const char *path);
 int ftp_rename(cftpfs_context_t *ctx, const char *old_path, const char *new_path);
+int ftp_batch(cftpfs_context_t *ctx, ftp_batch_cmd_t *cmds, int count);
+int ftp_batch_primary(cftpfs_context_t *ctx, ftp_batch_cmd_t *cmds, int count);
+int ftp_slot_noop(cftpfs_context_t *ctx, ftp_slot_t *slot);
+bool ftp_slot_alive(cftpfs_context_t *ctx, ftp_slot_t *slot);
+void ftp_slot_close(cftpfs_context_t *ctx, ftp_slot_t *slot);
+
+// Native FTP Engine
+int ftp_native_init(cftpfs_context_t *ctx);
+void ftp_native_cleanup(cftpfs_context_t *ctx);
+void ftp_native_close(cftpfs_context_t *ctx, ftp_slot_t *slot);
+int ftp_native_list_dir(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path, ftp_item_t **items, int *count);
+int ftp_native_download(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *remote_path, staging_t *st, time_t *mtime);
+int ftp_native_upload(cftpfs_context_t *ctx, ftp_slot_t *slot, staging_t *st, const char *remote_path);
+int ftp_native_delete(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path);
+int ftp_native_mkdir(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path);
+int ftp_native_rmdir(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path);
+int ftp_native_rename(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *old_path, const char *new_path);
+int ftp_native_batch(cftpfs_context_t *ctx, ftp_slot_t *slot, ftp_batch_cmd_t *cmds, int count);
+int ftp_native_noop(cftpfs_context_t *ctx, ftp_slot_t *slot);
+bool ftp_native_alive(ftp_slot_t *slot);
+
+// Mirrors
+int mirror_add(cftpfs_context_t *ctx, const char *spec, int default_port);
+void mirror_init(cftpfs_context_t *ctx);
+void mirror_cleanup(cftpfs_context_t *ctx);
+int mirror_pick(cftpfs_context_t *ctx, bool read_only);
+void mirror_begin(cftpfs_context_t *ctx, int server, bool write);
+void mirror_end(cftpfs_context_t *ctx, int server, bool write, ftp_err_t err, double latency);
+bool mirror_down(cftpfs_context_t *ctx, int server);
+bool mirror_probe_due(cftpfs_context_t *ctx, int server);
+
+// Mount Table
+int shard_load(cftpfs_context_t *root, const char *file, int default_port);
+void shard_cleanup(cftpfs_context_t *root);
+cftpfs_context_t* shard_route(cftpfs_context_t *root, const char *path, const char **rest);
+bool shard_is_name(cftpfs_context_t *root, const char *name);
+
+// Socket Options
+void sock_tune(cftpfs_context_t *ctx, int fd, bool transfer);
+
+// Connection Lanes
+int lanes_init(cftpfs_context_t *ctx, int meta, int bulk);
+void lanes_cleanup(cftpfs_context_t *ctx);
+ftp_slot_t* lane_acquire(cftpfs_context_t *ctx, ftp_lane_id_t lane, const char *path, int server);
+void lane_release(cftpfs_context_t *ctx, ftp_slot_t *slot);
+void lane_return(cftpfs_context_t *ctx, ftp_slot_t *slot);
+bool lane_try_take(cftpfs_context_t *ctx, ftp_slot_t *slot);
+bool lane_retired(cftpfs_context_t *ctx, ftp_slot_t *slot);
+int lane_set_limit(cftpfs_context_t *ctx, ftp_lane_id_t id, int limit);
+int lane_take_queued(cftpfs_context_t *ctx, ftp_lane_id_t id);
+
+// Connection Keepalive
+void keepalive_start(cftpfs_context_t *ctx);
+void keepalive_stop(cftpfs_context_t *ctx);
+void keepalive_shutdown(cftpfs_shared_t *shared);
+void keepalive_note_drop(cftpfs_context_t *ctx, time_t idle);
+
+// Shared Resources
+void shared_init(cftpfs_shared_t *shared, size_t content_cache_max, size_t staging_quota);
+void shared_cleanup(cftpfs_shared_t *shared);
+int shared_register(cftpfs_shared_t *shared, cftpfs_context_t *ctx);
+void shared_unregister(cftpfs_shared_t *shared, cftpfs_context_t *ctx);
+void shared_content_charge(cftpfs_shared_t *shared, open_file_t *of, bool add);
+void shared_content_trim(cftpfs_shared_t *shared);
+void shared_content_admit(cftpfs_shared_t *shared, cftpfs_context_t *ctx, uint64_t seq, unsigned freq);
+void shared_sketch_record(cftpfs_context_t *ctx, const char *path);
+unsigned shared_sketch_estimate(cftpfs_context_t *ctx, const char *path);
+bool shared_evict_clean(cftpfs_shared_t *shared, bool disk_only);
+
+// Daemon
+extern const struct fuse_operations cftpfs_oper;
+cftpfs_context_t* mount_create(int argc, char *argv[], cftpfs_shared_t *shared,
+                               char *mountpoint, size_t size);
+void mount_destroy(cftpfs_context_t *root);
+int daemon_run(const char *config, const char *control, const char *handoff,
+               cftpfs_shared_t *shared, bool foreground);
+int daemon_listen(const char *path, bool replace);
+
+// Hot Restart
+int handoff_receive(const char *socket_path, const char *mountpoint, cftpfs_context_t *root);
+int handoff_listen(const char *socket_path, bool keep_signals);
+void handoff_start(void);
+void handoff_offer(cftpfs_context_t *root, const char *mountpoint);
+bool handoff_withdraw(cftpfs_context_t *root);
+bool handoff_given(cftpfs_context_t *root);
+bool handoff_shutdown(const char *socket_path);
+
+// Retry Policy and Circuit Breaker
+void retry_init(cftpfs_context_t *ctx);
+void retry_cleanup(cftpfs_context_t *ctx);
+ftp_err_t ftp_reply_class(int code);
+bool retry_allowed(ftp_err_t err, bool idempotent);
+void retry_backoff(cftpfs_context_t *ctx, int attempt);
+bool breaker_allow(cftpfs_context_t *ctx);
+void breaker_record(cftpfs_context_t *ctx, ftp_err_t err);
+bool breaker_open(cftpfs_context_t *ctx);
+
+// Connection Count Autotuning
+void autotune_init(cftpfs_context_t *ctx, bool enabled);
+void autotune_cleanup(cftpfs_context_t *ctx);
+void autotune_bytes(cftpfs_context_t *ctx, size_t bytes);
+void autotune_latency(cftpfs_context_t *ctx, double seconds);
+void autotune_refused(cftpfs_context_t *ctx);
+int state_path(const char *name, char *out, size_t size);
+
+// Upload Journal
+void journal_init(cftpfs_context_t *ctx);
+void journal_cleanup(cftpfs_context_t *ctx);
+int journal_add(cftpfs_context_t *ctx, const char *path, staging_t *st, time_t base_mtime, bool is_new);
+void journal_forget(cftpfs_context_t *ctx, const char *path);
+bool journal_pending(cftpfs_context_t *ctx, const char *path);
+int journal_read(cftpfs_context_t *ctx, const char *path, staging_t *st);
+void journal_replay(cftpfs_context_t *ctx);
+
+// Pinned Content
+void pin_init(cftpfs_context_t *ctx);
+void pin_cleanup(cftpfs_context_t *ctx);
+bool pin_covers(cftpfs_context_t *ctx, const char *path);
+bool pin_set(cftpfs_context_t *ctx, const char *path);
+int pin_add(cftpfs_context_t *ctx, const char *path);
+int pin_remove(cftpfs_context_t *ctx, const char *path);
+int pin_format(cftpfs_context_t *ctx, const char *path, char *out, size_t size);
+
+// Bandwidth Limits
+void rate_init(cftpfs_context_t *ctx);
+void rate_cleanup(cftpfs_context_t *ctx);
+int rate_set(cftpfs_context_t *ctx, const char *spec);
+int rate_format(cftpfs_context_t *ctx, char *out, size_t size);
+void rate_take(cftpfs_context_t *ctx, ftp_lane_id_t lane, bool upload, size_t bytes);
 
 // Cache Functions
 void cache_init(cftpfs_context_t *ctx);
 void cache_clear(cftpfs_context_t *ctx);
 cache_entry_t* cache_get(cftpfs_context_t *ctx, const char *path);
+int cache_copy(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, int *count);
+int cache_copy_stale(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, int *count);
 void cache_put(cftpfs_context_t *ctx, const char *path, ftp_item_t *items, int count);
+void cache_put_at(cftpfs_context_t *ctx, const char *path, ftp_item_t *items, int count, time_t timestamp);
+cache_entry_t* cache_take(cftpfs_context_t *ctx);
 void cache_invalidate(cftpfs_context_t *ctx, const char *path);
+int cache_lookup_item(cftpfs_context_t *ctx, const char *path, ftp_item_t *out);
+void cache_note_file(cftpfs_context_t *ctx, const char *path, off_t size, time_t mtime);
 
 // FTP Listing Parser
 int parse_ftp_listing(const char *line, ftp_item_t *item);
 int parse_unix_listing(const char *line, ftp_item_t *item);
 int parse_windows_listing(const char *line, ftp_item_t *item);
+int parse_listing_buffer(const char *data, ftp_item_t **items, int *count);
+int parse_mdtm_reply(const char *reply, time_t *mtime);
+int parse_size(const char *str, size_t *out);
+int parse_endpoint(const char *spec, char *host, size_t size, int *port);
 
 // Handle Management
+void handles_init(cftpfs_context_t *ctx);
+void handles_cleanup(cftpfs_context_t *ctx);
 file_handle_t* handle_create(cftpfs_context_t *ctx, const char *path, int flags);
-file_handle_t* handle_get(cftpfs_context_t *ctx, int fh);
-void handle_release(cftpfs_context_t *ctx, int fh);
+file_handle_t* handle_get(cftpfs_context_t *ctx, uint64_t fh_id);
+void handle_release(cftpfs_context_t *ctx, uint64_t fh_id);
+
+// Content Staging
+void quota_init(cftpfs_shared_t *shared);
+void quota_cleanup(cftpfs_shared_t *shared);
+void staging_init(staging_t *st);
+void staging_free(cftpfs_context_t *ctx, staging_t *st);
+int staging_reserve(cftpfs_context_t *ctx, staging_t *st, size_t disk_bytes);
+size_t staging_shortfall(cftpfs_context_t *ctx, const staging_t *st, size_t end);
+int staging_admit(cftpfs_context_t *ctx, size_t bytes);
+void staging_credit(staging_t *st, size_t bytes);
+ssize_t staging_read(staging_t *st, char *buf, size_t size, off_t offset);
+ssize_t staging_write(cftpfs_context_t *ctx, staging_t *st, const char *buf, size_t size, off_t offset);
+int staging_truncate(cftpfs_context_t *ctx, staging_t *st, off_t size);
+bool staging_abandoned(const staging_t *st);
+
+// Shared Open Files
+void open_files_init(cftpfs_context_t *ctx);
+void open_files_cleanup(cftpfs_context_t *ctx);
+open_file_t* open_file_acquire(cftpfs_context_t *ctx, const char *path);
+open_file_t* open_file_lookup(cftpfs_context_t *ctx, const char *path);
+int open_file_load(cftpfs_context_t *ctx, open_file_t *of, bool missing_ok);
+void open_file_mark_new(cftpfs_context_t *ctx, open_file_t *of);
+int open_file_truncate(cftpfs_context_t *ctx, open_file_t *of, off_t size);
+void open_file_release(cftpfs_context_t *ctx, open_file_t *of);
+void open_file_invalidate(cftpfs_context_t *ctx, const char *path);
+bool open_file_evict(cftpfs_context_t *ctx, uint64_t seq);
+bool open_file_oldest(cftpfs_context_t *ctx, bool disk_only, uint64_t skip, uint64_t *seq, unsigned *freq);
+open_file_t* open_file_take_cached(cftpfs_context_t *ctx);
+void open_file_discard(cftpfs_context_t *ctx, open_file_t *of);
+int open_file_adopt(cftpfs_context_t *ctx, const char *path, staging_t *data, bool loaded,
+                    time_t loaded_at, time_t remote_mtime);
+void open_file_repin(cftpfs_context_t *ctx);
+void open_file_residency(cftpfs_context_t *ctx, const char *path, bool subtree,
+                         size_t *bytes, int *full, int *partial);
+
+// Path Interning
+void intern_init(cftpfs_context_t *ctx);
+void intern_cleanup(cftpfs_context_t *ctx);
+const char* path_intern(cftpfs_context_t *ctx, const char *path);
+void path_unintern(cftpfs_context_t *ctx, const char *path);
 
 // Curl callbacks
 size_t write_callback(void *ptr, size_t size, size_t nmemb, void *userdata);
 size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userdata);
+size_t download_callback(void *ptr, size_t size, size_t nmemb, void *userdata);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,230 @@
+/**
+ * autotune.c - Connection count tuning (AIMD)
+ *
+ * How many sessions a server tolerates differs from one server to the
+ * next. Unless --connections fixes the pool, the number of bulk-lane
+ * connections in use is adjusted while mounted: it grows by one per
+ * FTP_TUNE_WINDOW while transfers queue for a connection, as long as each
+ * extra connection pays off in throughput, and is halved when the server
+ * turns a login away with 421 or command latency climbs well above its
+ * minimum. The limit reached is saved per host and port, and is where the
+ * next mount of that server starts.
+ *
+ * Every change of the limit happens with tune_lock held (before
+ * lanes_lock), so the limit can be read under either lock.
+ */
+
+#include "cftpfs.h"
+
+// $XDG_STATE_HOME/name, ~/.local/state/name without it. Also where the
+// upload journal (journal.c) lives.
+int state_path(const char *name, char *out, size_t size) {
+    const char *base = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    int len;
+    if (base && base[0] == '/') {
+        len = snprintf(out, size, "%s/%s", base, name);
+    } else if (home && home[0]) {
+        len = snprintf(out, size, "%s/.local/state/%s", home, name);
+    } else {
+        return -1;
+    }
+    return (len < 0 || (size_t)len >= size) ? -1 : 0;
+}
+
+// One line per server: "<host> <port> <connections>"
+static int state_load(cftpfs_context_t *ctx) {
+    char path[MAX_PATH_LEN];
+    if (state_path(FTP_TUNE_STATE_FILE, path, sizeof(path)) < 0) {
+        return 0;
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+
+    int learned = 0;
+    char line[512];
+    char host[256];
+    int port, connections;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%255s %d %d", host, &port, &connections) == 3 &&
+            strcmp(host, ctx->host) == 0 && port == ctx->port) {
+            learned = connections;
+        }
+    }
+    fclose(f);
+    return learned;
+}
+
+static void state_save(cftpfs_context_t *ctx, int connections) {
+    char path[MAX_PATH_LEN];
+    char tmp[MAX_PATH_LEN + 16];
+    if (state_path(FTP_TUNE_STATE_FILE, path, sizeof(path)) < 0) {
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    // Create the directories leading up to the file
+    for (char *p = tmp + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        mkdir(tmp, 0700);
+        *p = '/';
+    }
+
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        return;
+    }
+    FILE *in = fopen(path, "r");
+    if (in) {
+        char line[512];
+        char host[256];
+        int port;
+        while (fgets(line, sizeof(line), in)) {
+            if (sscanf(line, "%255s %d", host, &port) == 2 &&
+                strcmp(host, ctx->host) == 0 && port == ctx->port) {
+                continue;
+            }
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s %d %d\n", ctx->host, ctx->port, connections);
+    if (fclose(out) != 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+    }
+}
+
+// Helpers below are called with tune_lock held
+
+static void tune_set(cftpfs_context_t *ctx, int limit, const char *why) {
+    int meta = ctx->lanes[FTP_LANE_META].count;
+    int old = ctx->lanes[FTP_LANE_BULK].limit;
+    limit = lane_set_limit(ctx, FTP_LANE_BULK, limit);
+    if (limit != old && ctx->debug) {
+        fprintf(stderr, "[DEBUG] autotune: %d -> %d connections (%s)\n", meta + old, meta + limit, why);
+    }
+}
+
+// Multiplicative decrease. Several transfers refused at the same moment
+// are one signal, so the pool is cut at most once per window.
+static bool tune_cut(cftpfs_context_t *ctx, const char *why) {
+    time_t now = time(NULL);
+    if (now - ctx->tune_cut_at < FTP_TUNE_WINDOW) {
+        return false;
+    }
+    ctx->tune_cut_at = now;
+    ctx->tune_hold = FTP_TUNE_HOLD;
+    ctx->tune_rate_before = 0;
+    tune_set(ctx, ctx->lanes[FTP_LANE_BULK].limit / 2, why);
+    return true;
+}
+
+// Additive increase: one more connection when transfers had to wait for
+// one, kept only if the next window moves more data
+static void tune_window_end(cftpfs_context_t *ctx, double rate) {
+    int queued = lane_take_queued(ctx, FTP_LANE_BULK);
+    int limit = ctx->lanes[FTP_LANE_BULK].limit;
+
+    if (ctx->tune_hold > 0) {
+        ctx->tune_hold--;
+    }
+    if (ctx->tune_rate_before > 0) {
+        if (rate < ctx->tune_rate_before * (1 + FTP_TUNE_GAIN)) {
+            tune_set(ctx, limit - 1, "no throughput gain");
+            ctx->tune_hold = FTP_TUNE_HOLD;
+        }
+        ctx->tune_rate_before = 0;
+    } else if (queued > 0 && ctx->tune_hold == 0 && limit < ctx->lanes[FTP_LANE_BULK].count) {
+        ctx->tune_rate_before = rate;
+        tune_set(ctx, limit + 1, "transfers waiting");
+    }
+}
+
+// Called after lanes_init; with tuning on, the bulk lane starts at the
+// learned limit for this server, or at the default pool size
+void autotune_init(cftpfs_context_t *ctx, bool enabled) {
+    pthread_mutex_init(&ctx->tune_lock, NULL);
+    ctx->autotune = enabled;
+    ctx->tune_window = time(NULL);
+    ctx->tune_bytes = 0;
+    ctx->tune_rate_before = 0;
+    ctx->tune_hold = 0;
+    ctx->tune_cut_at = 0;
+    ctx->tune_rtt_min = 0;
+    ctx->tune_rtt_avg = 0;
+    if (!enabled) {
+        return;
+    }
+
+    int meta = ctx->lanes[FTP_LANE_META].count;
+    int learned = state_load(ctx);
+    int start = learned > 0 ? learned : FTP_CONNECTIONS_DEFAULT;
+    int limit = lane_set_limit(ctx, FTP_LANE_BULK, start - meta);
+    if (ctx->debug) {
+        fprintf(stderr, "[DEBUG] autotune: starting with %d of up to %d connections%s\n",
+                meta + limit, meta + ctx->lanes[FTP_LANE_BULK].count, learned > 0 ? " (learned)" : "");
+    }
+}
+
+void autotune_cleanup(cftpfs_context_t *ctx) {
+    if (ctx->autotune) {
+        state_save(ctx, ctx->lanes[FTP_LANE_META].count + ctx->lanes[FTP_LANE_BULK].limit);
+    }
+    pthread_mutex_destroy(&ctx->tune_lock);
+}
+
+// Counts bytes moved by transfers, and closes a throughput window when
+// FTP_TUNE_WINDOW seconds have passed
+void autotune_bytes(cftpfs_context_t *ctx, size_t bytes) {
+    if (!ctx->autotune) {
+        return;
+    }
+    pthread_mutex_lock(&ctx->tune_lock);
+    time_t now = time(NULL);
+    time_t elapsed = now - ctx->tune_window;
+    if (elapsed > 2 * FTP_TUNE_WINDOW) {
+        // Transfers resumed after a pause: nothing to compare with
+        lane_take_queued(ctx, FTP_LANE_BULK);
+        ctx->tune_rate_before = 0;
+        ctx->tune_window = now;
+        ctx->tune_bytes = 0;
+    } else if (elapsed >= FTP_TUNE_WINDOW) {
+        tune_window_end(ctx, (double)ctx->tune_bytes / elapsed);
+        ctx->tune_window = now;
+        ctx->tune_bytes = 0;
+    }
+    ctx->tune_bytes += bytes;
+    pthread_mutex_unlock(&ctx->tune_lock);
+}
+
+// Response time of a single command on a logged-in connection. A server
+// that slows down under the load of our sessions gets fewer of them.
+void autotune_latency(cftpfs_context_t *ctx, double seconds) {
+    if (!ctx->autotune) {
+        return;
+    }
+    pthread_mutex_lock(&ctx->tune_lock);
+    if (ctx->tune_rtt_min == 0 || seconds < ctx->tune_rtt_min) {
+        ctx->tune_rtt_min = seconds;
+    }
+    ctx->tune_rtt_avg = ctx->tune_rtt_avg == 0 ? seconds : 0.8 * ctx->tune_rtt_avg + 0.2 * seconds;
+    if (ctx->tune_rtt_avg > FTP_TUNE_RTT_FACTOR * ctx->tune_rtt_min &&
+        ctx->tune_rtt_avg - ctx->tune_rtt_min > FTP_TUNE_RTT_SLACK &&
+        tune_cut(ctx, "latency inflation")) {
+        // Learn the baseline again under the new load
+        ctx->tune_rtt_min = 0;
+        ctx->tune_rtt_avg = 0;
+    }
+    pthread_mutex_unlock(&ctx->tune_lock);
+}
+
+void autotune_refused(cftpfs_context_t *ctx) {
+    if (!ctx->autotune) {
+        return;
+    }
+    pthread_mutex_lock(&ctx->tune_lock);
+    tune_cut(ctx, "server refused a login");
+    pthread_mutex_unlock(&ctx->tune_lock);
+}
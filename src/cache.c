@@ -61,7 +61,59 @@ cache_entry_t* cache_get(cftpfs_context_t *ctx, const char *path) {
     return NULL;
 }
 
+// Copies the listing cached for `path` while holding cache_lock, so the
+// caller never touches an entry another thread may replace. Entries older
+// than max_age seconds count as missing (any age if max_age < 0). Returns
+// -1 on a miss; on a hit *items is a malloc'd copy (NULL for an empty
+// directory).
+static int cache_copy_aged(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, int *count, int max_age) {
+    pthread_mutex_lock(&ctx->cache_lock);
+    
+    time_t now = time(NULL);
+    int ret = -1;
+    
+    for (cache_entry_t *e = ctx->dir_cache; e; e = e->next) {
+        if (strcmp(e->path, path) != 0) {
+            continue;
+        }
+        if (max_age >= 0 && now - e->timestamp > max_age) {
+            break;
+        }
+        *items = NULL;
+        *count = 0;
+        if (e->item_count > 0) {
+            *items = malloc(e->item_count * sizeof(ftp_item_t));
+            if (!*items) {
+                break;
+            }
+            memcpy(*items, e->items, e->item_count * sizeof(ftp_item_t));
+            *count = e->item_count;
+        }
+        ret = 0;
+        break;
+    }
+    
+    pthread_mutex_unlock(&ctx->cache_lock);
+    return ret;
+}
+
+int cache_copy(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, int *count) {
+    int timeout = ctx->cache_timeout > 0 ? ctx->cache_timeout : CACHE_TIMEOUT_DEFAULT;
+    return cache_copy_aged(ctx, path, items, count, timeout);
+}
+
+// Same, ignoring expiry: for when the server cannot be asked. Expired
+// entries stay in the list until replaced or invalidated.
+int cache_copy_stale(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, int *count) {
+    return cache_copy_aged(ctx, path, items, count, -1);
+}
+
 void cache_put(cftpfs_context_t *ctx, const char *path, ftp_item_t *items, int count) {
+    cache_put_at(ctx, path, items, count, time(NULL));
+}
+
+// Same, for a listing fetched at `timestamp` (see handoff.c)
+void cache_put_at(cftpfs_context_t *ctx, const char *path, ftp_item_t *items, int count, time_t timestamp) {
     pthread_mutex_lock(&ctx->cache_lock);
     
     // Remove existing entry if present
@@ -94,7 +146,7 @@ void cache_put(cftpfs_context_t *ctx, const char *path, ftp_item_t *items, int c
     
     strncpy(entry->path, path, MAX_PATH_LEN - 1);
     entry->path[MAX_PATH_LEN - 1] = '\0';
-    entry->timestamp = time(NULL);
+    entry->timestamp = timestamp;
     entry->item_count = count;
     
     if (count > 0 && items) {
@@ -109,6 +161,15 @@ void cache_put(cftpfs_context_t *ctx, const char *path, ftp_item_t *items, int c
     pthread_mutex_unlock(&ctx->cache_lock);
 }
 
+// Empties the cache and returns its entries, which the caller frees
+cache_entry_t* cache_take(cftpfs_context_t *ctx) {
+    pthread_mutex_lock(&ctx->cache_lock);
+    cache_entry_t *entries = ctx->dir_cache;
+    ctx->dir_cache = NULL;
+    pthread_mutex_unlock(&ctx->cache_lock);
+    return entries;
+}
+
 void cache_invalidate(cftpfs_context_t *ctx, const char *path) {
     pthread_mutex_lock(&ctx->cache_lock);
     
@@ -140,4 +201,87 @@ void cache_invalidate(cftpfs_context_t *ctx, const char *path) {
     }
     
     pthread_mutex_unlock(&ctx->cache_lock);
-}
\ No newline at end of file
+}
+
+// Copies the cached listing entry for `path` out of its parent's listing.
+// Returns -1 if the parent is not cached (or expired) or has no such entry.
+int cache_lookup_item(cftpfs_context_t *ctx, const char *path, ftp_item_t *out) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash[1] == '\0') {
+        return -1;
+    }
+
+    // Same keying as getattr and readdir: the parent without trailing
+    // slash, "/" for the root
+    size_t parent_len = slash == path ? 1 : (size_t)(slash - path);
+    const char *basename = slash + 1;
+
+    pthread_mutex_lock(&ctx->cache_lock);
+
+    time_t now = time(NULL);
+    int timeout = ctx->cache_timeout > 0 ? ctx->cache_timeout : CACHE_TIMEOUT_DEFAULT;
+    int ret = -1;
+
+    for (cache_entry_t *e = ctx->dir_cache; e; e = e->next) {
+        if (strlen(e->path) != parent_len || strncmp(e->path, path, parent_len) != 0) {
+            continue;
+        }
+        if (now - e->timestamp > timeout) {
+            break;
+        }
+        for (int i = 0; i < e->item_count; i++) {
+            if (strcmp(e->items[i].name, basename) == 0) {
+                *out = e->items[i];
+                ret = 0;
+                break;
+            }
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&ctx->cache_lock);
+    return ret;
+}
+
+// Records a file written locally in its parent's cached listing, at any
+// age, so that it is listed with its new size before the server has it
+void cache_note_file(cftpfs_context_t *ctx, const char *path, off_t size, time_t mtime) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash[1] == '\0' || strlen(slash + 1) >= MAX_PATH_LEN) {
+        return;
+    }
+    // Entries of the root are listed under "/"
+    size_t parent_len = slash == path ? 1 : (size_t)(slash - path);
+    const char *basename = slash + 1;
+
+    pthread_mutex_lock(&ctx->cache_lock);
+
+    for (cache_entry_t *e = ctx->dir_cache; e; e = e->next) {
+        if (strlen(e->path) != parent_len || strncmp(e->path, path, parent_len) != 0) {
+            continue;
+        }
+        ftp_item_t *item = NULL;
+        for (int i = 0; i < e->item_count && !item; i++) {
+            if (strcmp(e->items[i].name, basename) == 0) {
+                item = &e->items[i];
+            }
+        }
+        if (!item) {
+            ftp_item_t *grown = realloc(e->items, (e->item_count + 1) * sizeof(ftp_item_t));
+            if (!grown) {
+                break;
+            }
+            e->items = grown;
+            item = &e->items[e->item_count++];
+            memset(item, 0, sizeof(*item));
+            strcpy(item->name, basename);
+            item->type = FTP_TYPE_FILE;
+            item->mode = S_IFREG | 0644;
+        }
+        item->size = size;
+        item->mtime = mtime;
+        break;
+    }
+
+    pthread_mutex_unlock(&ctx->cache_lock);
+}
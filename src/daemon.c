@@ -0,0 +1,449 @@
+/**
+ * daemon.c - Several mounts served by one process (--daemon)
+ *
+ * Each line of the configuration file is the command line of one mount,
+ * without the program name:
+ *
+ *   # HOST            MOUNTPOINT   [options]
+ *   ftp1.example.com  /mnt/ftp1    -u alice -P secret
+ *   ftp2.example.com  /mnt/ftp2    --native-ftp --mount-table=/etc/cftpfs/ftp2.table
+ *
+ * Every mount gets its own FUSE session and contexts (main.c). All of them
+ * share curl's global state, the keepalive thread, the content cache limit
+ * and the staging quota (shared.c). --content-cache and --staging-quota
+ * are therefore given on the daemon's command line, and apply to all
+ * mounts together.
+ *
+ * Mounts can be added and removed while the daemon runs, through its
+ * control socket (--control). A client sends one command per connection,
+ * ending with a newline, and reads the reply up to a final "ok" or
+ * "error: ..." line:
+ *
+ *   mount HOST MOUNTPOINT [options]
+ *   unmount MOUNTPOINT
+ *   list                       one "MOUNTPOINT HOST:PORT" line per mount
+ *
+ * SIGINT and SIGTERM unmount everything and end the daemon.
+ *
+ * With --handoff, a new daemon takes over the mounts in its file from the
+ * running one (handoff.c). Once every mount has gone to the new daemon and
+ * the files open on them are closed, the old one ends by itself.
+ */
+
+#include "cftpfs.h"
+#include <fuse3/fuse_opt.h>
+#include <signal.h>
+#include <sys/un.h>
+
+#define DAEMON_LINE_MAX 4096
+#define DAEMON_ARGS_MAX 64
+#define DAEMON_REPLY_MAX (64 * 1024)
+
+typedef struct daemon_mount {
+    char mountpoint[MAX_PATH_LEN];
+    cftpfs_context_t *root;
+    struct fuse *fuse;
+    pthread_t thread;
+    bool started;               // The session loop runs in thread
+    bool stopped;               // The loop has returned, e.g. after fusermount -u
+    struct daemon_mount *next;
+} daemon_mount_t;
+
+static struct {
+    cftpfs_shared_t *shared;
+    const char *handoff;        // NULL without --handoff
+    daemon_mount_t *mounts;
+    pthread_mutex_t lock;       // Protects mounts; held while one is added or removed
+    int control_fd;             // -1 without --control
+} state;
+
+// Splits a command line into argv after a program name; returns argc, or
+// -1 if there are too many words
+static int daemon_split(char *line, char *argv[DAEMON_ARGS_MAX]) {
+    int argc = 0;
+    argv[argc++] = "cftpfs";
+    char *save = NULL;
+    for (char *word = strtok_r(line, " \t\r\n", &save); word; word = strtok_r(NULL, " \t\r\n", &save)) {
+        if (argc == DAEMON_ARGS_MAX - 1) {
+            return -1;
+        }
+        argv[argc++] = word;
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+// state.lock held
+static daemon_mount_t* daemon_find(const char *mountpoint) {
+    for (daemon_mount_t *m = state.mounts; m; m = m->next) {
+        if (strcmp(m->mountpoint, mountpoint) == 0) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+static void* daemon_loop(void *arg) {
+    daemon_mount_t *m = (daemon_mount_t *)arg;
+
+    fuse_loop_mt(m->fuse, 0);
+
+    pthread_mutex_lock(&state.lock);
+    m->stopped = true;
+    bool drained = true;
+    for (daemon_mount_t *other = state.mounts; other; other = other->next) {
+        drained &= other->stopped;
+    }
+    pthread_mutex_unlock(&state.lock);
+
+    // The last mount handed to a new daemon has served its open files
+    if (drained && handoff_given(m->root)) {
+        kill(getpid(), SIGTERM);
+    }
+    return NULL;
+}
+
+// state.lock held
+static int daemon_start(daemon_mount_t *m) {
+    if (pthread_create(&m->thread, NULL, daemon_loop, m) != 0) {
+        return -EAGAIN;
+    }
+    m->started = true;
+    return 0;
+}
+
+// Creates the mount described by a command line and mounts it. Its session
+// loop only starts with start, since the process may still daemonize.
+static int daemon_mount(char *line, bool start) {
+    char *argv[DAEMON_ARGS_MAX];
+    int argc = daemon_split(line, argv);
+    if (argc < 0) {
+        return -E2BIG;
+    }
+
+    pthread_mutex_lock(&state.lock);
+    char mountpoint[MAX_PATH_LEN];
+    cftpfs_context_t *root = mount_create(argc, argv, state.shared, mountpoint, sizeof(mountpoint));
+    if (!root) {
+        pthread_mutex_unlock(&state.lock);
+        return -EINVAL;
+    }
+    // Hot restart: the caches of the daemon now serving it, which unmounts
+    if (state.handoff && !start && handoff_receive(state.handoff, mountpoint, root) < 0) {
+        pthread_mutex_unlock(&state.lock);
+        mount_destroy(root);
+        return -EIO;
+    }
+    bool taken = daemon_find(mountpoint) != NULL;
+    daemon_mount_t *m = taken ? NULL : calloc(1, sizeof(daemon_mount_t));
+    if (!m) {
+        pthread_mutex_unlock(&state.lock);
+        mount_destroy(root);
+        return taken ? -EBUSY : -ENOMEM;
+    }
+    strcpy(m->mountpoint, mountpoint);
+    m->root = root;
+
+    // Same kernel cache timeouts as a mount of its own
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    fuse_opt_add_arg(&args, "cftpfs");
+    char opt_buf[64];
+    snprintf(opt_buf, sizeof(opt_buf), "-oattr_timeout=%d", root->cache_timeout);
+    fuse_opt_add_arg(&args, opt_buf);
+    snprintf(opt_buf, sizeof(opt_buf), "-oentry_timeout=%d", root->cache_timeout);
+    fuse_opt_add_arg(&args, opt_buf);
+    m->fuse = fuse_new(&args, &cftpfs_oper, sizeof(cftpfs_oper), root);
+    fuse_opt_free_args(&args);
+
+    int ret = 0;
+    if (!m->fuse) {
+        ret = -EINVAL;
+    } else if (fuse_mount(m->fuse, mountpoint) != 0) {
+        fuse_destroy(m->fuse);
+        ret = -EIO;
+    } else if (start && (ret = daemon_start(m)) < 0) {
+        fuse_unmount(m->fuse);
+        fuse_destroy(m->fuse);
+    }
+    if (ret < 0) {
+        pthread_mutex_unlock(&state.lock);
+        mount_destroy(root);
+        free(m);
+        return ret;
+    }
+    m->next = state.mounts;
+    state.mounts = m;
+    pthread_mutex_unlock(&state.lock);
+    handoff_offer(root, mountpoint);
+
+    printf("Mounted %s:%d on %s\n", root->host, root->port, mountpoint);
+    return 0;
+}
+
+// Unmounts, waits for the session loop to end and frees the mount, which
+// is no longer listed. Called without state.lock, which the loop takes as
+// it ends. The destroy callback has stopped its keepalive by then. A mount
+// handed to a new daemon is already detached, and its mountpoint is the
+// new one's: the loop ends once the files open on it are closed.
+static void daemon_teardown(daemon_mount_t *m) {
+    if (!handoff_given(m->root)) {
+        fuse_exit(m->fuse);
+        fuse_unmount(m->fuse);
+    }
+    if (m->started) {
+        pthread_join(m->thread, NULL);
+    }
+    fuse_destroy(m->fuse);
+    mount_destroy(m->root);
+    printf("Unmounted %s\n", m->mountpoint);
+    free(m);
+}
+
+static int daemon_unmount(const char *mountpoint) {
+    pthread_mutex_lock(&state.lock);
+    daemon_mount_t **pp = &state.mounts;
+    while (*pp && strcmp((*pp)->mountpoint, mountpoint) != 0) {
+        pp = &(*pp)->next;
+    }
+    daemon_mount_t *m = *pp;
+    if (m) {
+        *pp = m->next;
+    }
+    pthread_mutex_unlock(&state.lock);
+
+    if (!m) {
+        return -ENOENT;
+    }
+    daemon_teardown(m);
+    return 0;
+}
+
+// Runs one control command and writes its reply to fd
+static void daemon_command(int fd, char *line) {
+    char reply[DAEMON_REPLY_MAX];
+    size_t len = 0;
+    int ret = 0;
+
+    char *save = NULL;
+    char *command = strtok_r(line, " \t\r\n", &save);
+    char *rest = strtok_r(NULL, "\r\n", &save);
+    if (command && strcmp(command, "mount") == 0 && rest) {
+        ret = daemon_mount(rest, true);
+    } else if (command && strcmp(command, "unmount") == 0 && rest) {
+        ret = daemon_unmount(strtok_r(rest, " \t", &save));
+    } else if (command && strcmp(command, "list") == 0) {
+        pthread_mutex_lock(&state.lock);
+        for (daemon_mount_t *m = state.mounts; m && sizeof(reply) - len > MAX_PATH_LEN + 512; m = m->next) {
+            len += snprintf(reply + len, sizeof(reply) - len, "%s %s:%d%s\n", m->mountpoint,
+                            m->root->host, m->root->port, m->stopped ? " stopped" : "");
+        }
+        pthread_mutex_unlock(&state.lock);
+    } else {
+        ret = -EINVAL;
+    }
+
+    if (ret == 0) {
+        len += snprintf(reply + len, sizeof(reply) - len, "ok\n");
+    } else {
+        len = snprintf(reply, sizeof(reply), "error: %s\n", strerror(-ret));
+    }
+    if (write(fd, reply, len) < 0) {
+        fprintf(stderr, "Warning: control reply lost: %s\n", strerror(errno));
+    }
+}
+
+// Serves the control socket until daemon_run shuts it down
+static void* daemon_control(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        int fd = accept(state.control_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        // One command per connection, up to the first newline
+        char line[DAEMON_LINE_MAX];
+        size_t len = 0;
+        ssize_t n;
+        while (len < sizeof(line) - 1 && (n = read(fd, line + len, sizeof(line) - 1 - len)) > 0) {
+            len += n;
+            if (memchr(line, '\n', len)) {
+                break;
+            }
+        }
+        line[len] = '\0';
+        daemon_command(fd, line);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Clears path for a new socket. A socket nobody listens on is left over
+// from a process that did not exit cleanly and goes; one still in use
+// goes only when replace is set, for a handoff. Anything else stays.
+static int socket_clear(const char *path, const struct sockaddr_un *addr, bool replace) {
+    struct stat sb;
+    if (lstat(path, &sb) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISSOCK(sb.st_mode)) {
+        fprintf(stderr, "Error: %s exists and is not a socket\n", path);
+        return -1;
+    }
+    if (!replace) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe < 0) {
+            return -1;
+        }
+        int ret = connect(probe, (const struct sockaddr *)addr, sizeof(*addr));
+        int err = errno;
+        close(probe);
+        if (ret == 0 || err != ECONNREFUSED) {
+            fprintf(stderr, "Error: %s is in use by another process\n", path);
+            return -1;
+        }
+    }
+    return unlink(path) < 0 && errno != ENOENT ? -1 : 0;
+}
+
+// Creates a control or handoff socket, accessible to the daemon's user
+// only. replace takes the path over from a running process.
+int daemon_listen(const char *path, bool replace) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: control socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if (socket_clear(path, &addr, replace) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    mode_t mask = umask(077);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (ret < 0 || listen(fd, 8) < 0) {
+        fprintf(stderr, "Error: cannot listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Mounts everything in config, then serves until SIGINT or SIGTERM.
+// Returns the process exit status.
+int daemon_run(const char *config, const char *control, const char *handoff,
+               cftpfs_shared_t *shared, bool foreground) {
+    FILE *fp = fopen(config, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: cannot read %s: %s\n", config, strerror(errno));
+        return 1;
+    }
+    state.shared = shared;
+    state.handoff = handoff;
+    state.mounts = NULL;
+    state.control_fd = -1;
+    pthread_mutex_init(&state.lock, NULL);
+
+    // Sessions are mounted before the process daemonizes, so that errors
+    // still reach the terminal; their threads can only start after it
+    char line[DAEMON_LINE_MAX];
+    int number = 0;
+    int status = 0;
+    while (status == 0 && fgets(line, sizeof(line), fp)) {
+        number++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        if (line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        int ret = daemon_mount(line, false);
+        if (ret < 0) {
+            fprintf(stderr, "Error: %s:%d: %s\n", config, number, strerror(-ret));
+            status = 1;
+        }
+    }
+    fclose(fp);
+
+    // With --handoff the control socket is taken from the running daemon
+    if (status == 0 && control && (state.control_fd = daemon_listen(control, handoff != NULL)) < 0) {
+        status = 1;
+    }
+    if (status == 0 && handoff && handoff_listen(handoff, true) < 0) {
+        status = 1;
+    }
+    if (status == 0 && fuse_daemonize(foreground) != 0) {
+        status = 1;
+    }
+
+    // Signals are taken by sigwait below; every thread inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t control_thread;
+    bool control_running = false;
+    if (status == 0) {
+        pthread_mutex_lock(&state.lock);
+        for (daemon_mount_t *m = state.mounts; m && status == 0; m = m->next) {
+            if (daemon_start(m) < 0) {
+                fprintf(stderr, "Error: cannot serve %s\n", m->mountpoint);
+                status = 1;
+            }
+        }
+        pthread_mutex_unlock(&state.lock);
+    }
+    if (status == 0 && state.control_fd >= 0) {
+        control_running = pthread_create(&control_thread, NULL, daemon_control, NULL) == 0;
+    }
+
+    if (status == 0) {
+        int sig;
+        do {
+            sigwait(&signals, &sig);
+        } while (sig == SIGHUP);
+    }
+
+    // After a handoff the sockets are the new daemon's
+    bool handed = handoff && handoff_shutdown(handoff);
+    if (state.control_fd >= 0) {
+        // Makes accept() fail, which ends the control thread
+        shutdown(state.control_fd, SHUT_RDWR);
+        if (control_running) {
+            pthread_join(control_thread, NULL);
+        }
+        close(state.control_fd);
+        if (!handed) {
+            unlink(control);
+        }
+    }
+    for (;;) {
+        pthread_mutex_lock(&state.lock);
+        daemon_mount_t *m = state.mounts;
+        if (m) {
+            state.mounts = m->next;
+        }
+        pthread_mutex_unlock(&state.lock);
+        if (!m) {
+            break;
+        }
+        daemon_teardown(m);
+    }
+    pthread_mutex_destroy(&state.lock);
+    return status;
+}
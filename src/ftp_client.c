@@ -1,8 +1,13 @@
 /**
  * ftp_client.c - FTP client using libcurl
+ *
+ * Operations run on a connection slot taken from the metadata or bulk
+ * lane (lanes.c). With --native-ftp they are handed to the built-in engine
+ * in ftp_native.c instead.
  */
 
 #include "cftpfs.h"
+#include <poll.h>
 
 size_t write_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
     response_buffer_t *buf = (response_buffer_t *)userdata;
@@ -20,140 +25,398 @@ size_t write_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
     buf->size += total_size;
     buf->data[buf->size] = '\0';
     
+    if (buf->ctx) {
+        rate_take(buf->ctx, FTP_LANE_META, false, total_size);
+    }
     return total_size;
 }
 
+// Upload source: copies straight out of the staging buffer (or temp file)
 size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
-    FILE *fp = (FILE *)userdata;
-    return fread(ptr, size, nmemb, fp);
+    staging_cursor_t *cur = (staging_cursor_t *)userdata;
+    ssize_t n = staging_read(cur->st, ptr, size * nmemb, cur->offset);
+    if (n < 0) {
+        return CURL_READFUNC_ABORT;
+    }
+    cur->offset += n;
+    autotune_bytes(cur->ctx, n);
+    rate_take(cur->ctx, FTP_LANE_BULK, true, n);
+    return n;
 }
 
-// Helper function to encode FTP path (keeps "/" as separators)
-static int encode_ftp_path(CURL *curl, const char *path, char *out, size_t out_len, bool is_dir) {
-    if (!path || !out || out_len == 0) return -1;
-    
-    size_t out_pos = 0;
-    const char *p = path;
-    
-    // Always start with /
-    if (out_pos < out_len - 1) {
-        out[out_pos++] = '/';
+// Download sink: appends to the staging area, spilling to disk if it grows
+size_t download_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    staging_cursor_t *cur = (staging_cursor_t *)userdata;
+    ssize_t n = staging_write(cur->ctx, cur->st, ptr, size * nmemb, cur->offset);
+    if (n < 0) {
+        return 0;
+    }
+    cur->offset += n;
+    autotune_bytes(cur->ctx, n);
+    rate_take(cur->ctx, FTP_LANE_BULK, false, n);
+    return n;
+}
+
+// Called by libcurl about once a second during an operation; aborts it
+// when the FUSE request that started it has been interrupted. Downloads
+// pass their staging area, and carry on while other requests wait for it.
+static int xferinfo_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow,
+                             curl_off_t ultotal, curl_off_t ulnow) {
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    return staging_abandoned((const staging_t *)userdata) ? 1 : 0;
+}
+
+// Bytes curl_easy_escape leaves as they are: RFC 3986 unreserved characters
+static bool url_plain[256];
+
+static void url_init(cftpfs_context_t *ctx) {
+    for (int c = 0; c < 256; c++) {
+        url_plain[c] = isalnum(c) && c < 128;
     }
+    url_plain['-'] = url_plain['.'] = url_plain['_'] = url_plain['~'] = true;
     
-    // Skip initial / if it exists
-    if (*p == '/') p++;
+    // Implicit TLS is selected by the scheme; IPv6 literals need brackets
+    for (int i = 0; i < ctx->server_count; i++) {
+        ftp_server_t *srv = &ctx->servers[i];
+        bool v6 = strchr(srv->host, ':') != NULL;
+        srv->url_base_len = snprintf(srv->url_base, sizeof(srv->url_base), "%s://%s%s%s:%d",
+                                     ctx->tls == FTP_TLS_IMPLICIT ? "ftps" : "ftp",
+                                     v6 ? "[" : "", srv->host, v6 ? "]" : "", srv->port);
+    }
+}
+
+// Writes the URL of path on the slot's endpoint: the base built at
+// ftp_init, then the path with each byte of its components percent-encoded
+// as needed (the same output as curl_easy_escape per component) and a
+// trailing slash for directories. Returns -1 if it does not fit; nothing
+// is truncated.
+static int ftp_url(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path, bool is_dir,
+                   char *out, size_t size) {
+    static const char hex[] = "0123456789ABCDEF";
+    const ftp_server_t *srv = &ctx->servers[slot->server];
+    size_t pos = srv->url_base_len;
+    if (pos + 2 > size) {
+        return -1;
+    }
+    memcpy(out, srv->url_base, pos);
+    out[pos++] = '/';
     
-    while (*p && out_pos < out_len - 1) {
-        // Find next /
-        const char *slash = strchr(p, '/');
-        size_t component_len = slash ? (size_t)(slash - p) : strlen(p);
-        
-        if (component_len > 0) {
-            // Encode this component
-            char component[256];
-            if (component_len >= sizeof(component)) component_len = sizeof(component) - 1;
-            strncpy(component, p, component_len);
-            component[component_len] = '\0';
-            
-            char *encoded = curl_easy_escape(curl, component, 0);
-            if (encoded) {
-                size_t enc_len = strlen(encoded);
-                if (out_pos + enc_len < out_len - 1) {
-                    strcpy(out + out_pos, encoded);
-                    out_pos += enc_len;
-                }
-                curl_free(encoded);
-            }
+    const unsigned char *p = (const unsigned char *)path;
+    if (*p == '/') {
+        p++;
+    }
+    for (; *p; p++) {
+        if (pos + 4 > size) {
+            return -1;
         }
-        
-        if (slash) {
-            // Add separator /
-            if (out_pos < out_len - 1) {
-                out[out_pos++] = '/';
-            }
-            p = slash + 1;
+        if (*p == '/' || url_plain[*p]) {
+            out[pos++] = *p;
         } else {
-            break;
+            out[pos++] = '%';
+            out[pos++] = hex[*p >> 4];
+            out[pos++] = hex[*p & 0x0f];
         }
     }
-    
-    // Add / at the end ONLY if it is a directory and doesn't have it already
-    if (is_dir && out_pos > 0 && out[out_pos - 1] != '/' && out_pos < out_len - 1) {
-        out[out_pos++] = '/';
+    if (is_dir && out[pos - 1] != '/') {
+        if (pos + 2 > size) {
+            return -1;
+        }
+        out[pos++] = '/';
     }
-    
-    out[out_pos] = '\0';
+    out[pos] = '\0';
+    return 0;
+}
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    (void)handle;
+    (void)access;
+    cftpfs_context_t *ctx = (cftpfs_context_t *)userptr;
+    pthread_mutex_lock(&ctx->curl_share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    (void)handle;
+    cftpfs_context_t *ctx = (cftpfs_context_t *)userptr;
+    pthread_mutex_unlock(&ctx->curl_share_locks[data]);
+}
+
+// Builds the CURLOPT_RESOLVE entry "host:port:addr[,addr]" for --resolve
+static struct curl_slist* resolve_entry(cftpfs_context_t *ctx) {
+    char entry[MAX_PATH_LEN];
+    size_t len = snprintf(entry, sizeof(entry), "%s:%d:", ctx->host, ctx->port);
+
+    char list[sizeof(ctx->resolve)];
+    strcpy(list, ctx->resolve);
+    char *save = NULL;
+    for (char *addr = strtok_r(list, ",", &save); addr; addr = strtok_r(NULL, ",", &save)) {
+        bool bracket = strchr(addr, ':') && addr[0] != '[';
+        len += snprintf(entry + len, sizeof(entry) - len, "%s%s%s%s", entry[len - 1] == ':' ? "" : ",",
+                        bracket ? "[" : "", addr, bracket ? "]" : "");
+    }
+    return curl_slist_append(NULL, entry);
+}
+
+// Creates the share handle joined by every slot's curl handle. Through it
+// the server's name is resolved once for the whole pool rather than once
+// per handle, and a TLS session negotiated once per server is resumed by
+// all later connections, control and data alike, instead of each paying
+// for a full handshake.
+//
+// The connection cache is deliberately not shared: each slot owns exactly
+// one connection, which the lanes, the keepalive and the autotuner's
+// retirement of slots rely on.
+int ftp_init(cftpfs_context_t *ctx) {
+    if (CURL_LOCK_DATA_LAST > FTP_SHARE_LOCKS || ftp_native_init(ctx) < 0) {
+        return -1;
+    }
+    url_init(ctx);
+    if (ctx->resolve[0]) {
+        ctx->curl_resolve = resolve_entry(ctx);
+    }
+    CURLSH *share = curl_share_init();
+    if (!share) {
+        curl_slist_free_all(ctx->curl_resolve);
+        ctx->curl_resolve = NULL;
+        ftp_native_cleanup(ctx);
+        return -1;
+    }
+    for (int i = 0; i < FTP_SHARE_LOCKS; i++) {
+        pthread_mutex_init(&ctx->curl_share_locks[i], NULL);
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, ctx);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    ctx->curl_share = share;
     return 0;
 }
 
+// Every handle using the share must be gone (ftp_disconnect)
+void ftp_cleanup(cftpfs_context_t *ctx) {
+    if (ctx->curl_share) {
+        curl_share_cleanup(ctx->curl_share);
+        ctx->curl_share = NULL;
+        for (int i = 0; i < FTP_SHARE_LOCKS; i++) {
+            pthread_mutex_destroy(&ctx->curl_share_locks[i]);
+        }
+    }
+    curl_slist_free_all(ctx->curl_resolve);
+    ctx->curl_resolve = NULL;
+    ftp_native_cleanup(ctx);
+}
+
 static void setup_common_curl_options(cftpfs_context_t *ctx, CURL *curl) {
     if (ctx->debug) {
         curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
     }
+    curl_easy_setopt(curl, CURLOPT_SHARE, ctx->curl_share);
+    if (ctx->curl_resolve) {
+        curl_easy_setopt(curl, CURLOPT_RESOLVE, ctx->curl_resolve);
+    }
+    if (ctx->tls != FTP_TLS_NONE) {
+        // Control and data connections are both encrypted, never falling
+        // back to plain FTP
+        curl_easy_setopt(curl, CURLOPT_USE_SSL, (long)CURLUSESSL_ALL);
+        curl_easy_setopt(curl, CURLOPT_FTPSSLAUTH, (long)CURLFTPAUTH_TLS);
+        if (ctx->cacert[0]) {
+            curl_easy_setopt(curl, CURLOPT_CAINFO, ctx->cacert);
+        }
+    }
     curl_easy_setopt(curl, CURLOPT_USERNAME, ctx->user);
     curl_easy_setopt(curl, CURLOPT_PASSWORD, ctx->password);
     curl_easy_setopt(curl, CURLOPT_FTP_SKIP_PASV_IP, 1L);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 300L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)FTP_CONNECT_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_FTP_RESPONSE_TIMEOUT, (long)FTP_REPLY_TIMEOUT);
+    // No overall cap: a transfer runs as long as it keeps moving, and is
+    // aborted (then retried) once it stalls. Operations without a data
+    // transfer set their own deadline.
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)FTP_STALL_SPEED);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)FTP_STALL_TIME);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, xferinfo_callback);
     // Enable TCP Keep-Alive
     curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
     curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 120L);
     curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 60L);
 }
 
-int ftp_connect(cftpfs_context_t *ctx) {
-    if (ctx->curl && ctx->conn_active) {
-        return 0;
+// Connections of the bulk lane, control and data alike, are tuned for
+// transfers (sockopt.c). libcurl sets TCP_NODELAY on every connection.
+static int bulk_sockopt_callback(void *clientp, curl_socket_t fd, curlsocktype purpose) {
+    (void)purpose;
+    sock_tune((cftpfs_context_t *)clientp, fd, true);
+    return CURL_SOCKOPT_OK;
+}
+
+// Drops the slot's connection so the next operation starts a new one
+static void slot_reset(ftp_slot_t *slot) {
+    if (slot->curl) {
+        curl_easy_cleanup(slot->curl);
+        slot->curl = NULL;
     }
+}
 
-    if (ctx->curl) {
-        curl_easy_cleanup(ctx->curl);
+// Sorts a libcurl failure into retry classes. Failures that libcurl
+// reports for a refused command carry the server's verdict in the reply.
+static ftp_err_t curl_error_class(CURLcode res, long reply) {
+    switch (res) {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+            return FTP_ERR_UNREACHABLE;
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_FTP_ACCEPT_FAILED:
+        case CURLE_FTP_ACCEPT_TIMEOUT:
+        case CURLE_FTP_WEIRD_PASV_REPLY:
+        case CURLE_FTP_WEIRD_227_FORMAT:
+        case CURLE_FTP_CANT_GET_HOST:
+        case CURLE_FTP_PORT_FAILED:
+        case CURLE_WEIRD_SERVER_REPLY:
+            return FTP_ERR_TRANSIENT;
+        case CURLE_ABORTED_BY_CALLBACK:
+            return FTP_ERR_CANCELLED;
+        case CURLE_WRITE_ERROR:
+        case CURLE_READ_ERROR:
+        case CURLE_OUT_OF_MEMORY:
+            return FTP_ERR_PERMANENT;
+        default:
+            return reply > 0 ? ftp_reply_class((int)reply) : FTP_ERR_PERMANENT;
     }
-    
-    ctx->curl = curl_easy_init();
-    if (!ctx->curl) {
-        fprintf(stderr, "Error: Could not initialize curl\n");
-        return -1;
+}
+
+// Records why the slot's operation failed; a connection that may be in a
+// bad state is dropped so the next operation starts a new one
+static void slot_fail(ftp_slot_t *slot, CURLcode res) {
+    long reply = 0;
+    if (slot->curl) {
+        curl_easy_getinfo(slot->curl, CURLINFO_RESPONSE_CODE, &reply);
+    }
+    slot->error = curl_error_class(res, reply);
+    if (reply == 421 && slot->fresh) {
+        // Turned away while logging in, typically "too many connections"
+        slot->error = FTP_ERR_REFUSED;
+    }
+    if (slot->error == FTP_ERR_TRANSIENT || slot->error == FTP_ERR_UNREACHABLE ||
+        slot->error == FTP_ERR_CANCELLED) {
+        slot_reset(slot);
     }
-    
-    setup_common_curl_options(ctx, ctx->curl);
-    ctx->conn_active = true;
-    
-    return 0;
 }
 
-void ftp_disconnect(cftpfs_context_t *ctx) {
-    if (ctx->curl) {
-        curl_easy_cleanup(ctx->curl);
-        ctx->curl = NULL;
+// Socket of the connection libcurl keeps cached in the slot's handle
+static curl_socket_t slot_socket(ftp_slot_t *slot) {
+    curl_socket_t fd = CURL_SOCKET_BAD;
+    if (!slot->curl || curl_easy_getinfo(slot->curl, CURLINFO_ACTIVESOCKET, &fd) != CURLE_OK) {
+        return CURL_SOCKET_BAD;
     }
-    ctx->conn_active = false;
+    return fd;
 }
 
-int ftp_list_dir(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, int *count) {
-    if (!ctx->curl || !ctx->conn_active) {
-        if (ftp_connect(ctx) < 0) return -1;
+// An idle control connection has nothing to read unless the server is
+// announcing that it hangs up (421) or already has
+static bool socket_readable(curl_socket_t fd) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Returns the slot's curl handle, reset for a new operation. The handle,
+// and the connection libcurl keeps cached in it, lives as long as the slot.
+static CURL* slot_curl(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    // libcurl would send the next command on a connection the server
+    // already closed and fail on the 421; start over on a fresh one
+    curl_socket_t fd = slot_socket(slot);
+    if (fd != CURL_SOCKET_BAD && socket_readable(fd)) {
+        if (slot->last_used) {
+            keepalive_note_drop(ctx, time(NULL) - slot->last_used);
+        }
+        slot_reset(slot);
+        fd = CURL_SOCKET_BAD;
     }
+    slot->fresh = (fd == CURL_SOCKET_BAD);
     
-    CURL *curl = ctx->curl;
-    curl_easy_reset(curl);
-    setup_common_curl_options(ctx, curl);
-    
-    char url[MAX_PATH_LEN * 2];
-    char encoded_path[MAX_PATH_LEN];
+    if (!slot->curl) {
+        slot->curl = curl_easy_init();
+        if (!slot->curl) {
+            fprintf(stderr, "Error: Could not initialize curl\n");
+            return NULL;
+        }
+    }
+    curl_easy_reset(slot->curl);
+    setup_common_curl_options(ctx, slot->curl);
+    if (slot->lane == FTP_LANE_BULK) {
+        // Larger reads and writes per callback for file transfers
+        curl_easy_setopt(slot->curl, CURLOPT_SOCKOPTFUNCTION, bulk_sockopt_callback);
+        curl_easy_setopt(slot->curl, CURLOPT_SOCKOPTDATA, ctx);
+        curl_easy_setopt(slot->curl, CURLOPT_BUFFERSIZE, (long)FTP_BULK_BUFFER);
+        curl_easy_setopt(slot->curl, CURLOPT_UPLOAD_BUFFERSIZE, (long)FTP_BULK_BUFFER);
+    }
+    return slot->curl;
+}
+
+// Logs every slot in ahead of the first request. Slots that are already
+// in use are skipped; they are connected by then anyway.
+int ftp_connect(cftpfs_context_t *ctx) {
+    int connected = 0;
+    
+    for (int l = 0; l < FTP_LANE_COUNT; l++) {
+        for (int i = 0; i < ctx->lanes[l].count; i++) {
+            ftp_slot_t *slot = &ctx->lanes[l].slots[i];
+            if (!lane_try_take(ctx, slot)) {
+                connected++;
+                continue;
+            }
+            if (lane_retired(ctx, slot)) {
+                lane_return(ctx, slot);
+                continue;
+            }
+            if (ftp_slot_noop(ctx, slot) == 0) {
+                connected++;
+            }
+            lane_release(ctx, slot);
+        }
+    }
     
-    // Encode path keeping / as separators (IT IS A DIRECTORY)
-    if (encode_ftp_path(curl, path, encoded_path, sizeof(encoded_path), true) < 0) {
-        return -1;
+    return connected > 0 ? 0 : -1;
+}
+
+// Closes every connection; no operation may be in flight
+void ftp_disconnect(cftpfs_context_t *ctx) {
+    for (int l = 0; l < FTP_LANE_COUNT; l++) {
+        for (int i = 0; i < ctx->lanes[l].count; i++) {
+            ftp_slot_t *slot = &ctx->lanes[l].slots[i];
+            slot_reset(slot);
+            ftp_native_close(ctx, slot);
+        }
     }
+}
+
+static int curl_list_dir(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path, ftp_item_t **items, int *count) {
+    CURL *curl = slot_curl(ctx, slot);
+    if (!curl) return -ENOMEM;
     
-    snprintf(url, sizeof(url), "ftp://%s:%d%s", ctx->host, ctx->port, encoded_path);
+    char url[FTP_URL_MAX];
+    if (ftp_url(ctx, slot, path, true, url, sizeof(url)) < 0) {
+        return -ENAMETOOLONG;
+    }
     
     response_buffer_t buf = {0};
     buf.capacity = 65536;  // Increase buffer to 64KB
     buf.data = malloc(buf.capacity);
+    buf.ctx = ctx;
     if (!buf.data) {
-        return -1;
+        return -ENOMEM;
     }
     
     curl_easy_setopt(curl, CURLOPT_URL, url);
@@ -168,258 +431,211 @@ int ftp_list_dir(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, in
     if (res != CURLE_OK) {
         fprintf(stderr, "Error FTP list: %s\n", curl_easy_strerror(res));
         free(buf.data);
-        // If connection error, mark as inactive to reconnect next time
-        if (res == CURLE_COULDNT_CONNECT || res == CURLE_OPERATION_TIMEDOUT || res == CURLE_FTP_ACCEPT_FAILED) {
-             ftp_disconnect(ctx);
-        }
+        slot_fail(slot, res);
         return -1;
     }
     
-    // Parse listing - make copy of buffer because strtok modifies the string
-    char *data_copy = strdup(buf.data);
-    if (!data_copy) {
-        free(buf.data);
-        return -1;
-    }
-    
-    // First pass: count lines
-    *count = 0;
-    char *line = strtok(data_copy, "\n");
-    while (line) {
-        (*count)++;
-        line = strtok(NULL, "\n");
-    }
-    
-    *items = calloc(*count, sizeof(ftp_item_t));
-    if (!*items) {
-        free(data_copy);
-        free(buf.data);
-        return -1;
-    }
-    
-    // Second pass: parse (restore copy first)
-    strcpy(data_copy, buf.data);
-    int idx = 0;
-    line = strtok(data_copy, "\n");
-    while (line && idx < *count) {
-        if (parse_ftp_listing(line, &(*items)[idx]) == 0) {
-            idx++;
-        }
-        line = strtok(NULL, "\n");
-    }
-    
-    *count = idx;
-    free(data_copy);
+    int ret = parse_listing_buffer(buf.data, items, count);
     free(buf.data);
     
-    return 0;
+    return ret;
 }
 
-int ftp_download(cftpfs_context_t *ctx, const char *remote_path, const char *local_path) {
-    if (!ctx->curl || !ctx->conn_active) {
-        if (ftp_connect(ctx) < 0) return -1;
-    }
-    
-    CURL *curl = ctx->curl;
-    curl_easy_reset(curl);
-    setup_common_curl_options(ctx, curl);
-    
-    char url[MAX_PATH_LEN * 2];
-    char encoded_path[MAX_PATH_LEN];
-    
-    // Encode path keeping / as separators (IT IS A FILE)
-    if (encode_ftp_path(curl, remote_path, encoded_path, sizeof(encoded_path), false) < 0) {
-        return -1;
-    }
-    
-    snprintf(url, sizeof(url), "ftp://%s:%d%s", ctx->host, ctx->port, encoded_path);
-    
-    FILE *fp = fopen(local_path, "wb");
-    if (!fp) {
+// Downloads into st. If st already holds the start of the file, fetched
+// when it had the MDTM in *mtime, only the rest is transferred, provided
+// the file has not been modified since. On failure st keeps whatever
+// arrived, so that a retry can resume it, unless there is no MDTM to check
+// it against.
+static int curl_download(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *remote_path, staging_t *st, time_t *mtime) {
+    CURL *curl = slot_curl(ctx, slot);
+    if (!curl) return -ENOMEM;
+    
+    char url[FTP_URL_MAX];
+    if (ftp_url(ctx, slot, remote_path, false, url, sizeof(url)) < 0) {
+        return -ENAMETOOLONG;
+    }
+    
+    time_t known = mtime ? *mtime : 0;
+    off_t resume = known > 0 ? (off_t)st->size : 0;
+    if (staging_truncate(ctx, st, resume) < 0) {
         return -1;
     }
+    staging_cursor_t cur = { ctx, st, resume };
     
     curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, download_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &cur);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, st);
     curl_easy_setopt(curl, CURLOPT_FTP_FILEMETHOD, CURLFTPMETHOD_NOCWD);
+    if (mtime) {
+        curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+    }
+    if (resume > 0) {
+        // REST, but only if MDTM is not newer than that of the partial copy
+        curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)resume);
+        curl_easy_setopt(curl, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFUNMODSINCE);
+        curl_easy_setopt(curl, CURLOPT_TIMEVALUE_LARGE, (curl_off_t)known);
+    }
     
+    // Never block on the temp_dir quota while holding the connection
+    st->no_wait = true;
     CURLcode res = curl_easy_perform(curl);
-    fclose(fp);
+    
+    if (resume > 0) {
+        long unmet = 0;
+        long filetime = -1;
+        curl_easy_getinfo(curl, CURLINFO_CONDITION_UNMET, &unmet);
+        curl_easy_getinfo(curl, CURLINFO_FILETIME, &filetime);
+        if (unmet || res == CURLE_BAD_DOWNLOAD_RESUME || (res == CURLE_OK && filetime != (long)known)) {
+            // Changed on the server: the partial copy is useless
+            if (ctx->debug) {
+                fprintf(stderr, "[DEBUG] download: %s changed, not resuming\n", remote_path);
+            }
+            cur.offset = 0;
+            res = staging_truncate(ctx, st, 0) < 0 ? CURLE_WRITE_ERROR : CURLE_OK;
+            if (res == CURLE_OK) {
+                curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
+                curl_easy_setopt(curl, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_NONE);
+                res = curl_easy_perform(curl);
+            }
+        } else if (ctx->debug) {
+            fprintf(stderr, "[DEBUG] download: %s resumed at %lld\n", remote_path, (long long)resume);
+        }
+    }
+    st->no_wait = false;
+    
+    if (mtime) {
+        // Also known after a failure once MDTM has been answered, and lets
+        // the next attempt resume
+        long filetime = -1;
+        curl_easy_getinfo(curl, CURLINFO_FILETIME, &filetime);
+        *mtime = filetime > 0 ? (time_t)filetime : 0;
+    }
     
     if (res != CURLE_OK) {
         fprintf(stderr, "Error FTP download: %s\n", curl_easy_strerror(res));
-        unlink(local_path);
-        if (res == CURLE_COULDNT_CONNECT || res == CURLE_OPERATION_TIMEDOUT || res == CURLE_FTP_ACCEPT_FAILED) {
-             ftp_disconnect(ctx);
+        if (!mtime || *mtime == 0) {
+            staging_truncate(ctx, st, 0);
         }
-        return -1;
+        slot_fail(slot, res);
+        return res == CURLE_REMOTE_FILE_NOT_FOUND ? -ENOENT : -EIO;
     }
     
     return 0;
 }
 
-int ftp_upload(cftpfs_context_t *ctx, const char *local_path, const char *remote_path) {
-    if (!ctx->curl || !ctx->conn_active) {
-        if (ftp_connect(ctx) < 0) return -1;
-    }
-    
-    CURL *curl = ctx->curl;
-    curl_easy_reset(curl);
-    setup_common_curl_options(ctx, curl);
+static int curl_upload(cftpfs_context_t *ctx, ftp_slot_t *slot, staging_t *st, const char *remote_path) {
+    CURL *curl = slot_curl(ctx, slot);
+    if (!curl) return -ENOMEM;
     
-    char url[MAX_PATH_LEN * 2];
-    char encoded_path[MAX_PATH_LEN];
-    
-    // Encode path keeping / as separators (IT IS A FILE)
-    if (encode_ftp_path(curl, remote_path, encoded_path, sizeof(encoded_path), false) < 0) {
-        return -1;
+    char url[FTP_URL_MAX];
+    if (ftp_url(ctx, slot, remote_path, false, url, sizeof(url)) < 0) {
+        return -ENAMETOOLONG;
     }
     
-    snprintf(url, sizeof(url), "ftp://%s:%d%s", ctx->host, ctx->port, encoded_path);
-    
-    FILE *fp = fopen(local_path, "rb");
-    if (!fp) {
-        return -1;
-    }
+    staging_cursor_t cur = { ctx, st, 0 };
     
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
     curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback);
-    curl_easy_setopt(curl, CURLOPT_READDATA, fp);
-    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)-1);
+    curl_easy_setopt(curl, CURLOPT_READDATA, &cur);
+    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)st->size);
     curl_easy_setopt(curl, CURLOPT_FTP_CREATE_MISSING_DIRS, CURLFTP_CREATE_DIR);
     
     CURLcode res = curl_easy_perform(curl);
-    fclose(fp);
     
     if (res != CURLE_OK) {
         fprintf(stderr, "Error FTP upload: %s\n", curl_easy_strerror(res));
-        if (res == CURLE_COULDNT_CONNECT || res == CURLE_OPERATION_TIMEDOUT || res == CURLE_FTP_ACCEPT_FAILED) {
-             ftp_disconnect(ctx);
-        }
+        slot_fail(slot, res);
         return -1;
     }
     
     return 0;
 }
 
-int ftp_delete(cftpfs_context_t *ctx, const char *path) {
-    if (!ctx->curl || !ctx->conn_active) {
-        if (ftp_connect(ctx) < 0) return -1;
-    }
-    
-    CURL *curl = ctx->curl;
-    curl_easy_reset(curl);
-    setup_common_curl_options(ctx, curl);
+static int curl_delete(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path) {
+    CURL *curl = slot_curl(ctx, slot);
+    if (!curl) return -ENOMEM;
     
-    char url[MAX_PATH_LEN * 2];
-    char encoded_path[MAX_PATH_LEN];
-    
-    // Encode path keeping / as separators (IT IS A FILE)
-    if (encode_ftp_path(curl, path, encoded_path, sizeof(encoded_path), false) < 0) {
-        return -1;
+    char url[FTP_URL_MAX];
+    if (ftp_url(ctx, slot, path, false, url, sizeof(url)) < 0) {
+        return -ENAMETOOLONG;
     }
     
-    snprintf(url, sizeof(url), "ftp://%s:%d%s", ctx->host, ctx->port, encoded_path);
-    
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_QUOTE, NULL);
     curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELE");
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)FTP_COMMAND_TIMEOUT);
     
     CURLcode res = curl_easy_perform(curl);
     
     if (res != CURLE_OK) {
         fprintf(stderr, "Error FTP delete: %s\n", curl_easy_strerror(res));
-        if (res == CURLE_COULDNT_CONNECT || res == CURLE_OPERATION_TIMEDOUT || res == CURLE_FTP_ACCEPT_FAILED) {
-             ftp_disconnect(ctx);
-        }
+        slot_fail(slot, res);
         return -EIO;
     }
     
     return 0;
 }
 
-int ftp_mkdir(cftpfs_context_t *ctx, const char *path) {
-    if (!ctx->curl || !ctx->conn_active) {
-        if (ftp_connect(ctx) < 0) return -1;
-    }
+static int curl_mkdir(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path) {
+    CURL *curl = slot_curl(ctx, slot);
+    if (!curl) return -ENOMEM;
     
-    CURL *curl = ctx->curl;
-    curl_easy_reset(curl);
-    setup_common_curl_options(ctx, curl);
-    
-    char url[MAX_PATH_LEN * 2];
-    char encoded_path[MAX_PATH_LEN];
-    
-    // Encode path keeping / as separators (IT IS A DIRECTORY)
-    if (encode_ftp_path(curl, path, encoded_path, sizeof(encoded_path), true) < 0) {
-        return -1;
+    char url[FTP_URL_MAX];
+    if (ftp_url(ctx, slot, path, true, url, sizeof(url)) < 0) {
+        return -ENAMETOOLONG;
     }
     
-    snprintf(url, sizeof(url), "ftp://%s:%d%s", ctx->host, ctx->port, encoded_path);
-    
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_FTP_CREATE_MISSING_DIRS, CURLFTP_CREATE_DIR_RETRY);
     curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
     curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)0);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)FTP_COMMAND_TIMEOUT);
     
     CURLcode res = curl_easy_perform(curl);
     
     if (res != CURLE_OK) {
         fprintf(stderr, "Error FTP mkdir: %s\n", curl_easy_strerror(res));
-        if (res == CURLE_COULDNT_CONNECT || res == CURLE_OPERATION_TIMEDOUT || res == CURLE_FTP_ACCEPT_FAILED) {
-             ftp_disconnect(ctx);
-        }
+        slot_fail(slot, res);
         return -EIO;
     }
     
     return 0;
 }
 
-int ftp_rmdir(cftpfs_context_t *ctx, const char *path) {
-    if (!ctx->curl || !ctx->conn_active) {
-        if (ftp_connect(ctx) < 0) return -1;
-    }
-    
-    CURL *curl = ctx->curl;
-    curl_easy_reset(curl);
-    setup_common_curl_options(ctx, curl);
+static int curl_rmdir(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path) {
+    CURL *curl = slot_curl(ctx, slot);
+    if (!curl) return -ENOMEM;
     
-    char url[MAX_PATH_LEN * 2];
-    char encoded_path[MAX_PATH_LEN];
-    
-    // Encode path keeping / as separators (IT IS A DIRECTORY)
-    if (encode_ftp_path(curl, path, encoded_path, sizeof(encoded_path), true) < 0) {
-        return -1;
+    char url[FTP_URL_MAX];
+    if (ftp_url(ctx, slot, path, true, url, sizeof(url)) < 0) {
+        return -ENAMETOOLONG;
     }
     
-    snprintf(url, sizeof(url), "ftp://%s:%d%s", ctx->host, ctx->port, encoded_path);
-    
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "RMD");
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)FTP_COMMAND_TIMEOUT);
     
     CURLcode res = curl_easy_perform(curl);
     
     if (res != CURLE_OK) {
         fprintf(stderr, "Error FTP rmdir: %s\n", curl_easy_strerror(res));
-        if (res == CURLE_COULDNT_CONNECT || res == CURLE_OPERATION_TIMEDOUT || res == CURLE_FTP_ACCEPT_FAILED) {
-             ftp_disconnect(ctx);
-        }
+        slot_fail(slot, res);
         return -EIO;
     }
     
     return 0;
 }
 
-int ftp_rename(cftpfs_context_t *ctx, const char *old_path, const char *new_path) {
-    if (!ctx->curl || !ctx->conn_active) {
-        if (ftp_connect(ctx) < 0) return -1;
-    }
+static int curl_rename(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *old_path, const char *new_path) {
+    CURL *curl = slot_curl(ctx, slot);
+    if (!curl) return -ENOMEM;
     
-    CURL *curl = ctx->curl;
-    curl_easy_reset(curl);
-    setup_common_curl_options(ctx, curl);
+    char url[FTP_URL_MAX];
+    if (ftp_url(ctx, slot, "/", true, url, sizeof(url)) < 0) {
+        return -ENAMETOOLONG;
+    }
     
     char cmd[MAX_PATH_LEN * 4];
     snprintf(cmd, sizeof(cmd), "RNFR %s", old_path);
@@ -430,23 +646,341 @@ int ftp_rename(cftpfs_context_t *ctx, const char *old_path, const char *new_path
     snprintf(cmd, sizeof(cmd), "RNTO %s", new_path);
     cmds = curl_slist_append(cmds, cmd);
     
-    char url[MAX_PATH_LEN];
-    snprintf(url, sizeof(url), "ftp://%s:%d/", ctx->host, ctx->port);
-    
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_QUOTE, cmds);
     curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)FTP_COMMAND_TIMEOUT);
     
     CURLcode res = curl_easy_perform(curl);
     curl_slist_free_all(cmds);
     
     if (res != CURLE_OK) {
         fprintf(stderr, "Error FTP rename: %s\n", curl_easy_strerror(res));
-        if (res == CURLE_COULDNT_CONNECT || res == CURLE_OPERATION_TIMEDOUT || res == CURLE_FTP_ACCEPT_FAILED) {
-             ftp_disconnect(ctx);
-        }
+        slot_fail(slot, res);
         return -EIO;
     }
     
     return 0;
-}
\ No newline at end of file
+}
+
+// Keeps the last reply line seen on the control connection
+static size_t reply_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    ftp_batch_cmd_t *cmd = (ftp_batch_cmd_t *)userdata;
+    size_t total_size = size * nmemb;
+    
+    if (total_size >= 4 && isdigit((unsigned char)ptr[0]) && ptr[3] == ' ') {
+        size_t len = total_size < sizeof(cmd->reply) ? total_size : sizeof(cmd->reply) - 1;
+        memcpy(cmd->reply, ptr, len);
+        while (len > 0 && (cmd->reply[len - 1] == '\r' || cmd->reply[len - 1] == '\n')) {
+            len--;
+        }
+        cmd->reply[len] = '\0';
+    }
+    
+    return total_size;
+}
+
+// Through libcurl batch commands go one QUOTE at a time
+static int curl_batch(cftpfs_context_t *ctx, ftp_slot_t *slot, ftp_batch_cmd_t *cmds, int count) {
+    char url[FTP_URL_MAX];
+    if (ftp_url(ctx, slot, "/", true, url, sizeof(url)) < 0) {
+        return -ENAMETOOLONG;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        cmds[i].code = -1;
+        cmds[i].reply[0] = '\0';
+        
+        // The URL leaves the session in the login directory; name the path
+        // relative to it, as the URLs of the other requests do
+        const char *path = cmds[i].path;
+        while (*path == '/') {
+            path++;
+        }
+        char cmd[MAX_PATH_LEN * 2];
+        snprintf(cmd, sizeof(cmd), "%s %s", cmds[i].verb, *path ? path : ".");
+        if (strpbrk(cmd, "\r\n")) {
+            continue;
+        }
+        CURL *curl = slot_curl(ctx, slot);
+        if (!curl) return -ENOMEM;
+        struct curl_slist *quote = curl_slist_append(NULL, cmd);
+        
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_QUOTE, quote);
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, reply_callback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &cmds[i]);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)FTP_COMMAND_TIMEOUT);
+        
+        CURLcode res = curl_easy_perform(curl);
+        curl_slist_free_all(quote);
+        
+        // A negative reply to the command itself is a result, not a failure
+        if (res != CURLE_OK && res != CURLE_QUOTE_ERROR) {
+            fprintf(stderr, "Error FTP batch: %s\n", curl_easy_strerror(res));
+            slot_fail(slot, res);
+            return -1;
+        }
+        
+        long code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+        cmds[i].code = (int)code;
+    }
+    
+    return 0;
+}
+
+static int curl_noop(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    CURL *curl = slot_curl(ctx, slot);
+    if (!curl) return -ENOMEM;
+    
+    char url[FTP_URL_MAX];
+    if (ftp_url(ctx, slot, "/", true, url, sizeof(url)) < 0) {
+        return -ENAMETOOLONG;
+    }
+    struct curl_slist *quote = curl_slist_append(NULL, "NOOP");
+    
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_QUOTE, quote);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)FTP_COMMAND_TIMEOUT);
+    
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(quote);
+    
+    if (res != CURLE_OK) {
+        fprintf(stderr, "Error FTP keepalive: %s\n", curl_easy_strerror(res));
+        slot_fail(slot, res);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Cheap check, without network traffic, that the slot holds a logged-in
+// connection the server has not closed. The caller owns the slot.
+bool ftp_slot_alive(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    if (ctx->native_ftp) {
+        return ftp_native_alive(slot);
+    }
+    curl_socket_t fd = slot_socket(slot);
+    return fd != CURL_SOCKET_BAD && !socket_readable(fd);
+}
+
+// Keeps the slot's connection alive, reconnecting it if it was dropped.
+// The caller owns the slot (lane_try_take). Also serves as the circuit
+// breaker's probe when nothing else is talking to the server, and as the
+// check whether a mirror that was down is back.
+int ftp_slot_noop(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    int server = slot->server;
+    if (server == 0 && !breaker_allow(ctx)) {
+        return -EHOSTDOWN;
+    }
+    slot->error = FTP_ERR_NONE;
+    mirror_begin(ctx, server, false);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = ctx->native_ftp ? ftp_native_noop(ctx, slot) : curl_noop(ctx, slot);
+    double latency = (ret == 0 && !slot->fresh) ? seconds_since(&start) : 0;
+    ftp_err_t err = ret == 0 ? FTP_ERR_NONE : slot->error;
+    mirror_end(ctx, server, false, err, latency);
+    if (server == 0) {
+        if (latency > 0) {
+            autotune_latency(ctx, latency);
+        }
+        breaker_record(ctx, err);
+    }
+    return ret;
+}
+
+// Logs out a slot the autotuner has retired
+void ftp_slot_close(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    slot_reset(slot);
+    ftp_native_close(ctx, slot);
+}
+
+// Public entry points: each describes its operation as an ftp_req_t, and
+// ftp_execute takes a connection from the right lane and runs it on the
+// native engine or libcurl, retrying what the policy in retry.c allows
+
+typedef enum {
+    REQ_LIST, REQ_DOWNLOAD, REQ_UPLOAD, REQ_DELETE, REQ_MKDIR, REQ_RMDIR, REQ_RENAME, REQ_BATCH
+} ftp_req_op_t;
+
+typedef struct {
+    ftp_req_op_t op;
+    ftp_lane_id_t lane;
+    bool idempotent;        // Safe to repeat after a lost connection
+    bool primary;           // Read-only, but must see the primary's state
+    const char *path;
+    const char *path2;
+    staging_t *st;
+    ftp_item_t **items;
+    int *count;
+    time_t *mtime;
+    ftp_batch_cmd_t *cmds;
+    int cmd_count;
+} ftp_req_t;
+
+static int run_on_slot(cftpfs_context_t *ctx, ftp_slot_t *slot, ftp_req_t *req) {
+    bool native = ctx->native_ftp;
+    switch (req->op) {
+        case REQ_LIST:
+            return native ? ftp_native_list_dir(ctx, slot, req->path, req->items, req->count)
+                          : curl_list_dir(ctx, slot, req->path, req->items, req->count);
+        case REQ_DOWNLOAD:
+            return native ? ftp_native_download(ctx, slot, req->path, req->st, req->mtime)
+                          : curl_download(ctx, slot, req->path, req->st, req->mtime);
+        case REQ_UPLOAD:
+            return native ? ftp_native_upload(ctx, slot, req->st, req->path)
+                          : curl_upload(ctx, slot, req->st, req->path);
+        case REQ_DELETE:
+            return native ? ftp_native_delete(ctx, slot, req->path)
+                          : curl_delete(ctx, slot, req->path);
+        case REQ_MKDIR:
+            return native ? ftp_native_mkdir(ctx, slot, req->path)
+                          : curl_mkdir(ctx, slot, req->path);
+        case REQ_RMDIR:
+            return native ? ftp_native_rmdir(ctx, slot, req->path)
+                          : curl_rmdir(ctx, slot, req->path);
+        case REQ_RENAME:
+            return native ? ftp_native_rename(ctx, slot, req->path, req->path2)
+                          : curl_rename(ctx, slot, req->path, req->path2);
+        case REQ_BATCH:
+            return native ? ftp_native_batch(ctx, slot, req->cmds, req->cmd_count)
+                          : curl_batch(ctx, slot, req->cmds, req->cmd_count);
+    }
+    return -1;
+}
+
+// Returns the operation's own result, -EIO for a failure without a more
+// specific errno, -EINTR if the FUSE request was interrupted, or
+// -EHOSTDOWN if the server could not be reached (now, or recently enough
+// that the breaker is open). Read-only operations may run
+// on a mirror (mirror.c); one that fails there is repeated elsewhere
+// without counting as a retry.
+static int ftp_execute(cftpfs_context_t *ctx, ftp_req_t *req) {
+    bool read_only = req->idempotent && req->op != REQ_UPLOAD;
+    bool anywhere = read_only && !req->primary;
+    int failovers = 0;
+    
+    for (int attempt = 0; ; attempt++) {
+        int server = mirror_pick(ctx, anywhere);
+        if (server == 0 && !breaker_allow(ctx)) {
+            return -EHOSTDOWN;
+        }
+        
+        ftp_slot_t *slot = lane_acquire(ctx, req->lane, req->path, server);
+        if (slot->server != server) {
+            ftp_slot_close(ctx, slot);
+            slot->server = server;
+        }
+        slot->error = FTP_ERR_NONE;
+        mirror_begin(ctx, server, !read_only);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int ret = run_on_slot(ctx, slot, req);
+        ftp_err_t err = FTP_ERR_NONE;
+        if (ret != 0) {
+            err = slot->error != FTP_ERR_NONE ? slot->error : FTP_ERR_PERMANENT;
+        }
+        // Single commands on a logged-in connection time the server's
+        // response; listings and batches depend too much on their size
+        bool timed = req->op != REQ_LIST && req->op != REQ_BATCH && req->lane == FTP_LANE_META;
+        double latency = (err == FTP_ERR_NONE && timed && !slot->fresh) ? seconds_since(&start) : 0;
+        lane_release(ctx, slot);
+        mirror_end(ctx, server, !read_only, err, latency);
+        if (server == 0) {
+            // The autotuner and the breaker track the primary only
+            if (latency > 0) {
+                autotune_latency(ctx, latency);
+            }
+            breaker_record(ctx, err);
+        }
+        
+        if (err == FTP_ERR_CANCELLED) {
+            return -EINTR;
+        }
+        if (server > 0 && err != FTP_ERR_NONE && failovers++ < ctx->server_count) {
+            // Moves on at once: to another endpoint if the mirror is down,
+            // to the primary if it refused the read, as it may be behind
+            anywhere = mirror_down(ctx, server);
+            attempt--;
+            continue;
+        }
+        if (err == FTP_ERR_REFUSED && server == 0) {
+            autotune_refused(ctx);
+        }
+        if (err == FTP_ERR_NONE || !retry_allowed(err, req->idempotent)) {
+            return (err == FTP_ERR_UNREACHABLE) ? -EHOSTDOWN : (ret == -1 ? -EIO : ret);
+        }
+        if (attempt == FTP_RETRY_MAX) {
+            return (err == FTP_ERR_BUSY || err == FTP_ERR_REFUSED) ? (ret == -1 ? -EIO : ret) : -EHOSTDOWN;
+        }
+        retry_backoff(ctx, attempt);
+    }
+}
+
+int ftp_list_dir(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, int *count) {
+    ftp_req_t req = { .op = REQ_LIST, .lane = FTP_LANE_META, .idempotent = true,
+                      .path = path, .items = items, .count = count };
+    return ftp_execute(ctx, &req);
+}
+
+// -ENOENT only if the server says the file does not exist
+int ftp_download(cftpfs_context_t *ctx, const char *remote_path, staging_t *st, time_t *mtime) {
+    ftp_req_t req = { .op = REQ_DOWNLOAD, .lane = FTP_LANE_BULK, .idempotent = true,
+                      .path = remote_path, .st = st, .mtime = mtime };
+    return ftp_execute(ctx, &req);
+}
+
+// STOR replaces the whole file, so repeating it is harmless
+int ftp_upload(cftpfs_context_t *ctx, staging_t *st, const char *remote_path) {
+    ftp_req_t req = { .op = REQ_UPLOAD, .lane = FTP_LANE_BULK, .idempotent = true,
+                      .path = remote_path, .st = st };
+    return ftp_execute(ctx, &req);
+}
+
+int ftp_delete(cftpfs_context_t *ctx, const char *path) {
+    ftp_req_t req = { .op = REQ_DELETE, .lane = FTP_LANE_META, .path = path };
+    return ftp_execute(ctx, &req);
+}
+
+int ftp_mkdir(cftpfs_context_t *ctx, const char *path) {
+    ftp_req_t req = { .op = REQ_MKDIR, .lane = FTP_LANE_META, .path = path };
+    return ftp_execute(ctx, &req);
+}
+
+int ftp_rmdir(cftpfs_context_t *ctx, const char *path) {
+    ftp_req_t req = { .op = REQ_RMDIR, .lane = FTP_LANE_META, .path = path };
+    return ftp_execute(ctx, &req);
+}
+
+int ftp_rename(cftpfs_context_t *ctx, const char *old_path, const char *new_path) {
+    ftp_req_t req = { .op = REQ_RENAME, .lane = FTP_LANE_META, .path = old_path, .path2 = new_path };
+    return ftp_execute(ctx, &req);
+}
+
+static int batch_execute(cftpfs_context_t *ctx, ftp_batch_cmd_t *cmds, int count, bool primary) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(cmds[i].verb, "SIZE") != 0 && strcmp(cmds[i].verb, "MDTM") != 0) {
+            return -EINVAL;
+        }
+    }
+    ftp_req_t req = { .op = REQ_BATCH, .lane = FTP_LANE_META, .idempotent = true, .primary = primary,
+                      .path = count > 0 ? cmds[0].path : NULL, .cmds = cmds, .cmd_count = count };
+    return ftp_execute(ctx, &req);
+}
+
+// Runs independent metadata commands and records each reply. The native
+// engine pipelines them. Only read-only commands (SIZE, MDTM) are taken, so
+// a batch may be repeated and may run on a mirror.
+int ftp_batch(cftpfs_context_t *ctx, ftp_batch_cmd_t *cmds, int count) {
+    return batch_execute(ctx, cmds, count, false);
+}
+
+// Same, on the primary only: for checks a lagging mirror would get wrong
+int ftp_batch_primary(cftpfs_context_t *ctx, ftp_batch_cmd_t *cmds, int count) {
+    return batch_execute(ctx, cmds, count, true);
+}
@@ -77,19 +77,55 @@ size_t write_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
 }
 
 size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
-    FILE *fp = (FILE *)userdata;
-    return fread(ptr, size, nmemb, fp);
+    staging_cursor_t *cur = (staging_cursor_t *)userdata;
+    ssize_t n = staging_read(cur->st, ptr, size * nmemb, cur->offset);
+    if (n < 0) return 0;
+    cur->offset += n;
+    return n;
+}
+
+size_t download_callback(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    staging_cursor_t *cur = (staging_cursor_t *)userdata;
+    ssize_t n = staging_write(cur->ctx, cur->st, ptr, size * nmemb, cur->offset);
+    if (n < 0) return 0;
+    cur->offset += n;
+    return n;
+}
+
+int ftp_init(cftpfs_context_t *ctx) {
+    (void)ctx;
+    return 0;
+}
+
+void ftp_cleanup(cftpfs_context_t *ctx) {
+    (void)ctx;
 }
 
 int ftp_connect(cftpfs_context_t *ctx) {
     fprintf(stderr, "[MOCK] ftp_connect a %s:%d\n", ctx->host, ctx->port);
-    ctx->curl = (void*)1; // Mock pointer
     return 0;
 }
 
+int ftp_slot_noop(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    (void)ctx;
+    (void)slot;
+    return 0;
+}
+
+bool ftp_slot_alive(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    (void)ctx;
+    (void)slot;
+    return true;
+}
+
+void ftp_slot_close(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    (void)ctx;
+    (void)slot;
+}
+
 void ftp_disconnect(cftpfs_context_t *ctx) {
+    (void)ctx;
     fprintf(stderr, "[MOCK] ftp_disconnect\n");
-    ctx->curl = NULL;
 }
 
 int ftp_list_dir(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, int *count) {
@@ -122,18 +158,16 @@ int ftp_list_dir(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, in
     return 0;
 }
 
-int ftp_download(cftpfs_context_t *ctx, const char *remote_path, const char *local_path) {
-    (void)ctx;
-    fprintf(stderr, "[MOCK] ftp_download: %s -> %s\n", remote_path, local_path);
-    // Crear archivo vacío
-    FILE *fp = fopen(local_path, "w");
-    if (fp) fclose(fp);
-    return 0;
+int ftp_download(cftpfs_context_t *ctx, const char *remote_path, staging_t *st, time_t *mtime) {
+    fprintf(stderr, "[MOCK] ftp_download: %s\n", remote_path);
+    if (mtime) *mtime = 0;
+    // Contenido vacío
+    return staging_truncate(ctx, st, 0);
 }
 
-int ftp_upload(cftpfs_context_t *ctx, const char *local_path, const char *remote_path) {
+int ftp_upload(cftpfs_context_t *ctx, staging_t *st, const char *remote_path) {
     (void)ctx;
-    fprintf(stderr, "[MOCK] ftp_upload: %s -> %s\n", local_path, remote_path);
+    fprintf(stderr, "[MOCK] ftp_upload: %s (%zu bytes)\n", remote_path, st->size);
     return 0;
 }
 
@@ -159,4 +193,18 @@ int ftp_rename(cftpfs_context_t *ctx, const char *old_path, const char *new_path
     (void)ctx;
     fprintf(stderr, "[MOCK] ftp_rename: %s -> %s\n", old_path, new_path);
     return 0;
-}
\ No newline at end of file
+}
+
+int ftp_batch(cftpfs_context_t *ctx, ftp_batch_cmd_t *cmds, int count) {
+    (void)ctx;
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, "[MOCK] ftp_batch: %s %s\n", cmds[i].verb, cmds[i].path);
+        cmds[i].code = 502;
+        strcpy(cmds[i].reply, "502 Command not implemented");
+    }
+    return 0;
+}
+
+int ftp_batch_primary(cftpfs_context_t *ctx, ftp_batch_cmd_t *cmds, int count) {
+    return ftp_batch(ctx, cmds, count);
+}
@@ -0,0 +1,1103 @@
+/**
+ * ftp_native.c - Built-in FTP protocol engine
+ *
+ * Speaks FTP directly over sockets instead of going through libcurl's URL
+ * machinery. Each connection slot (see lanes.c) keeps its logged-in control
+ * connection open between operations, so metadata operations (DELE, MKD, RMD, RNFR/RNTO) cost a single
+ * command/reply round trip, and transfers only add EPSV/PASV plus the data
+ * connection. Enabled with --native-ftp.
+ *
+ * Independent read-only metadata commands (SIZE/MDTM for a directory of
+ * cached files) can go out as a pipelined batch: one write, then one reply
+ * per command, when the server passed the pipelining probe at first login.
+ *
+ * All commands use absolute paths built from the login directory, so the
+ * working directory of a pooled connection never matters.
+ */
+
+#include "cftpfs.h"
+#include <stdarg.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define NATIVE_IO_CHUNK 65536
+
+// Connects to addr within FTP_CONNECT_TIMEOUT. Data connections are tuned
+// for transfers, control connections for short exchanges (sockopt.c).
+static int tcp_connect_addr(cftpfs_context_t *ctx, const struct sockaddr *addr, socklen_t addrlen,
+                            bool data) {
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    sock_tune(ctx, fd, data);
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    if (connect(fd, addr, addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int err = 0;
+        socklen_t len = sizeof(err);
+        int ready = poll(&pfd, 1, FTP_CONNECT_TIMEOUT * 1000);
+        if (ready <= 0) {
+            err = ready == 0 ? ETIMEDOUT : errno;
+        } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            err = errno;
+        }
+        if (err != 0) {
+            close(fd);
+            errno = err;
+            return -1;
+        }
+    }
+
+    fcntl(fd, F_SETFL, flags);
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    return fd;
+}
+
+// Adds the addresses of name to the server's cache. Called with its
+// dns_lock held.
+static int dns_add(ftp_server_t *srv, const char *name, int flags) {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", srv->port);
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+
+    struct addrinfo *res;
+    if (getaddrinfo(name, service, &hints, &res) != 0) {
+        return -1;
+    }
+    for (struct addrinfo *ai = res; ai && srv->dns_count < FTP_DNS_MAX_ADDRS; ai = ai->ai_next) {
+        memcpy(&srv->dns_addrs[srv->dns_count], ai->ai_addr, ai->ai_addrlen);
+        srv->dns_lens[srv->dns_count++] = ai->ai_addrlen;
+    }
+    freeaddrinfo(res);
+    return 0;
+}
+
+// The --resolve addresses, which are pinned for the primary only
+static const char* dns_pinned(cftpfs_context_t *ctx, ftp_server_t *srv) {
+    return (srv == &ctx->servers[0] && ctx->resolve[0]) ? ctx->resolve : NULL;
+}
+
+// Fills the server's cache with its pinned addresses, or looks it up.
+// Called with its dns_lock held.
+static int dns_fill(cftpfs_context_t *ctx, ftp_server_t *srv) {
+    srv->dns_count = 0;
+    srv->dns_time = time(NULL);
+    if (!dns_pinned(ctx, srv)) {
+        return dns_add(srv, srv->host, 0);
+    }
+
+    char list[sizeof(ctx->resolve)];
+    strcpy(list, ctx->resolve);
+    char *save = NULL;
+    for (char *addr = strtok_r(list, ",", &save); addr; addr = strtok_r(NULL, ",", &save)) {
+        // IPv6 addresses may be given in brackets, as libcurl wants them
+        size_t len = strlen(addr);
+        if (addr[0] == '[' && len > 2 && addr[len - 1] == ']') {
+            addr[len - 1] = '\0';
+            addr++;
+        }
+        if (dns_add(srv, addr, AI_NUMERICHOST) < 0) {
+            srv->dns_count = 0;
+            return -1;
+        }
+    }
+    return srv->dns_count > 0 ? 0 : -1;
+}
+
+// Opens a control connection to the server. Its addresses are looked up
+// once per FTP_DNS_TTL for all connections, and again once none of them
+// could be reached; pinned addresses are used as given.
+static int server_connect(cftpfs_context_t *ctx, ftp_server_t *srv) {
+    struct sockaddr_storage addrs[FTP_DNS_MAX_ADDRS];
+    socklen_t lens[FTP_DNS_MAX_ADDRS];
+    bool pinned = dns_pinned(ctx, srv) != NULL;
+
+    pthread_mutex_lock(&srv->dns_lock);
+    if (srv->dns_count == 0 || (!pinned && time(NULL) - srv->dns_time >= FTP_DNS_TTL)) {
+        dns_fill(ctx, srv);
+    }
+    int count = srv->dns_count;
+    memcpy(addrs, srv->dns_addrs, count * sizeof(addrs[0]));
+    memcpy(lens, srv->dns_lens, count * sizeof(lens[0]));
+    pthread_mutex_unlock(&srv->dns_lock);
+
+    if (count == 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    int fd = -1;
+    for (int i = 0; i < count && fd < 0; i++) {
+        fd = tcp_connect_addr(ctx, (struct sockaddr *)&addrs[i], lens[i], false);
+    }
+    if (fd < 0 && !pinned) {
+        // The server may have moved
+        pthread_mutex_lock(&srv->dns_lock);
+        srv->dns_count = 0;
+        pthread_mutex_unlock(&srv->dns_lock);
+    }
+    return fd;
+}
+
+// Waits up to `timeout` seconds for fd to become readable (or writable)
+static int wait_fd(int fd, short events, int timeout) {
+    struct pollfd pfd = { fd, events, 0 };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeout * 1000);
+    } while (ret < 0 && errno == EINTR);
+    return ret > 0 ? 0 : -1;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && wait_fd(fd, POLLOUT, FTP_REPLY_TIMEOUT) == 0) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Stall detection for a data connection, as CURLOPT_LOW_SPEED_*: a
+// transfer may take as long as it needs, but is aborted once FTP_STALL_TIME
+// seconds pass without a second in which it moved FTP_STALL_SPEED bytes.
+// It is also abandoned when the FUSE request behind it is interrupted (see
+// staging_abandoned).
+typedef struct {
+    time_t last_ok;     // Last second that met the speed limit
+    time_t second;      // Second being counted
+    off_t bytes;        // Bytes moved during it
+    const staging_t *st;    // Content being downloaded, NULL otherwise
+} xfer_meter_t;
+
+static void xfer_begin(xfer_meter_t *m, const staging_t *st) {
+    m->last_ok = m->second = time(NULL);
+    m->bytes = 0;
+    m->st = st;
+}
+
+static bool xfer_stalled(xfer_meter_t *m, size_t moved) {
+    time_t now = time(NULL);
+    if (now != m->second) {
+        m->second = now;
+        m->bytes = 0;
+    }
+    m->bytes += moved;
+    if (m->bytes >= FTP_STALL_SPEED) {
+        m->last_ok = now;
+    }
+    return now - m->last_ok >= FTP_STALL_TIME;
+}
+
+// Waits for the data connection in one-second steps. Returns -1 if the
+// transfer stalled or was cancelled (conn->cancelled).
+static int xfer_wait(ftp_conn_t *conn, xfer_meter_t *m, int fd, short events) {
+    for (;;) {
+        if (staging_abandoned(m->st)) {
+            conn->cancelled = true;
+            return -1;
+        }
+        if (wait_fd(fd, events, 1) == 0) {
+            return 0;
+        }
+        if (xfer_stalled(m, 0)) {
+            return -1;
+        }
+    }
+}
+
+static ssize_t xfer_recv(ftp_conn_t *conn, xfer_meter_t *m, int fd, char *buf, size_t size) {
+    for (;;) {
+        if (xfer_wait(conn, m, fd, POLLIN) < 0) {
+            return -1;
+        }
+        ssize_t n = recv(fd, buf, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n > 0 && xfer_stalled(m, n)) {
+            return -1;
+        }
+        return n;
+    }
+}
+
+static int xfer_send(ftp_conn_t *conn, xfer_meter_t *m, int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && xfer_wait(conn, m, fd, POLLOUT) == 0) {
+                continue;
+            }
+            return -1;
+        }
+        if (xfer_stalled(m, n)) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads one control line (without CRLF) into line
+static int conn_read_line(ftp_conn_t *conn, char *line, size_t size, int timeout) {
+    for (;;) {
+        char *nl = memchr(conn->rbuf, '\n', conn->rlen);
+        if (nl) {
+            size_t len = nl - conn->rbuf;
+            size_t copy = len;
+            if (copy > 0 && conn->rbuf[copy - 1] == '\r') {
+                copy--;
+            }
+            if (copy >= size) {
+                copy = size - 1;
+            }
+            memcpy(line, conn->rbuf, copy);
+            line[copy] = '\0';
+            conn->rlen -= len + 1;
+            memmove(conn->rbuf, nl + 1, conn->rlen);
+            return 0;
+        }
+        if (conn->rlen == sizeof(conn->rbuf)) {
+            // Overlong line: drop what we have and keep looking for its end
+            conn->rlen = 0;
+        }
+        if (wait_fd(conn->fd, POLLIN, timeout) < 0) {
+            return -1;
+        }
+        ssize_t n = recv(conn->fd, conn->rbuf + conn->rlen, sizeof(conn->rbuf) - conn->rlen, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        conn->rlen += n;
+    }
+}
+
+// Reads a complete (possibly multi-line) reply and returns its code
+static int conn_read_reply_timeout(cftpfs_context_t *ctx, ftp_conn_t *conn, int timeout) {
+    char line[MAX_FTP_LINE];
+    if (conn_read_line(conn, line, sizeof(line), timeout) < 0) {
+        conn->broken = true;
+        return -1;
+    }
+    if (strlen(line) < 3 || !isdigit((unsigned char)line[0]) ||
+        !isdigit((unsigned char)line[1]) || !isdigit((unsigned char)line[2])) {
+        conn->broken = true;
+        return -1;
+    }
+
+    // Multi-line: "123-..." up to a line starting with "123 "
+    if (line[3] == '-') {
+        char code[4] = { line[0], line[1], line[2], '\0' };
+        do {
+            if (conn_read_line(conn, line, sizeof(line), timeout) < 0) {
+                conn->broken = true;
+                return -1;
+            }
+        } while (strncmp(line, code, 3) != 0 || line[3] != ' ');
+    }
+
+    if (ctx->debug) {
+        fprintf(stderr, "[DEBUG] ftp< %s\n", line);
+    }
+    strcpy(conn->reply, line);
+    conn->last_used = time(NULL);
+    int code = atoi(line);
+    if (code == 421) {
+        // "Service not available, closing control connection", typically
+        // an idle timeout announced just before the server hangs up
+        conn->broken = true;
+    }
+    return code;
+}
+
+static int conn_read_reply(cftpfs_context_t *ctx, ftp_conn_t *conn) {
+    return conn_read_reply_timeout(ctx, conn, FTP_REPLY_TIMEOUT);
+}
+
+static int conn_vsend(cftpfs_context_t *ctx, ftp_conn_t *conn, const char *fmt, va_list ap) {
+    char cmd[MAX_FTP_LINE];
+    int len = vsnprintf(cmd, sizeof(cmd) - 2, fmt, ap);
+    // A CR or LF in a path would smuggle a second command onto the channel
+    if (len < 0 || len >= (int)sizeof(cmd) - 2 || strpbrk(cmd, "\r\n")) {
+        snprintf(conn->reply, sizeof(conn->reply), "invalid command or path");
+        return -1;
+    }
+
+    if (ctx->debug) {
+        fprintf(stderr, "[DEBUG] ftp> %s\n", strncmp(cmd, "PASS ", 5) == 0 ? "PASS ****" : cmd);
+    }
+
+    memcpy(cmd + len, "\r\n", 2);
+    if (send_all(conn->fd, cmd, len + 2) < 0) {
+        conn->broken = true;
+        return -1;
+    }
+    return 0;
+}
+
+// Sends one command and returns the reply code, or -1
+static int conn_command(cftpfs_context_t *ctx, ftp_conn_t *conn, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = conn_vsend(ctx, conn, fmt, ap);
+    va_end(ap);
+    if (ret < 0) {
+        return -1;
+    }
+    return conn_read_reply(ctx, conn);
+}
+
+static void conn_close(cftpfs_context_t *ctx, ftp_conn_t *conn) {
+    if (!conn->broken) {
+        conn_command(ctx, conn, "QUIT");
+    }
+    close(conn->fd);
+    free(conn);
+}
+
+// Sends two NOOPs in one write. A server that reads the control channel
+// line by line answers both; one that discards input received while it is
+// busy answers only the first, and must get one command at a time.
+static bool pipeline_probe(cftpfs_context_t *ctx, ftp_conn_t *conn) {
+    static const char probe[] = "NOOP\r\nNOOP\r\n";
+    if (send_all(conn->fd, probe, sizeof(probe) - 1) < 0) {
+        conn->broken = true;
+        return false;
+    }
+    if (conn_read_reply(ctx, conn) != 200) {
+        return false;
+    }
+    return conn_read_reply_timeout(ctx, conn, FTP_PIPELINE_PROBE_TIMEOUT) == 200;
+}
+
+// Parses the directory out of a 257 reply: 257 "/some ""quoted"" dir"
+static void parse_pwd_reply(const char *reply, char *out, size_t size) {
+    const char *p = strchr(reply, '"');
+    size_t len = 0;
+    if (p) {
+        for (p++; *p && len < size - 1; p++) {
+            if (*p == '"') {
+                if (p[1] != '"') {
+                    break;
+                }
+                p++;
+            }
+            out[len++] = *p;
+        }
+    }
+    // Paths are joined as home + "/" + relative, so drop a trailing slash
+    while (len > 0 && out[len - 1] == '/') {
+        len--;
+    }
+    out[len] = '\0';
+}
+
+// Connects to the server and logs in. On failure *err tells whether it
+// could be reached at all.
+static ftp_conn_t* conn_open(cftpfs_context_t *ctx, ftp_server_t *srv, ftp_err_t *err) {
+    *err = FTP_ERR_PERMANENT;
+    ftp_conn_t *conn = calloc(1, sizeof(ftp_conn_t));
+    if (!conn) {
+        return NULL;
+    }
+
+    conn->fd = server_connect(ctx, srv);
+    if (conn->fd < 0) {
+        fprintf(stderr, "Error FTP connect: %s:%d: %s\n", srv->host, srv->port, strerror(errno));
+        free(conn);
+        *err = FTP_ERR_UNREACHABLE;
+        return NULL;
+    }
+
+    int code;
+    do {
+        code = conn_read_reply(ctx, conn);
+    } while (code == 120);  // "Service ready in nnn minutes"
+    if (code != 220) {
+        goto fail;
+    }
+
+    const char *user = ctx->user[0] ? ctx->user : "anonymous";
+    code = conn_command(ctx, conn, "USER %s", user);
+    if (code == 331) {
+        code = conn_command(ctx, conn, "PASS %s", ctx->password);
+    }
+    if (code != 230 && code != 202) {
+        fprintf(stderr, "Error FTP login: %s\n", conn->reply);
+        goto fail;
+    }
+
+    if (conn_command(ctx, conn, "TYPE I") != 200) {
+        goto fail;
+    }
+
+    if (conn_command(ctx, conn, "PWD") == 257) {
+        parse_pwd_reply(conn->reply, conn->home, sizeof(conn->home));
+    }
+
+    if (srv->pipelining == 0) {
+        bool ok = pipeline_probe(ctx, conn);
+        srv->pipelining = ok ? 1 : -1;
+        if (ctx->debug) {
+            fprintf(stderr, "[DEBUG] ftp: command pipelining %s on %s\n", ok ? "supported" : "not supported",
+                    srv->host);
+        }
+        if (!ok) {
+            // A reply may still be in flight, so this channel is out of step
+            conn->broken = true;
+            conn_close(ctx, conn);
+            return conn_open(ctx, srv, err);
+        }
+    }
+    conn->pipelined = srv->pipelining > 0;
+
+    return conn;
+
+fail:
+    // Greeted but not logged in: a 421 ("too many users") may pass, a 530
+    // will not. Nothing was sent that could have taken effect.
+    if (atoi(conn->reply) == 421) {
+        *err = FTP_ERR_REFUSED;
+    } else {
+        *err = conn->broken ? FTP_ERR_UNREACHABLE : ftp_reply_class(atoi(conn->reply));
+        if (*err == FTP_ERR_TRANSIENT) {
+            *err = FTP_ERR_UNREACHABLE;
+        }
+    }
+    conn_close(ctx, conn);
+    return NULL;
+}
+
+// Returns the slot's control connection, logging in if it has none.
+// *reused tells the caller whether a failure may just be a connection the
+// server dropped while it sat idle.
+static ftp_conn_t* conn_acquire(cftpfs_context_t *ctx, ftp_slot_t *slot, bool *reused) {
+    *reused = (slot->conn != NULL);
+    slot->fresh = !*reused;
+    if (!slot->conn) {
+        slot->conn = conn_open(ctx, &ctx->servers[slot->server], &slot->error);
+    }
+    return slot->conn;
+}
+
+static void conn_put(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    if (slot->conn && slot->conn->broken) {
+        conn_close(ctx, slot->conn);
+        slot->conn = NULL;
+    }
+}
+
+// Builds the absolute server path for a filesystem path
+static int remote_path(ftp_conn_t *conn, const char *path, char *out, size_t size) {
+    while (*path == '/') {
+        path++;
+    }
+    int len = snprintf(out, size, "%s/%s", conn->home, path);
+    if (len < 0 || (size_t)len >= size) {
+        return -1;
+    }
+    // Directory paths may end in "/", which some servers reject
+    while (len > 1 && out[len - 1] == '/') {
+        out[--len] = '\0';
+    }
+    return 0;
+}
+
+// Opens a passive data connection. The address in the reply is ignored in
+// favour of the control connection's peer, like CURLOPT_FTP_SKIP_PASV_IP.
+static int data_open(cftpfs_context_t *ctx, ftp_conn_t *conn) {
+    int port = -1;
+
+    if (!conn->no_epsv) {
+        int code = conn_command(ctx, conn, "EPSV");
+        if (code == 229) {
+            // 229 Entering Extended Passive Mode (|||port|)
+            const char *p = strchr(conn->reply, '(');
+            char d;
+            if (p && sscanf(p + 1, "%c%c%c%d", &d, &d, &d, &port) != 4) {
+                port = -1;
+            }
+        } else if (code >= 500) {
+            conn->no_epsv = true;
+        } else {
+            return -1;
+        }
+    }
+
+    if (port < 0) {
+        if (conn_command(ctx, conn, "PASV") != 227) {
+            return -1;
+        }
+        // 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)
+        const char *p = strchr(conn->reply, '(');
+        if (!p) {
+            p = conn->reply + 3;
+            while (*p && !isdigit((unsigned char)*p)) {
+                p++;
+            }
+        } else {
+            p++;
+        }
+        int h[4], p1, p2;
+        if (sscanf(p, "%d,%d,%d,%d,%d,%d", &h[0], &h[1], &h[2], &h[3], &p1, &p2) != 6) {
+            return -1;
+        }
+        port = p1 * 256 + p2;
+    }
+
+    if (port <= 0 || port > 65535) {
+        return -1;
+    }
+
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(conn->fd, (struct sockaddr *)&peer, &peer_len) < 0) {
+        conn->broken = true;
+        return -1;
+    }
+    if (peer.ss_family == AF_INET6) {
+        ((struct sockaddr_in6 *)&peer)->sin6_port = htons(port);
+    } else {
+        ((struct sockaddr_in *)&peer)->sin_port = htons(port);
+    }
+
+    return tcp_connect_addr(ctx, (struct sockaddr *)&peer, peer_len, true);
+}
+
+// Issues a transfer command on a fresh data connection. Returns the data fd
+// once the server has accepted the command (1xx), or -1.
+static int transfer_start(cftpfs_context_t *ctx, ftp_conn_t *conn, const char *cmd, const char *arg) {
+    int data_fd = data_open(ctx, conn);
+    if (data_fd < 0) {
+        return -1;
+    }
+    int code = arg ? conn_command(ctx, conn, "%s %s", cmd, arg) : conn_command(ctx, conn, "%s", cmd);
+    if (code < 100 || code >= 200) {
+        close(data_fd);
+        return -1;
+    }
+    return data_fd;
+}
+
+// Waits for the 226 that ends a transfer
+static int transfer_finish(cftpfs_context_t *ctx, ftp_conn_t *conn) {
+    int code = conn_read_reply(ctx, conn);
+    return (code == 226 || code == 250) ? 0 : -1;
+}
+
+// Ends a transfer whose data connection was closed early. A cancelled one
+// keeps its control connection: ABOR, then a NOOP whose reply marks the end
+// of whatever the server has to say about the transfer (426 and/or 226,
+// depending on the server and on timing). A stalled server is not waited
+// for; its connection is dropped.
+static void transfer_abort(cftpfs_context_t *ctx, ftp_conn_t *conn) {
+    static const char abor[] = "ABOR\r\n";
+    static const char noop[] = "NOOP\r\n";
+
+    if (!conn->cancelled || send_all(conn->fd, abor, sizeof(abor) - 1) < 0 ||
+        conn_read_reply_timeout(ctx, conn, FTP_ABORT_TIMEOUT) < 0 ||
+        send_all(conn->fd, noop, sizeof(noop) - 1) < 0) {
+        conn->broken = true;
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        int code = conn_read_reply_timeout(ctx, conn, FTP_ABORT_TIMEOUT);
+        if (code == 200) {
+            return;
+        }
+        if (code < 0) {
+            break;
+        }
+    }
+    conn->broken = true;
+}
+
+static int do_list(cftpfs_context_t *ctx, ftp_conn_t *conn, const char *path,
+                   ftp_item_t **items, int *count) {
+    char dir[MAX_PATH_LEN];
+    if (remote_path(conn, path, dir, sizeof(dir)) < 0) {
+        return -1;
+    }
+
+    // LIST arguments are interpreted by the server's ls emulation (globs,
+    // options), so change into the directory and list it instead
+    if (conn_command(ctx, conn, "CWD %s", dir) != 250) {
+        return -1;
+    }
+    int data_fd = transfer_start(ctx, conn, "LIST", NULL);
+    if (data_fd < 0) {
+        return -1;
+    }
+
+    response_buffer_t buf = {0};
+    buf.capacity = 65536;
+    buf.data = malloc(buf.capacity);
+    buf.ctx = ctx;
+    int ret = buf.data ? 0 : -1;
+
+    char chunk[NATIVE_IO_CHUNK];
+    xfer_meter_t meter;
+    xfer_begin(&meter, NULL);
+    bool aborted = false;
+    while (ret == 0) {
+        ssize_t n = xfer_recv(conn, &meter, data_fd, chunk, sizeof(chunk));
+        if (n < 0) {
+            aborted = true;
+            ret = -1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (write_callback(chunk, 1, n, &buf) != (size_t)n) {
+            ret = -1;
+        }
+    }
+    close(data_fd);
+
+    if (aborted) {
+        transfer_abort(ctx, conn);
+    } else if (transfer_finish(ctx, conn) < 0) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        buf.data[buf.size] = '\0';
+        ret = parse_listing_buffer(buf.data, items, count);
+    }
+    free(buf.data);
+    return ret;
+}
+
+// Downloads into st, resuming with REST when st already holds the start of
+// the file, fetched when it had the MDTM in *mtime, and MDTM still says the
+// same. On failure st keeps whatever arrived, so that a retry can resume it,
+// unless there is no MDTM to check it against.
+static int do_download(cftpfs_context_t *ctx, ftp_conn_t *conn, const char *path,
+                       staging_t *st, time_t *mtime) {
+    char file[MAX_PATH_LEN];
+    if (remote_path(conn, path, file, sizeof(file)) < 0) {
+        return -1;
+    }
+    time_t known = 0;
+    if (mtime) {
+        known = *mtime;
+        *mtime = 0;
+        if (conn_command(ctx, conn, "MDTM %s", file) == 213) {
+            parse_mdtm_reply(conn->reply, mtime);
+        }
+    }
+
+    off_t offset = 0;
+    if (known > 0 && st->size > 0 && *mtime == known) {
+        if (conn_command(ctx, conn, "REST %zu", st->size) == 350) {
+            offset = st->size;
+            if (ctx->debug) {
+                fprintf(stderr, "[DEBUG] download: %s resumed at %lld\n", path, (long long)offset);
+            }
+        } else if (conn->broken) {
+            return -1;
+        }
+    }
+    if (staging_truncate(ctx, st, offset) < 0) {
+        return -1;
+    }
+
+    char *chunk = malloc(FTP_BULK_BUFFER);
+    if (!chunk) {
+        return -1;
+    }
+    int data_fd = transfer_start(ctx, conn, "RETR", file);
+    if (data_fd < 0) {
+        free(chunk);
+        return !conn->broken && atoi(conn->reply) == 550 ? -ENOENT : -1;
+    }
+
+    int ret = 0;
+    xfer_meter_t meter;
+    xfer_begin(&meter, st);
+
+    // Never block on the temp_dir quota while holding the connection
+    st->no_wait = true;
+    for (;;) {
+        ssize_t n = xfer_recv(conn, &meter, data_fd, chunk, FTP_BULK_BUFFER);
+        if (n <= 0) {
+            ret = n < 0 ? -1 : 0;
+            break;
+        }
+        if (staging_write(ctx, st, chunk, n, offset) != n) {
+            ret = -1;
+            break;
+        }
+        offset += n;
+        autotune_bytes(ctx, n);
+        rate_take(ctx, FTP_LANE_BULK, false, n);
+    }
+    st->no_wait = false;
+    close(data_fd);
+    free(chunk);
+
+    if (ret < 0) {
+        transfer_abort(ctx, conn);
+    } else if (transfer_finish(ctx, conn) < 0) {
+        ret = -1;
+    }
+    if (ret < 0 && (!mtime || *mtime == 0)) {
+        staging_truncate(ctx, st, 0);
+    }
+    return ret;
+}
+
+// Creates every missing parent directory of file (an absolute server path)
+static void make_parents(cftpfs_context_t *ctx, ftp_conn_t *conn, const char *file) {
+    char dir[MAX_PATH_LEN];
+    strcpy(dir, file);
+    for (char *p = dir + strlen(conn->home) + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        conn_command(ctx, conn, "MKD %s", dir);
+        *p = '/';
+        if (conn->broken) {
+            return;
+        }
+    }
+}
+
+static int do_upload(cftpfs_context_t *ctx, ftp_conn_t *conn, staging_t *st, const char *path) {
+    char file[MAX_PATH_LEN];
+    if (remote_path(conn, path, file, sizeof(file)) < 0) {
+        return -1;
+    }
+
+    char *chunk = malloc(FTP_BULK_BUFFER);
+    if (!chunk) {
+        return -1;
+    }
+    int data_fd = transfer_start(ctx, conn, "STOR", file);
+    if (data_fd < 0 && !conn->broken && atoi(conn->reply) >= 400) {
+        // Same as CURLFTP_CREATE_DIR: create missing directories and retry
+        make_parents(ctx, conn, file);
+        if (!conn->broken) {
+            data_fd = transfer_start(ctx, conn, "STOR", file);
+        }
+    }
+    if (data_fd < 0) {
+        free(chunk);
+        return -1;
+    }
+
+    int ret = 0;
+    off_t offset = 0;
+    xfer_meter_t meter;
+    xfer_begin(&meter, NULL);
+    while ((size_t)offset < st->size) {
+        ssize_t n = staging_read(st, chunk, FTP_BULK_BUFFER, offset);
+        if (n <= 0 || xfer_send(conn, &meter, data_fd, chunk, n) < 0) {
+            ret = -1;
+            break;
+        }
+        offset += n;
+        autotune_bytes(ctx, n);
+        rate_take(ctx, FTP_LANE_BULK, true, n);
+    }
+    close(data_fd);
+    free(chunk);
+
+    if (ret < 0) {
+        transfer_abort(ctx, conn);
+    } else if (transfer_finish(ctx, conn) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+// Formats "VERB /server/path" for a batch entry, or returns -1
+static int batch_format(ftp_conn_t *conn, const ftp_batch_cmd_t *cmd, char *out, size_t size) {
+    char target[MAX_PATH_LEN];
+    if (remote_path(conn, cmd->path, target, sizeof(target)) < 0) {
+        return -1;
+    }
+    int len = snprintf(out, size, "%s %s", cmd->verb, target);
+    if (len < 0 || (size_t)len >= size || strpbrk(out, "\r\n")) {
+        return -1;
+    }
+    return len;
+}
+
+static void batch_record(ftp_conn_t *conn, ftp_batch_cmd_t *cmd, int code) {
+    cmd->code = code;
+    // The reply is cut to fit; a date or size is early in it
+    snprintf(cmd->reply, sizeof(cmd->reply), "%.*s", (int)sizeof(cmd->reply) - 1, conn->reply);
+}
+
+// Writes up to FTP_BATCH_WINDOW commands back to back, then reads their
+// replies in order, so a window costs one round trip instead of one per
+// command. Falls back to lock-step when the server failed the probe.
+static int do_batch(cftpfs_context_t *ctx, ftp_conn_t *conn, ftp_batch_cmd_t *cmds, int count) {
+    for (int i = 0; i < count; i++) {
+        cmds[i].code = -1;
+        cmds[i].reply[0] = '\0';
+    }
+
+    if (!conn->pipelined) {
+        for (int i = 0; i < count; i++) {
+            char line[MAX_FTP_LINE];
+            if (batch_format(conn, &cmds[i], line, sizeof(line)) < 0) {
+                continue;
+            }
+            int code = conn_command(ctx, conn, "%s", line);
+            if (conn->broken) {
+                return -1;
+            }
+            batch_record(conn, &cmds[i], code);
+        }
+        return 0;
+    }
+
+    char *buf = malloc(FTP_BATCH_WINDOW * MAX_FTP_LINE);
+    if (!buf) {
+        return -1;
+    }
+
+    int ret = 0;
+    for (int start = 0; start < count && ret == 0; start += FTP_BATCH_WINDOW) {
+        int end = start + FTP_BATCH_WINDOW < count ? start + FTP_BATCH_WINDOW : count;
+        bool sent[FTP_BATCH_WINDOW];
+        size_t len = 0;
+
+        for (int i = start; i < end; i++) {
+            int n = batch_format(conn, &cmds[i], buf + len, MAX_FTP_LINE - 2);
+            sent[i - start] = (n >= 0);
+            if (n < 0) {
+                continue;
+            }
+            if (ctx->debug) {
+                fprintf(stderr, "[DEBUG] ftp> %s\n", buf + len);
+            }
+            memcpy(buf + len + n, "\r\n", 2);
+            len += n + 2;
+        }
+
+        if (send_all(conn->fd, buf, len) < 0) {
+            conn->broken = true;
+            ret = -1;
+            break;
+        }
+
+        for (int i = start; i < end; i++) {
+            if (!sent[i - start]) {
+                continue;
+            }
+            int code = conn_read_reply(ctx, conn);
+            if (code < 0) {
+                ret = -1;
+                break;
+            }
+            batch_record(conn, &cmds[i], code);
+        }
+    }
+
+    free(buf);
+    return ret;
+}
+
+static int do_simple(cftpfs_context_t *ctx, ftp_conn_t *conn, const char *cmd,
+                     const char *path, int expect) {
+    char target[MAX_PATH_LEN];
+    if (remote_path(conn, path, target, sizeof(target)) < 0) {
+        return -1;
+    }
+    return conn_command(ctx, conn, "%s %s", cmd, target) == expect ? 0 : -1;
+}
+
+static int do_rename(cftpfs_context_t *ctx, ftp_conn_t *conn, const char *old_path, const char *new_path) {
+    char from[MAX_PATH_LEN];
+    char to[MAX_PATH_LEN];
+    if (remote_path(conn, old_path, from, sizeof(from)) < 0 ||
+        remote_path(conn, new_path, to, sizeof(to)) < 0) {
+        return -1;
+    }
+    if (conn_command(ctx, conn, "RNFR %s", from) != 350) {
+        return -1;
+    }
+    return conn_command(ctx, conn, "RNTO %s", to) == 250 ? 0 : -1;
+}
+
+// Operation dispatch, so every entry point shares the acquire/retry logic
+typedef enum {
+    OP_LIST, OP_DOWNLOAD, OP_UPLOAD, OP_DELETE, OP_MKDIR, OP_RMDIR, OP_RENAME, OP_BATCH, OP_NOOP
+} native_op_t;
+
+typedef struct {
+    native_op_t op;
+    const char *path;
+    const char *path2;
+    staging_t *st;
+    ftp_item_t **items;
+    int *count;
+    time_t *mtime;
+    ftp_batch_cmd_t *cmds;
+    int cmd_count;
+} native_req_t;
+
+static int run_op(cftpfs_context_t *ctx, ftp_conn_t *conn, native_req_t *req) {
+    switch (req->op) {
+        case OP_LIST:     return do_list(ctx, conn, req->path, req->items, req->count);
+        case OP_DOWNLOAD: return do_download(ctx, conn, req->path, req->st, req->mtime);
+        case OP_UPLOAD:   return do_upload(ctx, conn, req->st, req->path);
+        case OP_DELETE:   return do_simple(ctx, conn, "DELE", req->path, 250);
+        case OP_MKDIR:    return do_simple(ctx, conn, "MKD", req->path, 257);
+        case OP_RMDIR:    return do_simple(ctx, conn, "RMD", req->path, 250);
+        case OP_RENAME:   return do_rename(ctx, conn, req->path, req->path2);
+        case OP_BATCH:    return do_batch(ctx, conn, req->cmds, req->cmd_count);
+        case OP_NOOP:     return conn_command(ctx, conn, "NOOP") == 200 ? 0 : -1;
+    }
+    return -1;
+}
+
+static int native_run(cftpfs_context_t *ctx, ftp_slot_t *slot, native_req_t *req) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused;
+        ftp_conn_t *conn = conn_acquire(ctx, slot, &reused);
+        if (!conn) {
+            return -1;
+        }
+
+        time_t idle = time(NULL) - conn->last_used;
+        conn->cancelled = false;
+        int ret = run_op(ctx, conn, req);
+        bool broken = conn->broken;
+        if (ret < 0) {
+            if (conn->cancelled) {
+                slot->error = FTP_ERR_CANCELLED;
+            } else {
+                slot->error = broken ? FTP_ERR_TRANSIENT : ftp_reply_class(atoi(conn->reply));
+            }
+            if (!broken && !conn->cancelled) {
+                fprintf(stderr, "Error FTP: %s\n", conn->reply);
+            }
+        }
+        conn_put(ctx, slot);
+
+        // An idle connection may have been closed by the server; try once
+        // more on a fresh one before reporting the failure
+        if (ret == 0 || !broken || !reused || slot->error == FTP_ERR_CANCELLED) {
+            return ret;
+        }
+        keepalive_note_drop(ctx, idle);
+    }
+    return -1;
+}
+
+// A pinned --resolve list is parsed here, so a bad address fails the mount
+int ftp_native_init(cftpfs_context_t *ctx) {
+    for (int i = 0; i < ctx->server_count; i++) {
+        pthread_mutex_init(&ctx->servers[i].dns_lock, NULL);
+        ctx->servers[i].dns_count = 0;
+        ctx->servers[i].pipelining = 0;
+    }
+    if (ctx->resolve[0] && dns_fill(ctx, &ctx->servers[0]) < 0) {
+        fprintf(stderr, "Error: invalid address in --resolve: %s\n", ctx->resolve);
+        ftp_native_cleanup(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+void ftp_native_cleanup(cftpfs_context_t *ctx) {
+    for (int i = 0; i < ctx->server_count; i++) {
+        pthread_mutex_destroy(&ctx->servers[i].dns_lock);
+    }
+}
+
+// Logs out and closes the slot's connection
+void ftp_native_close(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    if (slot->conn) {
+        conn_close(ctx, slot->conn);
+        slot->conn = NULL;
+    }
+}
+
+// An idle control connection has nothing to read unless the server is
+// announcing that it hangs up (421) or already has
+bool ftp_native_alive(ftp_slot_t *slot) {
+    if (!slot->conn || slot->conn->broken || slot->conn->rlen > 0) {
+        return false;
+    }
+    return wait_fd(slot->conn->fd, POLLIN, 0) < 0;
+}
+
+int ftp_native_list_dir(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path, ftp_item_t **items, int *count) {
+    native_req_t req = { .op = OP_LIST, .path = path, .items = items, .count = count };
+    return native_run(ctx, slot, &req);
+}
+
+int ftp_native_download(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *remote_path, staging_t *st, time_t *mtime) {
+    native_req_t req = { .op = OP_DOWNLOAD, .path = remote_path, .st = st, .mtime = mtime };
+    return native_run(ctx, slot, &req);
+}
+
+int ftp_native_upload(cftpfs_context_t *ctx, ftp_slot_t *slot, staging_t *st, const char *remote_path) {
+    native_req_t req = { .op = OP_UPLOAD, .path = remote_path, .st = st };
+    return native_run(ctx, slot, &req);
+}
+
+int ftp_native_delete(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path) {
+    native_req_t req = { .op = OP_DELETE, .path = path };
+    return native_run(ctx, slot, &req) == 0 ? 0 : -EIO;
+}
+
+int ftp_native_mkdir(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path) {
+    native_req_t req = { .op = OP_MKDIR, .path = path };
+    return native_run(ctx, slot, &req) == 0 ? 0 : -EIO;
+}
+
+int ftp_native_rmdir(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *path) {
+    native_req_t req = { .op = OP_RMDIR, .path = path };
+    return native_run(ctx, slot, &req) == 0 ? 0 : -EIO;
+}
+
+int ftp_native_rename(cftpfs_context_t *ctx, ftp_slot_t *slot, const char *old_path, const char *new_path) {
+    native_req_t req = { .op = OP_RENAME, .path = old_path, .path2 = new_path };
+    return native_run(ctx, slot, &req) == 0 ? 0 : -EIO;
+}
+
+int ftp_native_batch(cftpfs_context_t *ctx, ftp_slot_t *slot, ftp_batch_cmd_t *cmds, int count) {
+    native_req_t req = { .op = OP_BATCH, .cmds = cmds, .cmd_count = count };
+    return native_run(ctx, slot, &req);
+}
+
+int ftp_native_noop(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    native_req_t req = { .op = OP_NOOP };
+    return native_run(ctx, slot, &req);
+}
@@ -1,69 +1,173 @@
 /**
  * handles.c - File handle management
+ *
+ * Handles live in a table of fixed-size slabs that grows on demand. Free
+ * slots are chained in an intrusive free list so allocation and release are
+ * O(1), and every slot carries a generation counter that is encoded in the
+ * handle ID to detect stale fi->fh values.
  */
 
 #include "cftpfs.h"
-#include <sys/stat.h>
+
+#define HANDLE_NONE UINT32_MAX
+
+static inline uint64_t make_handle_id(uint32_t index, uint32_t generation) {
+    return ((uint64_t)generation << 32) | index;
+}
+
+static inline handle_slot_t* slot_at(cftpfs_context_t *ctx, uint32_t index) {
+    return &ctx->handle_slabs[index / HANDLE_SLAB_SIZE][index % HANDLE_SLAB_SIZE];
+}
+
+// Adds one slab to the table and threads its slots onto the free list.
+// Must be called with handles_lock held.
+static int handles_grow(cftpfs_context_t *ctx) {
+    if ((uint64_t)(ctx->handle_slab_count + 1) * HANDLE_SLAB_SIZE > HANDLE_TABLE_MAX) {
+        return -1;
+    }
+
+    if (ctx->handle_slab_count == ctx->handle_slab_capacity) {
+        uint32_t new_capacity = ctx->handle_slab_capacity ? ctx->handle_slab_capacity * 2 : 4;
+        handle_slot_t **slabs = realloc(ctx->handle_slabs, new_capacity * sizeof(handle_slot_t *));
+        if (!slabs) {
+            return -1;
+        }
+        ctx->handle_slabs = slabs;
+        ctx->handle_slab_capacity = new_capacity;
+    }
+
+    handle_slot_t *slab = calloc(HANDLE_SLAB_SIZE, sizeof(handle_slot_t));
+    if (!slab) {
+        return -1;
+    }
+
+    uint32_t base = ctx->handle_slab_count * HANDLE_SLAB_SIZE;
+    for (uint32_t i = 0; i < HANDLE_SLAB_SIZE; i++) {
+        slab[i].generation = 1;
+        slab[i].next_free = (i + 1 < HANDLE_SLAB_SIZE) ? base + i + 1 : ctx->handle_free;
+    }
+
+    ctx->handle_slabs[ctx->handle_slab_count++] = slab;
+    ctx->handle_free = base;
+
+    return 0;
+}
+
+void handles_init(cftpfs_context_t *ctx) {
+    ctx->handle_slabs = NULL;
+    ctx->handle_slab_count = 0;
+    ctx->handle_slab_capacity = 0;
+    ctx->handle_free = HANDLE_NONE;
+    ctx->handle_count = 0;
+    pthread_mutex_init(&ctx->handles_lock, NULL);
+}
+
+void handles_cleanup(cftpfs_context_t *ctx) {
+    pthread_mutex_lock(&ctx->handles_lock);
+
+    for (uint32_t s = 0; s < ctx->handle_slab_count; s++) {
+        for (uint32_t i = 0; i < HANDLE_SLAB_SIZE; i++) {
+            handle_slot_t *slot = &ctx->handle_slabs[s][i];
+            if (!slot->in_use) {
+                continue;
+            }
+            open_file_release(ctx, slot->fh.of);
+            path_unintern(ctx, slot->fh.path);
+        }
+        free(ctx->handle_slabs[s]);
+    }
+    free(ctx->handle_slabs);
+    ctx->handle_slabs = NULL;
+    ctx->handle_slab_count = 0;
+    ctx->handle_slab_capacity = 0;
+    ctx->handle_free = HANDLE_NONE;
+    ctx->handle_count = 0;
+
+    pthread_mutex_unlock(&ctx->handles_lock);
+    pthread_mutex_destroy(&ctx->handles_lock);
+}
 
 file_handle_t* handle_create(cftpfs_context_t *ctx, const char *path, int flags) {
-    file_handle_t *fh = calloc(1, sizeof(file_handle_t));
-    if (!fh) {
+    const char *interned = path_intern(ctx, path);
+    if (!interned) {
+        errno = ENOMEM;
         return NULL;
     }
-    
-    strncpy(fh->path, path, MAX_PATH_LEN - 1);
-    fh->path[MAX_PATH_LEN - 1] = '\0';
+
+    pthread_mutex_lock(&ctx->handles_lock);
+
+    if (ctx->handle_free == HANDLE_NONE && handles_grow(ctx) < 0) {
+        pthread_mutex_unlock(&ctx->handles_lock);
+        path_unintern(ctx, interned);
+        errno = EMFILE;
+        return NULL;
+    }
+
+    uint32_t index = ctx->handle_free;
+    handle_slot_t *slot = slot_at(ctx, index);
+    ctx->handle_free = slot->next_free;
+    slot->in_use = true;
+    ctx->handle_count++;
+
+    pthread_mutex_unlock(&ctx->handles_lock);
+
+    file_handle_t *fh = &slot->fh;
+    memset(fh, 0, sizeof(*fh));
+    fh->id = make_handle_id(index, slot->generation);
+    fh->path = interned;
     fh->flags = flags;
-    fh->fd = -1;
-    fh->dirty = false;
-    fh->is_new = false;
-    
-    // Create temporary file
-    snprintf(fh->temp_path, MAX_PATH_LEN, "%s/fh_%d_%ld_%p", 
-             ctx->temp_dir, getpid(), (long)time(NULL), (void*)fh);
-    
-    // Create empty file
-    int fd = open(fh->temp_path, O_CREAT | O_RDWR, 0600);
-    if (fd < 0) {
-        free(fh);
+
+    // Attach to the content shared by every handle open on this path
+    fh->of = open_file_acquire(ctx, path);
+    if (!fh->of) {
+        int saved_errno = errno;
+        handle_release(ctx, fh->id);
+        errno = saved_errno;
         return NULL;
     }
-    close(fd);
-    
-    pthread_mutex_init(&fh->lock, NULL);
-    
+
     return fh;
 }
 
-file_handle_t* handle_get(cftpfs_context_t *ctx, int fh_id) {
-    if (fh_id < 0 || fh_id >= MAX_HANDLES) {
-        return NULL;
-    }
-    
+file_handle_t* handle_get(cftpfs_context_t *ctx, uint64_t fh_id) {
+    uint32_t index = (uint32_t)fh_id;
+    uint32_t generation = (uint32_t)(fh_id >> 32);
+    file_handle_t *fh = NULL;
+
     pthread_mutex_lock(&ctx->handles_lock);
-    file_handle_t *fh = ctx->file_handles[fh_id];
+    if (index < ctx->handle_slab_count * HANDLE_SLAB_SIZE) {
+        handle_slot_t *slot = slot_at(ctx, index);
+        if (slot->in_use && slot->generation == generation) {
+            fh = &slot->fh;
+        }
+    }
     pthread_mutex_unlock(&ctx->handles_lock);
-    
+
     return fh;
 }
 
-void handle_release(cftpfs_context_t *ctx, int fh_id) {
-    if (fh_id < 0 || fh_id >= MAX_HANDLES) {
-        return;
-    }
-    
-    file_handle_t *fh = ctx->file_handles[fh_id];
+void handle_release(cftpfs_context_t *ctx, uint64_t fh_id) {
+    file_handle_t *fh = handle_get(ctx, fh_id);
     if (!fh) {
         return;
     }
-    
-    pthread_mutex_destroy(&fh->lock);
-    
-    // Remove temporary file
-    if (strlen(fh->temp_path) > 0) {
-        unlink(fh->temp_path);
+
+    open_file_release(ctx, fh->of);
+    fh->of = NULL;
+    path_unintern(ctx, fh->path);
+    fh->path = NULL;
+
+    uint32_t index = (uint32_t)fh_id;
+
+    pthread_mutex_lock(&ctx->handles_lock);
+    handle_slot_t *slot = slot_at(ctx, index);
+    slot->in_use = false;
+    // Skip generation 0 on wrap so an ID is never 0 (fi->fh of handle-less opens)
+    if (++slot->generation == 0) {
+        slot->generation = 1;
     }
-    
-    free(fh);
-    ctx->file_handles[fh_id] = NULL;
-}
\ No newline at end of file
+    slot->next_free = ctx->handle_free;
+    ctx->handle_free = index;
+    ctx->handle_count--;
+    pthread_mutex_unlock(&ctx->handles_lock);
+}
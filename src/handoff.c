@@ -0,0 +1,685 @@
+/**
+ * handoff.c - Hot restart: caches handed to the next process (--handoff)
+ *
+ * A process started with --handoff=SOCKET listens on SOCKET. A new process
+ * started with the same option and mountpoint first connects there and
+ * asks for the mount. The running one then passes on the state a restart
+ * would lose:
+ *
+ *   - the directory listings, with their age;
+ *   - the content cache. Content in memory is copied. Content spilled to
+ *     disk is passed as its open file descriptor (SCM_RIGHTS), so not a
+ *     byte of it is copied.
+ *
+ * It then detaches its mount (lazy unmount), and the new process mounts in
+ * its place and listens on SOCKET for the next restart.
+ *
+ * The FUSE connection itself cannot change hands. libfuse only starts a
+ * session with the kernel's INIT request, which the new process would
+ * never get. Instead, files that are open keep working through the old
+ * process, whose detached mount goes on serving them until they are
+ * closed. Its session then ends and it exits. New opens go to the new
+ * process. Until then it must not unmount by path, which would now hit the
+ * new mount: a single mount ignores SIGINT and SIGTERM after a handoff
+ * (SIGKILL ends it and fails its open files), and the daemon waits for the
+ * mounts it handed over to drain.
+ *
+ * Every context of the mount is passed on, the host's and each mount table
+ * backend's. Contexts are matched by mount table directory, host and port,
+ * so a backend whose entry changed starts out empty.
+ */
+
+#include "cftpfs.h"
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mount.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+#define HANDOFF_VERSION 1
+#define HANDOFF_BUFFER (64 * 1024)
+
+// Records after the version; contents and listings follow their context
+enum {
+    HANDOFF_CONTEXT = 'C',      // key (table directory, "" for the host), host, port
+    HANDOFF_LISTING = 'D',      // path, timestamp, count, then the items
+    HANDOFF_CONTENT = 'F',      // path, flags, size, times, then the bytes or an fd
+    HANDOFF_END = 'E'
+};
+
+#define HANDOFF_LOADED 1        // Complete content, not the start of a download
+#define HANDOFF_ON_DISK 2       // Passed as a file descriptor
+
+typedef struct handoff_mount {
+    char mountpoint[MAX_PATH_LEN];
+    cftpfs_context_t *root;
+    bool given;                 // Handed to another process
+    struct handoff_mount *next;
+} handoff_mount_t;
+
+static struct {
+    int listen_fd;              // -1 without --handoff
+    bool keep_signals;          // The daemon takes signals with sigwait
+    bool started;
+    pthread_t thread;
+    handoff_mount_t *mounts;
+    pthread_mutex_t lock;       // Protects mounts
+} state = { .listen_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Buffered output; fds go out with a byte of their own
+typedef struct {
+    int fd;
+    char buf[HANDOFF_BUFFER];
+    size_t len;
+    bool failed;
+} handoff_writer_t;
+
+// Buffered input, collecting the fds that come along in arrival order
+typedef struct {
+    int fd;
+    char buf[HANDOFF_BUFFER];
+    size_t pos;
+    size_t len;
+    int *fds;
+    int fd_count;
+    int fd_next;
+} handoff_reader_t;
+
+static void out_flush(handoff_writer_t *w) {
+    size_t done = 0;
+    while (!w->failed && done < w->len) {
+        ssize_t n = send(w->fd, w->buf + done, w->len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno != EINTR) {
+            w->failed = true;
+        } else if (n > 0) {
+            done += n;
+        }
+    }
+    w->len = 0;
+}
+
+static void out(handoff_writer_t *w, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0 && !w->failed) {
+        if (w->len == sizeof(w->buf)) {
+            out_flush(w);
+        }
+        size_t n = sizeof(w->buf) - w->len < size ? sizeof(w->buf) - w->len : size;
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+        p += n;
+        size -= n;
+    }
+}
+
+static void out_u64(handoff_writer_t *w, uint64_t value) {
+    out(w, &value, sizeof(value));
+}
+
+static void out_str(handoff_writer_t *w, const char *str) {
+    uint32_t len = strlen(str);
+    out(w, &len, sizeof(len));
+    out(w, str, len);
+}
+
+static void out_fd(handoff_writer_t *w, int fd) {
+    out_flush(w);
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    while (!w->failed && sendmsg(w->fd, &msg, MSG_NOSIGNAL) < 0) {
+        w->failed = errno != EINTR;
+    }
+}
+
+static int in_fill(handoff_reader_t *r) {
+    union {
+        char buf[CMSG_SPACE(16 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = r->buf, .iov_len = sizeof(r->buf) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t n;
+    do {
+        n = recvmsg(r->fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return -1;
+    }
+    r->pos = 0;
+    r->len = n;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *grown = realloc(r->fds, (r->fd_count + count) * sizeof(int));
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (grown) {
+                grown[r->fd_count++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+        if (grown) {
+            r->fds = grown;
+        }
+    }
+    return 0;
+}
+
+static int in(handoff_reader_t *r, void *data, size_t size) {
+    char *p = data;
+    while (size > 0) {
+        if (r->pos == r->len && in_fill(r) < 0) {
+            return -1;
+        }
+        size_t n = r->len - r->pos < size ? r->len - r->pos : size;
+        memcpy(p, r->buf + r->pos, n);
+        r->pos += n;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int in_u64(handoff_reader_t *r, uint64_t *value) {
+    return in(r, value, sizeof(*value));
+}
+
+static int in_str(handoff_reader_t *r, char *str, size_t size) {
+    uint32_t len;
+    if (in(r, &len, sizeof(len)) < 0 || len >= size || in(r, str, len) < 0) {
+        return -1;
+    }
+    str[len] = '\0';
+    return 0;
+}
+
+// The fd sent with the next byte
+static int in_fd(handoff_reader_t *r, int *fd) {
+    char byte;
+    if (in(r, &byte, 1) < 0 || r->fd_next == r->fd_count) {
+        return -1;
+    }
+    *fd = r->fds[r->fd_next++];
+    return 0;
+}
+
+// Sends a context's listings and cached content, which it loses
+static void handoff_send_context(handoff_writer_t *w, cftpfs_context_t *ctx, const char *key) {
+    char type = HANDOFF_CONTEXT;
+    out(w, &type, 1);
+    out_str(w, key);
+    out_str(w, ctx->host);
+    out_u64(w, ctx->port);
+
+    cache_entry_t *entry = cache_take(ctx);
+    while (entry) {
+        type = HANDOFF_LISTING;
+        out(w, &type, 1);
+        out_str(w, entry->path);
+        out_u64(w, entry->timestamp);
+        out_u64(w, entry->item_count);
+        for (int i = 0; i < entry->item_count; i++) {
+            ftp_item_t *item = &entry->items[i];
+            out_str(w, item->name);
+            out_u64(w, item->type);
+            out_u64(w, item->size);
+            out_u64(w, item->mtime);
+            out_u64(w, item->mode);
+        }
+        cache_entry_t *next = entry->next;
+        free(entry->items);
+        free(entry);
+        entry = next;
+    }
+
+    int sent = 0;
+    open_file_t *of = open_file_take_cached(ctx);
+    while (of) {
+        bool on_disk = of->data.fd >= 0;
+        type = HANDOFF_CONTENT;
+        out(w, &type, 1);
+        out_str(w, of->path);
+        out_u64(w, (of->loaded ? HANDOFF_LOADED : 0) | (on_disk ? HANDOFF_ON_DISK : 0));
+        out_u64(w, of->data.size);
+        out_u64(w, of->loaded_at);
+        out_u64(w, of->remote_mtime);
+        if (on_disk) {
+            out_fd(w, of->data.fd);
+        } else {
+            out(w, of->data.data, of->data.size);
+        }
+        sent++;
+        open_file_t *next = of->lru_next;
+        open_file_discard(ctx, of);
+        of = next;
+    }
+
+    if (ctx->debug) {
+        fprintf(stderr, "[DEBUG] handoff: %s:%d, %d cached files\n", ctx->host, ctx->port, sent);
+    }
+}
+
+// Finds the context the records of key, host and port belong to; NULL if
+// this mount has none like it
+static cftpfs_context_t* handoff_match(cftpfs_context_t *root, const char *key, const char *host, int port) {
+    cftpfs_context_t *ctx = NULL;
+    if (key[0] == '\0') {
+        ctx = root;
+    }
+    for (int i = 0; !ctx && i < root->shard_count; i++) {
+        if (strcmp(root->shards[i].name, key) == 0) {
+            ctx = root->shards[i].ctx;
+        }
+    }
+    return ctx && strcmp(ctx->host, host) == 0 && ctx->port == port ? ctx : NULL;
+}
+
+// Reads one listing into ctx's cache, or past it without ctx
+static int handoff_read_listing(handoff_reader_t *r, cftpfs_context_t *ctx) {
+    char path[MAX_PATH_LEN];
+    uint64_t timestamp, count;
+    if (in_str(r, path, sizeof(path)) < 0 || in_u64(r, &timestamp) < 0 || in_u64(r, &count) < 0 ||
+        count > INT32_MAX) {
+        return -1;
+    }
+    ftp_item_t *items = count > 0 ? calloc(count, sizeof(ftp_item_t)) : NULL;
+    if (count > 0 && !items) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t type, size, mtime, mode;
+        if (in_str(r, items[i].name, sizeof(items[i].name)) < 0 || in_u64(r, &type) < 0 ||
+            in_u64(r, &size) < 0 || in_u64(r, &mtime) < 0 || in_u64(r, &mode) < 0) {
+            free(items);
+            return -1;
+        }
+        items[i].type = type;
+        items[i].size = size;
+        items[i].mtime = mtime;
+        items[i].mode = mode;
+    }
+    if (ctx) {
+        cache_put_at(ctx, path, items, count, timestamp);
+    } else {
+        free(items);
+    }
+    return 0;
+}
+
+// Reads one cached file into ctx's content cache, or past it. Content that
+// does not fit this process's limits is dropped.
+static int handoff_read_content(handoff_reader_t *r, cftpfs_context_t *ctx) {
+    char path[MAX_PATH_LEN];
+    uint64_t flags, size, loaded_at, remote_mtime;
+    if (in_str(r, path, sizeof(path)) < 0 || in_u64(r, &flags) < 0 || in_u64(r, &size) < 0 ||
+        in_u64(r, &loaded_at) < 0 || in_u64(r, &remote_mtime) < 0) {
+        return -1;
+    }
+
+    staging_t data;
+    staging_init(&data);
+    if (flags & HANDOFF_ON_DISK) {
+        if (in_fd(r, &data.fd) < 0) {
+            return -1;
+        }
+        data.size = size;
+        // Never wait for room: nothing is being served yet
+        data.no_wait = true;
+        if (!ctx || staging_reserve(ctx, &data, size) < 0) {
+            close(data.fd);
+            return 0;
+        }
+        data.no_wait = false;
+    } else {
+        data.data = size > 0 ? malloc(size) : NULL;
+        if (size > 0 && !data.data) {
+            return -1;
+        }
+        if (in(r, data.data, size) < 0) {
+            free(data.data);
+            return -1;
+        }
+        data.size = data.capacity = size;
+    }
+
+    if (!ctx) {
+        free(data.data);
+    } else if (size > ctx->shared->content_cache_max ||
+               open_file_adopt(ctx, path, &data, flags & HANDOFF_LOADED, loaded_at, remote_mtime) < 0) {
+        staging_free(ctx, &data);
+    }
+    return 0;
+}
+
+// Detaches the mount without closing its FUSE connection, which serves the
+// files still open until the last is closed
+static int handoff_detach(const char *mountpoint) {
+    if (geteuid() == 0) {
+        return umount2(mountpoint, MNT_DETACH) == 0 ? 0 : -errno;
+    }
+    char *argv[] = { "fusermount3", "-u", "-z", "-q", "--", (char *)mountpoint, NULL };
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+    if (err != 0) {
+        return -err;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -errno;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -EPERM;
+}
+
+// Serves one "takeover MOUNTPOINT" request
+static void handoff_serve(int fd) {
+    char line[MAX_PATH_LEN + 16];
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(line) - 1 && (n = read(fd, line + len, sizeof(line) - 1 - len)) > 0) {
+        len += n;
+        if (memchr(line, '\n', len)) {
+            break;
+        }
+    }
+    line[len] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+    const char *mountpoint = strncmp(line, "takeover ", 9) == 0 ? line + 9 : NULL;
+
+    // Claimed under the lock, so that two new processes cannot both get it
+    handoff_mount_t *m = NULL;
+    pthread_mutex_lock(&state.lock);
+    for (handoff_mount_t *c = state.mounts; c && mountpoint; c = c->next) {
+        if (!c->given && strcmp(c->mountpoint, mountpoint) == 0) {
+            c->given = true;
+            m = c;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&state.lock);
+
+    handoff_writer_t *w = calloc(1, sizeof(handoff_writer_t));
+    if (!w) {
+        // Nothing was sent, the new process starts from scratch
+        if (m) {
+            pthread_mutex_lock(&state.lock);
+            m->given = false;
+            pthread_mutex_unlock(&state.lock);
+        }
+        return;
+    }
+    w->fd = fd;
+    out_u64(w, m ? HANDOFF_VERSION : 0);
+    if (!m) {
+        out_flush(w);
+        free(w);
+        return;
+    }
+
+    cftpfs_context_t *root = m->root;
+    handoff_send_context(w, root, "");
+    for (int i = 0; i < root->shard_count; i++) {
+        handoff_send_context(w, root->shards[i].ctx, root->shards[i].name);
+    }
+    char type = HANDOFF_END;
+    out(w, &type, 1);
+    out_flush(w);
+    bool failed = w->failed;
+    free(w);
+
+    // The new process has read everything and waits for the mountpoint
+    char go;
+    int32_t result = -EPROTO;
+    if (!failed && read(fd, &go, 1) == 1) {
+        result = handoff_detach(m->mountpoint);
+    }
+    if (write(fd, &result, sizeof(result)) < 0 || result < 0) {
+        fprintf(stderr, "Warning: handoff of %s failed: %s\n", m->mountpoint, strerror(-result));
+        pthread_mutex_lock(&state.lock);
+        m->given = false;
+        pthread_mutex_unlock(&state.lock);
+        return;
+    }
+    if (!state.keep_signals) {
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+    }
+    printf("Handed %s over to the new process, serving its open files until closed\n", m->mountpoint);
+}
+
+static void* handoff_main(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        int fd = accept(state.listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        handoff_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+// The mountpoint as both processes name it
+static void handoff_canonical(const char *mountpoint, char *out, size_t size) {
+    char resolved[PATH_MAX];
+    const char *name = realpath(mountpoint, resolved) ? resolved : mountpoint;
+    snprintf(out, size, "%s", name);
+}
+
+// Takes over the caches of mountpoint from the process listening on
+// socket, which then detaches its mount. Returns 0 if there is no such
+// process or it does not serve mountpoint, -1 if the handoff failed.
+int handoff_receive(const char *socket_path, const char *mountpoint, cftpfs_context_t *root) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: handoff socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        // Nothing running: a plain start
+        close(fd);
+        return 0;
+    }
+
+    char canonical[MAX_PATH_LEN];
+    handoff_canonical(mountpoint, canonical, sizeof(canonical));
+    char request[MAX_PATH_LEN + 16];
+    int len = snprintf(request, sizeof(request), "takeover %s\n", canonical);
+    handoff_reader_t *r = calloc(1, sizeof(handoff_reader_t));
+    if (!r || write(fd, request, len) != len) {
+        free(r);
+        close(fd);
+        return -1;
+    }
+    r->fd = fd;
+
+    uint64_t version;
+    int ret = in_u64(r, &version);
+    if (ret == 0 && version == HANDOFF_VERSION) {
+        cftpfs_context_t *ctx = NULL;
+        int files = 0;
+        char type;
+        while ((ret = in(r, &type, 1)) == 0 && type != HANDOFF_END) {
+            if (type == HANDOFF_CONTEXT) {
+                char key[256], host[256];
+                uint64_t port;
+                ret = in_str(r, key, sizeof(key)) < 0 || in_str(r, host, sizeof(host)) < 0 ||
+                      in_u64(r, &port) < 0 ? -1 : 0;
+                ctx = ret == 0 ? handoff_match(root, key, host, port) : NULL;
+            } else if (type == HANDOFF_LISTING) {
+                ret = handoff_read_listing(r, ctx);
+            } else if (type == HANDOFF_CONTENT) {
+                ret = handoff_read_content(r, ctx);
+                files += ret == 0 && ctx;
+            } else {
+                ret = -1;
+            }
+            if (ret < 0) {
+                break;
+            }
+        }
+
+        // The old process lets go of the mountpoint only now
+        int32_t result = -EPROTO;
+        char go = 'G';
+        if (ret == 0 && (write(fd, &go, 1) != 1 || in(r, &result, sizeof(result)) < 0 || result < 0)) {
+            ret = -1;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Error: handoff of %s failed: %s\n", mountpoint, strerror(-result));
+        } else {
+            printf("Took over %s from the running process (%d cached files)\n", mountpoint, files);
+            shared_content_trim(root->shared);
+        }
+    } else if (ret == 0) {
+        // The running process does not serve this mountpoint
+        ret = 0;
+    }
+
+    // Descriptors that arrived but were not used
+    for (int i = r->fd_next; i < r->fd_count; i++) {
+        close(r->fds[i]);
+    }
+    free(r->fds);
+    free(r);
+    close(fd);
+    return ret;
+}
+
+// Listens on socket for the next process. Called once the mounts have
+// been received, since the socket replaces the old process's.
+// keep_signals leaves signal handling alone after a handoff.
+int handoff_listen(const char *socket_path, bool keep_signals) {
+    state.keep_signals = keep_signals;
+    state.listen_fd = daemon_listen(socket_path, true);
+    return state.listen_fd < 0 ? -1 : 0;
+}
+
+// Starts serving handoff requests, once the process has daemonized; does
+// nothing without --handoff or when already started
+void handoff_start(void) {
+    pthread_mutex_lock(&state.lock);
+    if (state.listen_fd >= 0 && !state.started) {
+        state.started = pthread_create(&state.thread, NULL, handoff_main, NULL) == 0;
+        if (!state.started) {
+            fprintf(stderr, "Warning: Could not start the handoff thread\n");
+        }
+    }
+    pthread_mutex_unlock(&state.lock);
+}
+
+// Offers a mount to the next process
+void handoff_offer(cftpfs_context_t *root, const char *mountpoint) {
+    handoff_mount_t *m = calloc(1, sizeof(handoff_mount_t));
+    if (!m) {
+        return;
+    }
+    handoff_canonical(mountpoint, m->mountpoint, sizeof(m->mountpoint));
+    m->root = root;
+    pthread_mutex_lock(&state.lock);
+    m->next = state.mounts;
+    state.mounts = m;
+    pthread_mutex_unlock(&state.lock);
+}
+
+// Withdraws the offer of a mount about to be torn down; true if it was
+// handed to another process
+bool handoff_withdraw(cftpfs_context_t *root) {
+    bool given = false;
+    pthread_mutex_lock(&state.lock);
+    for (handoff_mount_t **pp = &state.mounts; *pp; pp = &(*pp)->next) {
+        if ((*pp)->root == root) {
+            handoff_mount_t *m = *pp;
+            *pp = m->next;
+            given = m->given;
+            free(m);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&state.lock);
+    return given;
+}
+
+// True if the mount was handed to another process
+bool handoff_given(cftpfs_context_t *root) {
+    bool given = false;
+    pthread_mutex_lock(&state.lock);
+    for (handoff_mount_t *m = state.mounts; m; m = m->next) {
+        if (m->root == root) {
+            given = m->given;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&state.lock);
+    return given;
+}
+
+// Stops serving requests. The socket now belongs to the new process if a
+// mount was handed over, so it is left in place then. Returns whether one
+// was.
+bool handoff_shutdown(const char *socket_path) {
+    if (state.listen_fd < 0) {
+        return false;
+    }
+    shutdown(state.listen_fd, SHUT_RDWR);
+    if (state.started) {
+        pthread_join(state.thread, NULL);
+        state.started = false;
+    }
+    close(state.listen_fd);
+    state.listen_fd = -1;
+
+    bool given = false;
+    pthread_mutex_lock(&state.lock);
+    for (handoff_mount_t *m = state.mounts; m; m = m->next) {
+        given |= m->given;
+    }
+    pthread_mutex_unlock(&state.lock);
+    if (!given) {
+        unlink(socket_path);
+    }
+    return given;
+}
@@ -0,0 +1,135 @@
+/**
+ * intern.c - Refcounted path interning
+ *
+ * Handles and other long-lived objects keep a pointer into this table
+ * instead of carrying their own MAX_PATH_LEN buffer.
+ */
+
+#include "cftpfs.h"
+#include <stddef.h>
+
+static uint32_t hash_path(const char *s) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void intern_grow(cftpfs_context_t *ctx) {
+    size_t new_count = ctx->intern_bucket_count * 2;
+    intern_entry_t **buckets = calloc(new_count, sizeof(intern_entry_t *));
+    if (!buckets) {
+        // Keep the old table, chains just get longer
+        return;
+    }
+
+    for (size_t i = 0; i < ctx->intern_bucket_count; i++) {
+        intern_entry_t *e = ctx->intern_buckets[i];
+        while (e) {
+            intern_entry_t *next = e->next;
+            size_t b = e->hash & (new_count - 1);
+            e->next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+
+    free(ctx->intern_buckets);
+    ctx->intern_buckets = buckets;
+    ctx->intern_bucket_count = new_count;
+}
+
+void intern_init(cftpfs_context_t *ctx) {
+    ctx->intern_bucket_count = INTERN_BUCKETS_INITIAL;
+    ctx->intern_buckets = calloc(ctx->intern_bucket_count, sizeof(intern_entry_t *));
+    ctx->intern_count = 0;
+    pthread_mutex_init(&ctx->intern_lock, NULL);
+}
+
+void intern_cleanup(cftpfs_context_t *ctx) {
+    pthread_mutex_lock(&ctx->intern_lock);
+
+    for (size_t i = 0; i < ctx->intern_bucket_count; i++) {
+        intern_entry_t *e = ctx->intern_buckets[i];
+        while (e) {
+            intern_entry_t *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(ctx->intern_buckets);
+    ctx->intern_buckets = NULL;
+    ctx->intern_bucket_count = 0;
+    ctx->intern_count = 0;
+
+    pthread_mutex_unlock(&ctx->intern_lock);
+    pthread_mutex_destroy(&ctx->intern_lock);
+}
+
+const char* path_intern(cftpfs_context_t *ctx, const char *path) {
+    if (!path || !ctx->intern_buckets) {
+        return NULL;
+    }
+
+    uint32_t hash = hash_path(path);
+
+    pthread_mutex_lock(&ctx->intern_lock);
+
+    size_t b = hash & (ctx->intern_bucket_count - 1);
+    for (intern_entry_t *e = ctx->intern_buckets[b]; e; e = e->next) {
+        if (e->hash == hash && strcmp(e->str, path) == 0) {
+            e->refs++;
+            pthread_mutex_unlock(&ctx->intern_lock);
+            return e->str;
+        }
+    }
+
+    size_t len = strlen(path);
+    intern_entry_t *e = malloc(sizeof(intern_entry_t) + len + 1);
+    if (!e) {
+        pthread_mutex_unlock(&ctx->intern_lock);
+        return NULL;
+    }
+    memcpy(e->str, path, len + 1);
+    e->hash = hash;
+    e->refs = 1;
+    e->next = ctx->intern_buckets[b];
+    ctx->intern_buckets[b] = e;
+
+    if (++ctx->intern_count > ctx->intern_bucket_count) {
+        intern_grow(ctx);
+    }
+
+    pthread_mutex_unlock(&ctx->intern_lock);
+    return e->str;
+}
+
+void path_unintern(cftpfs_context_t *ctx, const char *path) {
+    if (!path) {
+        return;
+    }
+
+    intern_entry_t *entry = (intern_entry_t *)(path - offsetof(intern_entry_t, str));
+
+    pthread_mutex_lock(&ctx->intern_lock);
+
+    if (--entry->refs > 0) {
+        pthread_mutex_unlock(&ctx->intern_lock);
+        return;
+    }
+
+    intern_entry_t **pp = &ctx->intern_buckets[entry->hash & (ctx->intern_bucket_count - 1)];
+    while (*pp && *pp != entry) {
+        pp = &(*pp)->next;
+    }
+    if (*pp) {
+        *pp = entry->next;
+    }
+    ctx->intern_count--;
+
+    pthread_mutex_unlock(&ctx->intern_lock);
+    free(entry);
+}
@@ -0,0 +1,525 @@
+/**
+ * journal.c - Upload journal: files saved while the server is down
+ *
+ * While the circuit breaker is open (retry.c) the mount works offline.
+ * Listings and file content are served from the caches, however old, and
+ * whatever changes the tree fails with EROFS. Files can still be written:
+ * an upload that cannot reach the server is saved in the journal instead,
+ * and the file counts as saved. Until the server has it, the journal's
+ * copy is what opens of the path see.
+ *
+ * The journal is a directory per server under $XDG_STATE_HOME, so it
+ * survives a crash or an unmount. Each entry is a content file, <seq>.data,
+ * and <seq>.meta holding what the content was edited from and the path.
+ * The .meta file is written last and renamed into place, which commits the
+ * entry. Only the latest entry of a path is kept.
+ *
+ * The keepalive thread replays the journal, oldest first, once the server
+ * answers again (or on the next mount). A file that changed on the server
+ * since it was downloaded is not overwritten: the saved copy goes next to
+ * it as PATH.conflict-YYYYMMDD-HHMMSS. Entries the server refuses are kept
+ * as <seq>.failed for the user to recover. Processes sharing the directory
+ * take turns replaying it, under a lock on its file "lock".
+ */
+
+#include "cftpfs.h"
+#include <dirent.h>
+#include <sys/file.h>
+
+#define JOURNAL_COPY_CHUNK (64 * 1024)
+
+static void journal_file(cftpfs_context_t *ctx, unsigned seq, const char *suffix, char *out, size_t size) {
+    snprintf(out, size, "%s/%010u.%s", ctx->journal_dir, seq, suffix);
+}
+
+// Deletes an entry's files and frees it; journal_lock held, entry unlinked
+static void journal_drop(cftpfs_context_t *ctx, journal_entry_t *entry) {
+    char file[MAX_PATH_LEN + 32];
+    journal_file(ctx, entry->seq, "meta", file, sizeof(file));
+    unlink(file);
+    journal_file(ctx, entry->seq, "data", file, sizeof(file));
+    unlink(file);
+    free(entry->path);
+    free(entry);
+}
+
+// Drops every entry of path; journal_lock held
+static void journal_remove_path(cftpfs_context_t *ctx, const char *path) {
+    journal_entry_t **pp = &ctx->journal;
+    while (*pp) {
+        journal_entry_t *entry = *pp;
+        if (strcmp(entry->path, path) == 0) {
+            *pp = entry->next;
+            journal_drop(ctx, entry);
+        } else {
+            pp = &entry->next;
+        }
+    }
+}
+
+// Unlinks the entry numbered seq and returns it, NULL if gone; journal_lock
+// held
+static journal_entry_t* journal_take(cftpfs_context_t *ctx, unsigned seq) {
+    for (journal_entry_t **pp = &ctx->journal; *pp; pp = &(*pp)->next) {
+        if ((*pp)->seq == seq) {
+            journal_entry_t *entry = *pp;
+            *pp = entry->next;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Reads an entry's .meta: "<base_mtime> <is_new>\n<path>"
+static journal_entry_t* journal_load_entry(cftpfs_context_t *ctx, unsigned seq) {
+    char file[MAX_PATH_LEN + 32];
+    journal_file(ctx, seq, "meta", file, sizeof(file));
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        return NULL;
+    }
+    long long base_mtime;
+    int is_new;
+    char path[MAX_PATH_LEN];
+    size_t len = 0;
+    if (fscanf(f, "%lld %d\n", &base_mtime, &is_new) == 2) {
+        len = fread(path, 1, sizeof(path) - 1, f);
+    }
+    fclose(f);
+    if (len == 0 || path[0] != '/') {
+        return NULL;
+    }
+    path[len] = '\0';
+
+    journal_entry_t *entry = calloc(1, sizeof(journal_entry_t));
+    if (!entry || !(entry->path = strdup(path))) {
+        free(entry);
+        return NULL;
+    }
+    entry->seq = seq;
+    entry->base_mtime = base_mtime;
+    entry->is_new = is_new;
+    return entry;
+}
+
+// Inserts by sequence number; journal_lock held
+static void journal_insert(cftpfs_context_t *ctx, journal_entry_t *entry) {
+    journal_entry_t **pp = &ctx->journal;
+    while (*pp && (*pp)->seq < entry->seq) {
+        pp = &(*pp)->next;
+    }
+    entry->next = *pp;
+    *pp = entry;
+}
+
+// Finds the journal of this server, creating its directory, and loads the
+// entries an earlier mount left
+void journal_init(cftpfs_context_t *ctx) {
+    pthread_mutex_init(&ctx->journal_lock, NULL);
+    ctx->journal = NULL;
+    ctx->journal_seq = 0;
+
+    char name[MAX_PATH_LEN];
+    snprintf(name, sizeof(name), "%s/%s@%s_%d", FTP_JOURNAL_DIR, ctx->user, ctx->host, ctx->port);
+    if (state_path(name, ctx->journal_dir, sizeof(ctx->journal_dir)) < 0) {
+        ctx->journal_dir[0] = '\0';
+        return;
+    }
+    char dir[MAX_PATH_LEN];
+    strcpy(dir, ctx->journal_dir);
+    for (char *p = dir + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        mkdir(dir, 0700);
+        *p = '/';
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Warning: no upload journal, cannot create %s: %s\n", dir, strerror(errno));
+        ctx->journal_dir[0] = '\0';
+        return;
+    }
+
+    DIR *d = opendir(ctx->journal_dir);
+    if (!d) {
+        ctx->journal_dir[0] = '\0';
+        return;
+    }
+    int pending = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned seq;
+        char suffix[8];
+        if (sscanf(de->d_name, "%u.%7s", &seq, suffix) != 2) {
+            continue;
+        }
+        if (seq >= ctx->journal_seq) {
+            ctx->journal_seq = seq + 1;
+        }
+        if (strcmp(suffix, "tmp") == 0) {
+            // Interrupted before it was committed
+            char file[MAX_PATH_LEN + 32];
+            journal_file(ctx, seq, "tmp", file, sizeof(file));
+            unlink(file);
+            journal_file(ctx, seq, "data", file, sizeof(file));
+            unlink(file);
+            continue;
+        }
+        journal_entry_t *entry = strcmp(suffix, "meta") == 0 ? journal_load_entry(ctx, seq) : NULL;
+        if (entry) {
+            journal_insert(ctx, entry);
+            pending++;
+        }
+    }
+    closedir(d);
+
+    if (pending > 0) {
+        printf("%d uploads to %s:%d are waiting in %s\n", pending, ctx->host, ctx->port, ctx->journal_dir);
+    }
+}
+
+void journal_cleanup(cftpfs_context_t *ctx) {
+    while (ctx->journal) {
+        journal_entry_t *entry = ctx->journal;
+        ctx->journal = entry->next;
+        free(entry->path);
+        free(entry);
+    }
+    pthread_mutex_destroy(&ctx->journal_lock);
+}
+
+// Writes the content of st, or else text, to a new file and syncs it
+static int journal_write_file(const char *file, int flags, staging_t *st, const char *text) {
+    int fd = open(file, O_CREAT | O_WRONLY | O_CLOEXEC | flags, 0600);
+    if (fd < 0) {
+        return -errno;
+    }
+    char *chunk = st ? malloc(JOURNAL_COPY_CHUNK) : NULL;
+    int ret = st && !chunk ? -ENOMEM : 0;
+    size_t total = st ? st->size : strlen(text);
+    for (size_t done = 0; ret == 0 && done < total; ) {
+        const char *p = text + done;
+        ssize_t n = total - done;
+        if (st) {
+            n = staging_read(st, chunk, JOURNAL_COPY_CHUNK, done);
+            p = chunk;
+            if (n <= 0) {
+                ret = n < 0 ? n : -EIO;
+                break;
+            }
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(fd, p + off, n - off);
+            if (w < 0) {
+                ret = -errno;
+                break;
+            }
+            off += w;
+        }
+        done += n;
+    }
+    free(chunk);
+    if (ret == 0 && fsync(fd) < 0) {
+        ret = -errno;
+    }
+    if (close(fd) < 0 && ret == 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        unlink(file);
+    }
+    return ret;
+}
+
+// Saves the content of path, to be uploaded once the server is back, in
+// place of anything saved for it before. base_mtime is the MDTM of the
+// content the edit started from. Called with the open file's lock held.
+int journal_add(cftpfs_context_t *ctx, const char *path, staging_t *st, time_t base_mtime, bool is_new) {
+    if (ctx->journal_dir[0] == '\0') {
+        return -ENOSYS;
+    }
+    journal_entry_t *entry = calloc(1, sizeof(journal_entry_t));
+    if (!entry || !(entry->path = strdup(path))) {
+        free(entry);
+        return -ENOMEM;
+    }
+    entry->base_mtime = base_mtime;
+    entry->is_new = is_new;
+
+    pthread_mutex_lock(&ctx->journal_lock);
+    // A file saved again keeps what the first offline save started from
+    for (journal_entry_t *old = ctx->journal; old; old = old->next) {
+        if (strcmp(old->path, path) == 0) {
+            entry->base_mtime = old->base_mtime;
+            entry->is_new = old->is_new;
+        }
+    }
+    // Another mount of the same server may use the same directory
+    char data[MAX_PATH_LEN + 32], meta[MAX_PATH_LEN + 32], tmp[MAX_PATH_LEN + 32];
+    int ret;
+    do {
+        entry->seq = ctx->journal_seq++;
+        journal_file(ctx, entry->seq, "data", data, sizeof(data));
+        ret = journal_write_file(data, O_EXCL, st, NULL);
+    } while (ret == -EEXIST);
+    journal_file(ctx, entry->seq, "meta", meta, sizeof(meta));
+    journal_file(ctx, entry->seq, "tmp", tmp, sizeof(tmp));
+    char header[MAX_PATH_LEN + 64];
+    snprintf(header, sizeof(header), "%lld %d\n%s", (long long)entry->base_mtime, entry->is_new, path);
+
+    if (ret == 0) {
+        ret = journal_write_file(tmp, O_TRUNC, NULL, header);
+        if (ret == 0 && rename(tmp, meta) < 0) {
+            ret = -errno;
+            unlink(tmp);
+        }
+        if (ret < 0) {
+            unlink(data);
+        }
+    }
+    if (ret < 0) {
+        pthread_mutex_unlock(&ctx->journal_lock);
+        fprintf(stderr, "Warning: could not save %s in the upload journal: %s\n", path, strerror(-ret));
+        free(entry->path);
+        free(entry);
+        return ret;
+    }
+
+    journal_remove_path(ctx, path);
+    journal_insert(ctx, entry);
+    pthread_mutex_unlock(&ctx->journal_lock);
+
+    if (ctx->debug) {
+        fprintf(stderr, "[DEBUG] journal: saved %s (%zu bytes) until %s:%d is back\n",
+                path, st->size, ctx->host, ctx->port);
+    }
+    return 0;
+}
+
+// Drops what is saved for path, superseded by an upload or a delete
+void journal_forget(cftpfs_context_t *ctx, const char *path) {
+    pthread_mutex_lock(&ctx->journal_lock);
+    journal_remove_path(ctx, path);
+    pthread_mutex_unlock(&ctx->journal_lock);
+}
+
+bool journal_pending(cftpfs_context_t *ctx, const char *path) {
+    bool pending = false;
+    pthread_mutex_lock(&ctx->journal_lock);
+    for (journal_entry_t *entry = ctx->journal; entry && !pending; entry = entry->next) {
+        pending = strcmp(entry->path, path) == 0;
+    }
+    pthread_mutex_unlock(&ctx->journal_lock);
+    return pending;
+}
+
+// Opens the content saved for path; -ENOENT if there is none
+static int journal_open(cftpfs_context_t *ctx, const char *path, journal_entry_t *copy) {
+    int fd = -ENOENT;
+    pthread_mutex_lock(&ctx->journal_lock);
+    for (journal_entry_t *entry = ctx->journal; entry; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) {
+            char data[MAX_PATH_LEN + 32];
+            journal_file(ctx, entry->seq, "data", data, sizeof(data));
+            fd = open(data, O_RDONLY | O_CLOEXEC);
+            fd = fd < 0 ? -errno : fd;
+            if (copy) {
+                // The node may be freed once the lock is dropped: keep its
+                // fields, not its path or link
+                *copy = *entry;
+                copy->path = NULL;
+                copy->next = NULL;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx->journal_lock);
+    return fd;
+}
+
+// Copies the content saved for path into st, which is empty
+int journal_read(cftpfs_context_t *ctx, const char *path, staging_t *st) {
+    int fd = journal_open(ctx, path, NULL);
+    if (fd < 0) {
+        return fd;
+    }
+    char *chunk = malloc(JOURNAL_COPY_CHUNK);
+    int ret = chunk ? 0 : -ENOMEM;
+    off_t offset = 0;
+    ssize_t n;
+    while (ret == 0 && (n = read(fd, chunk, JOURNAL_COPY_CHUNK)) != 0) {
+        if (n < 0) {
+            ret = -errno;
+            break;
+        }
+        for (ssize_t done = 0; ret == 0 && done < n; ) {
+            ssize_t w = staging_write(ctx, st, chunk + done, n - done, offset);
+            if (w < 0) {
+                ret = w;
+            } else {
+                done += w;
+                offset += w;
+            }
+        }
+    }
+    free(chunk);
+    close(fd);
+    return ret;
+}
+
+// Where the copy of path saved in entry goes: path itself, or next to it when the
+// file changed on the server since it was downloaded (or appeared there,
+// for a file created offline). Only the primary is asked, as a mirror may
+// not have the change yet. Fails unless it answers 213 or 550, so the
+// entry waits rather than overwrite a change it could not see.
+static int journal_target(cftpfs_context_t *ctx, const char *path, const journal_entry_t *entry,
+                          char *target, size_t size) {
+    ftp_batch_cmd_t cmd = { .verb = "MDTM", .path = path };
+    int ret = ftp_batch_primary(ctx, &cmd, 1);
+    if (ret < 0) {
+        return ret == -EHOSTDOWN ? ret : -EIO;
+    }
+    if (cmd.code != 213 && cmd.code != 550) {
+        return -EAGAIN;
+    }
+    time_t mtime;
+    bool exists = (cmd.code == 213);
+    bool known = exists && parse_mdtm_reply(cmd.reply, &mtime) == 0;
+    bool changed = entry->base_mtime != 0 && (!known || mtime != entry->base_mtime);
+    bool conflict = exists && (entry->is_new || changed);
+    if (!conflict) {
+        snprintf(target, size, "%s", path);
+        return 0;
+    }
+
+    char stamp[16];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(target, size, "%s.conflict-%s", path, stamp);
+    fprintf(stderr, "Warning: %s changed on %s:%d while it was unreachable; the copy saved offline "
+            "is uploaded as %s\n", path, ctx->host, ctx->port, target);
+    return 0;
+}
+
+// Replays the entries; the journal directory's lock held
+static void journal_replay_locked(cftpfs_context_t *ctx) {
+    while (!breaker_open(ctx)) {
+        // The entry may be superseded, and freed, once the lock is dropped:
+        // work from a copy of its path
+        char path[MAX_PATH_LEN];
+        pthread_mutex_lock(&ctx->journal_lock);
+        bool pending = ctx->journal != NULL;
+        if (pending) {
+            snprintf(path, sizeof(path), "%s", ctx->journal->path);
+        }
+        pthread_mutex_unlock(&ctx->journal_lock);
+        if (!pending) {
+            return;
+        }
+
+        // Its file stays open while it uploads
+        journal_entry_t entry;
+        staging_t st;
+        staging_init(&st);
+        st.fd = journal_open(ctx, path, &entry);
+        struct stat sb;
+        if (st.fd < 0 || fstat(st.fd, &sb) < 0) {
+            if (st.fd >= 0) {
+                close(st.fd);
+            }
+            journal_forget(ctx, path);
+            continue;
+        }
+        st.size = sb.st_size;
+
+        // Uploaded, or set aside as failed, by another process since this
+        // one loaded it: forget it here and leave its files alone
+        char meta[MAX_PATH_LEN + 32];
+        journal_file(ctx, entry.seq, "meta", meta, sizeof(meta));
+        if (access(meta, F_OK) < 0) {
+            staging_free(ctx, &st);
+            pthread_mutex_lock(&ctx->journal_lock);
+            journal_entry_t *gone = journal_take(ctx, entry.seq);
+            pthread_mutex_unlock(&ctx->journal_lock);
+            if (gone) {
+                free(gone->path);
+                free(gone);
+            }
+            continue;
+        }
+
+        char target[MAX_PATH_LEN + 32];
+        int ret = journal_target(ctx, path, &entry, target, sizeof(target));
+        if (ret != 0) {
+            // Whether the file changed is not known: try again next round
+            staging_free(ctx, &st);
+            if (ctx->debug && ret != -EHOSTDOWN) {
+                fprintf(stderr, "[DEBUG] journal: cannot check %s for changes: %s\n", path, strerror(-ret));
+            }
+            return;
+        }
+        ret = ftp_upload(ctx, &st, target);
+        staging_free(ctx, &st);
+        if (ret == -EHOSTDOWN) {
+            return;
+        }
+
+        pthread_mutex_lock(&ctx->journal_lock);
+        journal_entry_t *done = journal_take(ctx, entry.seq);
+        if (done && ret == 0) {
+            journal_drop(ctx, done);
+        } else if (done) {
+            // Refused by the server: keep the content for the user
+            char failed[MAX_PATH_LEN + 32];
+            journal_file(ctx, done->seq, "failed", failed, sizeof(failed));
+            rename(meta, failed);
+            fprintf(stderr, "Warning: could not upload %s saved offline: %s; kept in %s\n",
+                    done->path, strerror(-ret), ctx->journal_dir);
+            free(done->path);
+            free(done);
+        }
+        pthread_mutex_unlock(&ctx->journal_lock);
+
+        if (ret == 0) {
+            printf("Uploaded %s, saved while %s:%d was unreachable\n", target, ctx->host, ctx->port);
+            if (strcmp(target, path) != 0) {
+                // The cached content is the offline copy, not what the path holds
+                open_file_invalidate(ctx, path);
+            }
+            const char *slash = strrchr(path, '/');
+            if (slash && slash != path) {
+                path[slash - path] = '\0';
+                cache_invalidate(ctx, path);
+            } else {
+                cache_invalidate(ctx, "/");
+            }
+        }
+    }
+}
+
+// Uploads what was saved while the server was down, oldest first. Stops at
+// once while the server is still unreachable, or cannot tell whether a file
+// changed meanwhile. Runs on the keepalive thread.
+//
+// Other mounts of the server, and the process on the other side of a
+// handoff, load the same entries: a lock on the directory lets one of them
+// replay at a time, and the others skip the round.
+void journal_replay(cftpfs_context_t *ctx) {
+    pthread_mutex_lock(&ctx->journal_lock);
+    bool pending = ctx->journal != NULL;
+    pthread_mutex_unlock(&ctx->journal_lock);
+    if (!pending) {
+        return;
+    }
+
+    char file[MAX_PATH_LEN + 32];
+    snprintf(file, sizeof(file), "%s/lock", ctx->journal_dir);
+    int fd = open(file, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        journal_replay_locked(ctx);
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+}
@@ -0,0 +1,246 @@
+/**
+ * keepalive.c - Connection warm-up and idle keepalive
+ *
+ * A background thread logs every connection slot in right after mount, then
+ * sends NOOP on slots that have sat idle for keepalive_interval seconds, so
+ * a request after a quiet period does not pay for a new login. The interval
+ * starts at FTP_KEEPALIVE_DEFAULT and follows the server: whenever a
+ * connection turns out to have been dropped while idle, it is reconnected
+ * and the interval shrinks to half of the idle time the server did not
+ * tolerate. Slots the autotuner has retired are logged out instead.
+ *
+ * The thread also checks mirrors that are down (mirror.c) once their
+ * cooldown is over. Connections left on a down mirror go back to the
+ * primary. Files saved while the server was unreachable are uploaded from
+ * the journal (journal.c) once it answers again.
+ *
+ * There is one thread per process, shared by every context (shared.c): it
+ * visits the contexts in turn, so each pool costs no thread of its own.
+ */
+
+#include "cftpfs.h"
+
+// Checks every idle slot: a connection the server has closed is replaced
+// at once, and one that is due gets a NOOP. Busy slots and lanes with
+// queued requests are left alone.
+static void keepalive_pass(cftpfs_context_t *ctx, int interval, int tick) {
+    for (int l = 0; l < FTP_LANE_COUNT; l++) {
+        for (int i = 0; i < ctx->lanes[l].count; i++) {
+            ftp_slot_t *slot = &ctx->lanes[l].slots[i];
+            if (!lane_try_take(ctx, slot)) {
+                continue;
+            }
+            if (lane_retired(ctx, slot)) {
+                ftp_slot_close(ctx, slot);
+                lane_return(ctx, slot);
+                continue;
+            }
+            if (mirror_down(ctx, slot->server)) {
+                ftp_slot_close(ctx, slot);
+                slot->server = 0;
+            }
+
+            bool due = time(NULL) - slot->last_used >= interval - tick;
+            if (!due && ftp_slot_alive(ctx, slot)) {
+                lane_return(ctx, slot);
+                continue;
+            }
+            if (ctx->debug) {
+                fprintf(stderr, "[DEBUG] keepalive: %s %s slot %d\n", due ? "NOOP on" : "reconnecting",
+                        l == FTP_LANE_META ? "meta" : "bulk", i);
+            }
+            ftp_slot_noop(ctx, slot);
+            lane_release(ctx, slot);
+        }
+    }
+}
+
+// Sends a NOOP to each mirror whose cooldown is over, on an idle slot
+// moved over to it; the outcome brings the mirror back or extends its
+// cooldown
+static void keepalive_probe_mirrors(cftpfs_context_t *ctx) {
+    for (int server = 1; server < ctx->server_count; server++) {
+        if (!mirror_probe_due(ctx, server)) {
+            continue;
+        }
+        ftp_slot_t *slot = NULL;
+        for (int l = FTP_LANE_COUNT - 1; l >= 0 && !slot; l--) {
+            for (int i = 0; i < ctx->lanes[l].count && !slot; i++) {
+                ftp_slot_t *candidate = &ctx->lanes[l].slots[i];
+                if (!lane_try_take(ctx, candidate)) {
+                    continue;
+                }
+                if (lane_retired(ctx, candidate)) {
+                    lane_return(ctx, candidate);
+                    continue;
+                }
+                slot = candidate;
+            }
+        }
+        if (!slot) {
+            return;
+        }
+        if (ctx->debug) {
+            fprintf(stderr, "[DEBUG] keepalive: checking mirror %s:%d\n",
+                    ctx->servers[server].host, ctx->servers[server].port);
+        }
+        ftp_slot_close(ctx, slot);
+        slot->server = server;
+        ftp_slot_noop(ctx, slot);
+        lane_release(ctx, slot);
+    }
+}
+
+// Finds a context the current round has not visited yet and marks it as
+// the one being worked on; keepalive_lock held
+static cftpfs_context_t* keepalive_next(cftpfs_shared_t *shared) {
+    for (int i = 0; i < shared->keepalive_count; i++) {
+        cftpfs_context_t *ctx = shared->keepalive_contexts[i];
+        if (ctx->keepalive_round != shared->keepalive_round) {
+            ctx->keepalive_round = shared->keepalive_round;
+            shared->keepalive_current = ctx;
+            return ctx;
+        }
+    }
+    return NULL;
+}
+
+// One thread serves every context of the process. A context is logged in
+// as soon as it is added, then visited a few times per interval; contexts
+// can come and go while it runs.
+static void* keepalive_main(void *arg) {
+    cftpfs_shared_t *shared = (cftpfs_shared_t *)arg;
+
+    pthread_mutex_lock(&shared->keepalive_lock);
+    while (!shared->keepalive_stopping) {
+        // Wake a few times per interval so no slot idles much past it
+        int tick = FTP_KEEPALIVE_DEFAULT / 4;
+        shared->keepalive_round++;
+        cftpfs_context_t *ctx;
+        while ((ctx = keepalive_next(shared)) != NULL) {
+            int interval = ctx->keepalive_interval;
+            int own_tick = interval / 4 > 0 ? interval / 4 : 1;
+            bool warm = ctx->keepalive_warm;
+            ctx->keepalive_warm = true;
+            if (own_tick < tick) {
+                tick = own_tick;
+            }
+            pthread_mutex_unlock(&shared->keepalive_lock);
+
+            if (!warm) {
+                if (ftp_connect(ctx) < 0) {
+                    fprintf(stderr, "Warning: Could not connect to %s:%d, will retry on first use\n",
+                            ctx->host, ctx->port);
+                } else {
+                    // Uploads left by an earlier mount
+                    journal_replay(ctx);
+                }
+            } else {
+                keepalive_pass(ctx, interval, own_tick);
+                keepalive_probe_mirrors(ctx);
+                journal_replay(ctx);
+            }
+
+            pthread_mutex_lock(&shared->keepalive_lock);
+            shared->keepalive_current = NULL;
+            pthread_cond_broadcast(&shared->keepalive_cond);
+        }
+        if (shared->keepalive_stopping) {
+            break;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += tick;
+        pthread_cond_timedwait(&shared->keepalive_cond, &shared->keepalive_lock, &deadline);
+    }
+    pthread_mutex_unlock(&shared->keepalive_lock);
+
+    return NULL;
+}
+
+// Started from the FUSE init callback, after fuse_main has daemonized. The
+// thread is created with the first context.
+void keepalive_start(cftpfs_context_t *ctx) {
+    cftpfs_shared_t *shared = ctx->shared;
+
+    pthread_mutex_lock(&shared->keepalive_lock);
+    cftpfs_context_t **grown = realloc(shared->keepalive_contexts,
+                                       (shared->keepalive_count + 1) * sizeof(*grown));
+    if (!grown) {
+        pthread_mutex_unlock(&shared->keepalive_lock);
+        fprintf(stderr, "Warning: Could not start keepalive for %s\n", ctx->host);
+        return;
+    }
+    shared->keepalive_contexts = grown;
+    shared->keepalive_contexts[shared->keepalive_count++] = ctx;
+    ctx->keepalive_interval = FTP_KEEPALIVE_DEFAULT;
+    ctx->keepalive_warm = false;
+    // Not visited in this round yet, so a pass under way logs it in too
+    ctx->keepalive_round = shared->keepalive_round - 1;
+    ctx->keepalive_running = true;
+
+    if (!shared->keepalive_started) {
+        if (pthread_create(&shared->keepalive_thread, NULL, keepalive_main, shared) == 0) {
+            shared->keepalive_started = true;
+        } else {
+            fprintf(stderr, "Warning: Could not start keepalive thread\n");
+        }
+    }
+    // Log the new pool in now rather than at the next tick
+    pthread_cond_broadcast(&shared->keepalive_cond);
+    pthread_mutex_unlock(&shared->keepalive_lock);
+}
+
+// Takes the context off the thread's list, waiting if the thread is using
+// it; the thread keeps running for the other contexts
+void keepalive_stop(cftpfs_context_t *ctx) {
+    cftpfs_shared_t *shared = ctx->shared;
+
+    pthread_mutex_lock(&shared->keepalive_lock);
+    for (int i = 0; i < shared->keepalive_count; i++) {
+        if (shared->keepalive_contexts[i] == ctx) {
+            shared->keepalive_contexts[i] = shared->keepalive_contexts[--shared->keepalive_count];
+            break;
+        }
+    }
+    ctx->keepalive_running = false;
+    while (shared->keepalive_current == ctx) {
+        pthread_cond_wait(&shared->keepalive_cond, &shared->keepalive_lock);
+    }
+    pthread_mutex_unlock(&shared->keepalive_lock);
+}
+
+// Ends the thread, once every context has been stopped
+void keepalive_shutdown(cftpfs_shared_t *shared) {
+    pthread_mutex_lock(&shared->keepalive_lock);
+    bool started = shared->keepalive_started;
+    shared->keepalive_stopping = true;
+    pthread_cond_broadcast(&shared->keepalive_cond);
+    pthread_mutex_unlock(&shared->keepalive_lock);
+
+    if (started) {
+        pthread_join(shared->keepalive_thread, NULL);
+    }
+}
+
+// Called when a connection that had been idle for `idle` seconds was found
+// closed by the server
+void keepalive_note_drop(cftpfs_context_t *ctx, time_t idle) {
+    // A connection lost moments after use is a network error, not a timeout
+    if (idle < 2 * FTP_KEEPALIVE_MIN) {
+        return;
+    }
+    int interval = (int)(idle / 2);
+
+    pthread_mutex_lock(&ctx->shared->keepalive_lock);
+    if (interval < ctx->keepalive_interval) {
+        ctx->keepalive_interval = interval;
+        if (ctx->debug) {
+            fprintf(stderr, "[DEBUG] keepalive: connection dropped after %lds idle, NOOP every %ds\n",
+                    (long)idle, interval);
+        }
+        pthread_cond_broadcast(&ctx->shared->keepalive_cond);
+    }
+    pthread_mutex_unlock(&ctx->shared->keepalive_lock);
+}
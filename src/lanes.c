@@ -0,0 +1,259 @@
+/**
+ * lanes.c - Connection slots and priority lanes
+ *
+ * Every FTP operation runs on a connection slot taken from a lane. The
+ * metadata lane serves listings and one-command operations (getattr,
+ * readdir, unlink, rename, batches); the bulk lane serves downloads and
+ * uploads. Each lane owns its own connections, so a long transfer never
+ * sits in front of an interactive `ls`.
+ *
+ * Metadata operations may also borrow an idle bulk slot, never the other
+ * way round. Waiters are granted slots in arrival order, except that in
+ * the bulk lane a path that already has transfers running yields to paths
+ * that have fewer, so one busy file cannot monopolise the pool.
+ *
+ * With mirrors (mirror.c), a request prefers an idle slot that is already
+ * connected to the endpoint it was sent to, so slots settle on endpoints
+ * rather than reconnecting for every request.
+ *
+ * Only the first `limit` slots of a lane are handed out. The autotuner
+ * moves the bulk lane's limit; slots past it are retired, and their
+ * connections are closed by the keepalive thread once they are idle.
+ */
+
+#include "cftpfs.h"
+
+static const char *lane_names[FTP_LANE_COUNT] = { "meta", "bulk" };
+
+// FNV-1a, only used to tell owners apart
+static uint32_t owner_hash(const char *path) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)(path ? path : ""); *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+int lanes_init(cftpfs_context_t *ctx, int meta, int bulk) {
+    int sizes[FTP_LANE_COUNT] = { meta, bulk };
+
+    pthread_mutex_init(&ctx->lanes_lock, NULL);
+    for (int l = 0; l < FTP_LANE_COUNT; l++) {
+        ftp_lane_t *lane = &ctx->lanes[l];
+        lane->count = sizes[l] > 0 ? sizes[l] : 1;
+        lane->limit = lane->count;
+        lane->queued = 0;
+        lane->waiters = NULL;
+        lane->slots = calloc(lane->count, sizeof(ftp_slot_t));
+        if (!lane->slots) {
+            return -1;
+        }
+        for (int i = 0; i < lane->count; i++) {
+            lane->slots[i].lane = l;
+        }
+    }
+    return 0;
+}
+
+void lanes_cleanup(cftpfs_context_t *ctx) {
+    for (int l = 0; l < FTP_LANE_COUNT; l++) {
+        free(ctx->lanes[l].slots);
+        ctx->lanes[l].slots = NULL;
+        ctx->lanes[l].count = 0;
+    }
+    pthread_mutex_destroy(&ctx->lanes_lock);
+}
+
+// Helpers below are called with lanes_lock held
+
+// An idle slot, preferably one connected to `server` (-1 for any)
+static ftp_slot_t* lane_free_slot(ftp_lane_t *lane, int server) {
+    ftp_slot_t *any = NULL;
+    for (int i = 0; i < lane->limit; i++) {
+        ftp_slot_t *slot = &lane->slots[i];
+        if (slot->busy) {
+            continue;
+        }
+        if (server < 0 || slot->server == server) {
+            return slot;
+        }
+        if (!any) {
+            any = slot;
+        }
+    }
+    return any;
+}
+
+static int lane_owner_busy(ftp_lane_t *lane, uint32_t owner) {
+    int n = 0;
+    for (int i = 0; i < lane->count; i++) {
+        if (lane->slots[i].busy && lane->slots[i].owner == owner) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static void slot_take(ftp_slot_t *slot, uint32_t owner) {
+    slot->busy = true;
+    slot->owner = owner;
+}
+
+// Unlinks and returns the waiter that should get the next slot of `lane`:
+// the earliest one among those whose owner has the fewest busy slots
+static lane_waiter_t* lane_pick(ftp_lane_t *lane) {
+    lane_waiter_t **best = NULL;
+    int best_busy = 0;
+    for (lane_waiter_t **pp = &lane->waiters; *pp; pp = &(*pp)->next) {
+        int busy = lane_owner_busy(lane, (*pp)->owner);
+        if (!best || busy < best_busy) {
+            best = pp;
+            best_busy = busy;
+        }
+    }
+    if (!best) {
+        return NULL;
+    }
+    lane_waiter_t *w = *best;
+    *best = w->next;
+    return w;
+}
+
+static void lane_enqueue(ftp_lane_t *lane, lane_waiter_t *w) {
+    lane_waiter_t **pp = &lane->waiters;
+    while (*pp) {
+        pp = &(*pp)->next;
+    }
+    *pp = w;
+}
+
+ftp_slot_t* lane_acquire(cftpfs_context_t *ctx, ftp_lane_id_t id, const char *path, int server) {
+    uint32_t owner = owner_hash(path);
+    ftp_lane_t *lane = &ctx->lanes[id];
+    ftp_lane_t *bulk = &ctx->lanes[FTP_LANE_BULK];
+
+    pthread_mutex_lock(&ctx->lanes_lock);
+
+    ftp_slot_t *slot = lane->waiters ? NULL : lane_free_slot(lane, server);
+    if (!slot && id == FTP_LANE_META && !bulk->waiters) {
+        // Interactive work may run on an idle transfer connection
+        slot = lane_free_slot(bulk, server);
+    }
+    if (slot) {
+        slot_take(slot, owner);
+        pthread_mutex_unlock(&ctx->lanes_lock);
+        return slot;
+    }
+
+    lane_waiter_t w;
+    w.owner = owner;
+    w.slot = NULL;
+    w.next = NULL;
+    pthread_cond_init(&w.cond, NULL);
+    lane_enqueue(lane, &w);
+    lane->queued++;
+
+    if (ctx->debug) {
+        fprintf(stderr, "[DEBUG] lanes: waiting for a %s connection: %s\n", lane_names[id], path ? path : "");
+    }
+    while (!w.slot) {
+        pthread_cond_wait(&w.cond, &ctx->lanes_lock);
+    }
+
+    pthread_mutex_unlock(&ctx->lanes_lock);
+    pthread_cond_destroy(&w.cond);
+    return w.slot;
+}
+
+static bool slot_retired(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    ftp_lane_t *lane = &ctx->lanes[slot->lane];
+    return slot - lane->slots >= lane->limit;
+}
+
+// Hands an idle slot to the next waiter, if any
+static bool slot_grant(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    lane_waiter_t *w = lane_pick(&ctx->lanes[slot->lane]);
+    if (!w && slot->lane == FTP_LANE_BULK) {
+        w = lane_pick(&ctx->lanes[FTP_LANE_META]);
+    }
+    if (!w) {
+        return false;
+    }
+    slot_take(slot, w->owner);
+    w->slot = slot;
+    pthread_cond_signal(&w->cond);
+    return true;
+}
+
+static void slot_put(cftpfs_context_t *ctx, ftp_slot_t *slot, bool used) {
+    pthread_mutex_lock(&ctx->lanes_lock);
+
+    slot->busy = false;
+    if (used) {
+        slot->last_used = time(NULL);
+    }
+    if (!slot_retired(ctx, slot)) {
+        slot_grant(ctx, slot);
+    }
+
+    pthread_mutex_unlock(&ctx->lanes_lock);
+}
+
+void lane_release(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    slot_put(ctx, slot, true);
+}
+
+// Returns a slot without touching its idle time, for background checks
+// that did not talk to the server
+void lane_return(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    slot_put(ctx, slot, false);
+}
+
+// Claims `slot` for background work (keepalive) only if it is idle and no
+// request is queued for its lane; user operations always come first
+bool lane_try_take(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    pthread_mutex_lock(&ctx->lanes_lock);
+    bool taken = !slot->busy && !ctx->lanes[slot->lane].waiters;
+    if (taken) {
+        slot_take(slot, 0);
+    }
+    pthread_mutex_unlock(&ctx->lanes_lock);
+    return taken;
+}
+
+bool lane_retired(cftpfs_context_t *ctx, ftp_slot_t *slot) {
+    pthread_mutex_lock(&ctx->lanes_lock);
+    bool retired = slot_retired(ctx, slot);
+    pthread_mutex_unlock(&ctx->lanes_lock);
+    return retired;
+}
+
+// Sets how many of the lane's slots are used, clamped to [1, count], and
+// returns the new limit. Slots that come into use go to waiters at once.
+int lane_set_limit(cftpfs_context_t *ctx, ftp_lane_id_t id, int limit) {
+    ftp_lane_t *lane = &ctx->lanes[id];
+
+    pthread_mutex_lock(&ctx->lanes_lock);
+    if (limit > lane->count) {
+        limit = lane->count;
+    }
+    if (limit < 1) {
+        limit = 1;
+    }
+    lane->limit = limit;
+
+    ftp_slot_t *slot;
+    while ((slot = lane_free_slot(lane, -1)) != NULL && slot_grant(ctx, slot)) {
+    }
+    pthread_mutex_unlock(&ctx->lanes_lock);
+    return limit;
+}
+
+// Returns how many requests queued for the lane since the last call
+int lane_take_queued(cftpfs_context_t *ctx, ftp_lane_id_t id) {
+    pthread_mutex_lock(&ctx->lanes_lock);
+    int queued = ctx->lanes[id].queued;
+    ctx->lanes[id].queued = 0;
+    pthread_mutex_unlock(&ctx->lanes_lock);
+    return queued;
+}
@@ -26,17 +26,68 @@ static struct options {
     int debug;
     int foreground;
     int cache_timeout;  // Cache timeout in seconds
+    size_t mem_staging; // Max bytes staged in memory per file
+    size_t staging_quota;   // Max bytes in the temp directory, 0 = unlimited
+    size_t content_cache;   // Clean content retained after close
+    int native_ftp;         // Use the built-in FTP engine
+    ftp_tls_t tls;          // --ftps / --ftpes
+    const char *cacert;     // CA bundle for verifying the server
+    const char *resolve;    // Addresses pinned for the host
+    const char *mirrors[FTP_SERVERS_MAX - 1];  // --mirror endpoints, read-only
+    int mirror_count;
+    const char *mount_table; // Directories served by other servers, see shard.c
+    const char *daemon_config;  // Mounts of a daemon, see daemon.c
+    const char *control;        // The daemon's control socket
+    const char *handoff;        // Hot restart socket, see handoff.c
+    int connections;        // Control connections across both lanes, 0 = automatic
+    int max_connections;    // Ceiling for the automatic connection count
+    const char *rate_limit; // Bandwidth limits, see rate_set()
+    size_t tcp_bdp;         // Socket buffers of transfer connections, 0 = kernel default
+    const char *tcp_congestion; // Congestion control of transfer connections
 } options;
 
 static void show_help_text(const char *progname) {
-    printf("Usage: %s [options] <host> <mountpoint>\n\n", progname);
+    printf("Usage: %s [options] <host> <mountpoint>\n", progname);
+    printf("       %s --daemon=FILE [--control=SOCKET] [options]\n\n", progname);
     printf("Options:\n");
-    printf("    -p, --port=PORT          FTP Port (default: 21)\n");
+    printf("    -p, --port=PORT          FTP Port (default: 21, %d with --ftps)\n", FTPS_PORT_DEFAULT);
     printf("    -u, --user=USER          FTP User (default: anonymous)\n");
     printf("    -P, --password=PASS      FTP Password\n");
     printf("    -e, --encoding=ENC       Encoding (default: utf-8)\n");
     printf("    -c, --cache-timeout=SEC  Cache timeout in seconds (default: %d, min: %d, max: %d)\n",
            CACHE_TIMEOUT_DEFAULT, CACHE_TIMEOUT_MIN, CACHE_TIMEOUT_MAX);
+    printf("    --mem-staging=SIZE       Keep files up to SIZE in memory before spilling to disk\n");
+    printf("                             (default: %dK, 0 disables, accepts K/M/G suffixes)\n",
+           STAGING_MEM_DEFAULT / 1024);
+    printf("    --staging-quota=SIZE     Max disk space for temporary files (default: unlimited)\n");
+    printf("    --content-cache=SIZE     Clean file content kept after close (default: %dM, 0 disables)\n",
+           CONTENT_CACHE_DEFAULT / (1024 * 1024));
+    printf("    --connections=N          Fixed number of FTP connections, a third reserved for metadata\n");
+    printf("                             (default: automatic, learned per server; min: %d)\n", FTP_CONNECTIONS_MIN);
+    printf("    --max-connections=N      Most connections the automatic count may reach (default: %d)\n",
+           FTP_CONNECTIONS_MAX_DEFAULT);
+    printf("    --rate-limit=SPEC        Bandwidth limits in bytes/s: a total (10M) or a list of\n");
+    printf("                             total,download,upload,bulk,meta=RATE (default: unlimited)\n");
+    printf("    --tcp-bdp=SIZE           Bandwidth-delay product of the link; transfer connections get\n");
+    printf("                             socket buffers of that size (e.g. 100 Mbit/s x 100 ms = 1250K)\n");
+    printf("    --tcp-congestion=NAME    TCP congestion control for transfer connections (e.g. bbr)\n");
+    printf("    --ftps                   Implicit FTPS: TLS from connect (default port: %d)\n", FTPS_PORT_DEFAULT);
+    printf("    --ftpes                  Explicit FTPS: AUTH TLS, then encrypted control and data\n");
+    printf("    --cacert=FILE            CA certificates to verify the server with (default: system)\n");
+    printf("    --resolve=ADDR[,ADDR]    Connect to these addresses instead of looking the host up\n");
+    printf("    --mirror=HOST[:PORT]     Read-only mirror of the host; reads are spread over the host\n");
+    printf("                             and its mirrors, writes go to the host (up to %d, repeatable)\n",
+           FTP_SERVERS_MAX - 1);
+    printf("    --mount-table=FILE       Serve top-level directories from other servers: lines of\n");
+    printf("                             /DIR HOST[:PORT] [user=U] [password=P] [resolve=A] [mirror=H]\n");
+    printf("    --daemon=FILE            Serve every mount listed in FILE (one HOST MOUNTPOINT [options]\n");
+    printf("                             per line) from this process; --content-cache and\n");
+    printf("                             --staging-quota then limit all mounts together\n");
+    printf("    --control=SOCKET         Daemon control socket: mount, unmount and list commands\n");
+    printf("    --handoff=SOCKET         Hot restart: take the caches over from the process on SOCKET,\n");
+    printf("                             which lets go of the mount, then listen there for the next\n");
+    printf("                             restart\n");
+    printf("    --native-ftp             Built-in FTP engine with persistent control connections\n");
     printf("    --vscode                 Optimized mode for VS Code (extended cache)\n");
     printf("    -d, --debug              Debug mode with detailed logs\n");
     printf("    -f, --foreground         Run in foreground\n");
@@ -46,15 +97,21 @@ static void show_help_text(const char *progname) {
     printf("    %s ftp.example.com /mnt/ftp -u user -P password --vscode -f\n", progname);
 }
 
-static int parse_args(int argc, char *argv[]) {
+static int parse_args(int argc, char *argv[], struct options *opts) {
     // Default values
-    options.port = 21;
-    options.user = "anonymous";
-    options.password = "";
-    options.encoding = "utf-8";
-    options.debug = 0;
-    options.foreground = 0;
-    options.cache_timeout = CACHE_TIMEOUT_DEFAULT;
+    memset(opts, 0, sizeof(*opts));
+    opts->port = 0;       // FTP_PORT_DEFAULT, or FTPS_PORT_DEFAULT with --ftps
+    opts->user = "anonymous";
+    opts->password = "";
+    opts->encoding = "utf-8";
+    opts->debug = 0;
+    opts->foreground = 0;
+    opts->cache_timeout = CACHE_TIMEOUT_DEFAULT;
+    opts->mem_staging = STAGING_MEM_DEFAULT;
+    opts->staging_quota = 0;
+    opts->content_cache = CONTENT_CACHE_DEFAULT;
+    opts->connections = 0;
+    opts->max_connections = FTP_CONNECTIONS_MAX_DEFAULT;
     
     // First pass: process all options (in any position)
     int i = 1;
@@ -67,54 +124,198 @@ static int parse_args(int argc, char *argv[]) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             return -1;
         } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
-            options.debug = 1;
+            opts->debug = 1;
             i++;
         } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--foreground") == 0) {
-            options.foreground = 1;
+            opts->foreground = 1;
             i++;
         } else if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0)) {
             if (i + 1 >= argc || argv[i+1][0] == '-') {
                 fprintf(stderr, "Error: %s requires a value\n", argv[i]);
                 return -1;
             }
-            options.port = atoi(argv[++i]);
+            opts->port = atoi(argv[++i]);
             i++;
         } else if ((strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--user") == 0)) {
             if (i + 1 >= argc || argv[i+1][0] == '-') {
                 fprintf(stderr, "Error: %s requires a value\n", argv[i]);
                 return -1;
             }
-            options.user = argv[++i];
+            opts->user = argv[++i];
             i++;
         } else if ((strcmp(argv[i], "-P") == 0 || strcmp(argv[i], "--password") == 0)) {
             if (i + 1 >= argc || argv[i+1][0] == '-') {
                 fprintf(stderr, "Error: %s requires a value\n", argv[i]);
                 return -1;
             }
-            options.password = argv[++i];
+            opts->password = argv[++i];
             i++;
         } else if ((strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--encoding") == 0)) {
             if (i + 1 >= argc || argv[i+1][0] == '-') {
                 fprintf(stderr, "Error: %s requires a value\n", argv[i]);
                 return -1;
             }
-            options.encoding = argv[++i];
+            opts->encoding = argv[++i];
             i++;
         } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--cache-timeout") == 0)) {
             if (i + 1 >= argc || argv[i+1][0] == '-') {
                 fprintf(stderr, "Error: %s requires a value\n", argv[i]);
                 return -1;
             }
-            options.cache_timeout = atoi(argv[++i]);
-            if (options.cache_timeout < CACHE_TIMEOUT_MIN) {
-                options.cache_timeout = CACHE_TIMEOUT_MIN;
-            } else if (options.cache_timeout > CACHE_TIMEOUT_MAX) {
-                options.cache_timeout = CACHE_TIMEOUT_MAX;
+            opts->cache_timeout = atoi(argv[++i]);
+            if (opts->cache_timeout < CACHE_TIMEOUT_MIN) {
+                opts->cache_timeout = CACHE_TIMEOUT_MIN;
+            } else if (opts->cache_timeout > CACHE_TIMEOUT_MAX) {
+                opts->cache_timeout = CACHE_TIMEOUT_MAX;
             }
             i++;
+        } else if (strcmp(argv[i], "--mem-staging") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            if (parse_size(argv[++i], &opts->mem_staging) < 0) {
+                fprintf(stderr, "Error: invalid size for --mem-staging: %s\n", argv[i]);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--staging-quota") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            if (parse_size(argv[++i], &opts->staging_quota) < 0) {
+                fprintf(stderr, "Error: invalid size for --staging-quota: %s\n", argv[i]);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--content-cache") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            if (parse_size(argv[++i], &opts->content_cache) < 0) {
+                fprintf(stderr, "Error: invalid size for --content-cache: %s\n", argv[i]);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--connections") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            opts->connections = atoi(argv[++i]);
+            if (opts->connections < FTP_CONNECTIONS_MIN) {
+                opts->connections = FTP_CONNECTIONS_MIN;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--max-connections") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            opts->max_connections = atoi(argv[++i]);
+            if (opts->max_connections < FTP_CONNECTIONS_MIN) {
+                opts->max_connections = FTP_CONNECTIONS_MIN;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--rate-limit") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            opts->rate_limit = argv[++i];
+            i++;
+        } else if (strcmp(argv[i], "--tcp-bdp") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            if (parse_size(argv[++i], &opts->tcp_bdp) < 0) {
+                fprintf(stderr, "Error: invalid size for --tcp-bdp: %s\n", argv[i]);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--tcp-congestion") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            opts->tcp_congestion = argv[++i];
+            if (strlen(opts->tcp_congestion) >= sizeof(g_context->tcp_congestion)) {
+                fprintf(stderr, "Error: invalid name for --tcp-congestion: %s\n", opts->tcp_congestion);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--ftps") == 0) {
+            opts->tls = FTP_TLS_IMPLICIT;
+            i++;
+        } else if (strcmp(argv[i], "--ftpes") == 0) {
+            opts->tls = FTP_TLS_EXPLICIT;
+            i++;
+        } else if (strcmp(argv[i], "--cacert") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            opts->cacert = argv[++i];
+            i++;
+        } else if (strcmp(argv[i], "--resolve") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            opts->resolve = argv[++i];
+            if (strlen(opts->resolve) >= sizeof(g_context->resolve)) {
+                fprintf(stderr, "Error: address list too long for --resolve\n");
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--mirror") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            if (opts->mirror_count == FTP_SERVERS_MAX - 1) {
+                fprintf(stderr, "Error: at most %d mirrors\n", FTP_SERVERS_MAX - 1);
+                return -1;
+            }
+            opts->mirrors[opts->mirror_count++] = argv[++i];
+            i++;
+        } else if (strcmp(argv[i], "--mount-table") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            opts->mount_table = argv[++i];
+            i++;
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            opts->daemon_config = argv[++i];
+            i++;
+        } else if (strcmp(argv[i], "--control") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            opts->control = argv[++i];
+            i++;
+        } else if (strcmp(argv[i], "--handoff") == 0) {
+            if (i + 1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "Error: %s requires a value\n", argv[i]);
+                return -1;
+            }
+            opts->handoff = argv[++i];
+            i++;
+        } else if (strcmp(argv[i], "--native-ftp") == 0) {
+            opts->native_ftp = 1;
+            i++;
         } else if (strcmp(argv[i], "--vscode") == 0) {
             // VS Code mode: more aggressive cache for better performance
-            options.cache_timeout = 60;  // 1 minute cache
+            opts->cache_timeout = 60;  // 1 minute cache
             i++;
         } else {
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
@@ -140,24 +341,46 @@ static int parse_args(int argc, char *argv[]) {
         i++;
     }
     
+    // The daemon's mounts come from its configuration file
+    if (opts->daemon_config && non_option_count == 0) {
+        return 0;
+    }
     if (non_option_count != 2) {
         fprintf(stderr, "Error: host and mountpoint required (found: %d)\n", non_option_count);
         return -1;
     }
     
-    options.host = non_options[0];
-    options.mountpoint = non_options[1];
+    opts->host = non_options[0];
+    opts->mountpoint = non_options[1];
+    
+    if (opts->port == 0) {
+        opts->port = opts->tls == FTP_TLS_IMPLICIT ? FTPS_PORT_DEFAULT : FTP_PORT_DEFAULT;
+    }
+    if (opts->native_ftp && opts->tls != FTP_TLS_NONE) {
+        fprintf(stderr, "Warning: --native-ftp does not support TLS, using libcurl\n");
+        opts->native_ftp = 0;
+    }
     
     return 0;
 }
 
+// The host's context, which also holds the mount table. Every mount of a
+// daemon has its own; FUSE hands it back as the private data of each call.
+static cftpfs_context_t* mount_root(void) {
+    return fuse_get_context()->private_data;
+}
+
 static int cftpfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
     (void) fi;
     
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] getattr: %s\n", path);
     }
     
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
+    
     memset(stbuf, 0, sizeof(struct stat));
     
     if (strcmp(path, "/") == 0) {
@@ -168,45 +391,39 @@ static int cftpfs_getattr(const char *path, struct stat *stbuf, struct fuse_file
         return 0;
     }
     
-    pthread_mutex_lock(&g_context->ftp_lock);
-    
     char *parent_path = strdup(path);
-    char *basename = strrchr(parent_path, '/');
-    
-    if (basename) {
-        *basename = '\0';
-        basename++;
-        if (*basename == '\0') {
-            free(parent_path);
-            pthread_mutex_unlock(&g_context->ftp_lock);
-            return -ENOENT;
-        }
-    } else {
+    char *last_slash = strrchr(parent_path, '/');
+    
+    if (!last_slash || last_slash[1] == '\0') {
         free(parent_path);
-        pthread_mutex_unlock(&g_context->ftp_lock);
         return -ENOENT;
     }
+    const char *basename = path + (last_slash - parent_path) + 1;
+    // Entries of the root are listed under "/", as readdir caches them
+    last_slash[last_slash == parent_path ? 1 : 0] = '\0';
     
     ftp_item_t *items = NULL;
     int count = 0;
     int found = 0;
     int items_need_free = 0;
     
-    cache_entry_t *cached = cache_get(g_context, parent_path);
-    if (cached) {
-        count = cached->item_count;
-        if (count > 0) {
-            items = malloc(count * sizeof(ftp_item_t));
-            if (items) {
-                memcpy(items, cached->items, count * sizeof(ftp_item_t));
-                items_need_free = 1;
-            }
-        }
+    if (cache_copy(ctx, parent_path, &items, &count) == 0) {
+        items_need_free = 1;
     } else {
-        if (ftp_list_dir(g_context, parent_path, &items, &count) == 0) {
-            cache_put(g_context, parent_path, items, count);
-            // cache_put takes ownership of items, DO NOT free here
-            items_need_free = 0;
+        int ret = ftp_list_dir(ctx, parent_path, &items, &count);
+        if (ret == 0) {
+            // cache_put takes ownership of items, and another thread may
+            // replace or drop them at once: read a copy
+            cache_put(ctx, parent_path, items, count);
+            items = NULL;
+            if (cache_copy_stale(ctx, parent_path, &items, &count) != 0) {
+                free(parent_path);
+                return -EIO;
+            }
+            items_need_free = 1;
+        } else if (ret == -EHOSTDOWN && cache_copy_stale(ctx, parent_path, &items, &count) == 0) {
+            // Server unreachable: the last known listing beats an error
+            items_need_free = 1;
         }
     }
     
@@ -230,7 +447,6 @@ static int cftpfs_getattr(const char *path, struct stat *stbuf, struct fuse_file
     }
     
     free(parent_path);
-    pthread_mutex_unlock(&g_context->ftp_lock);
     
     return found ? 0 : -ENOENT;
 }
@@ -242,42 +458,58 @@ static int cftpfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     (void) fi;
     (void) flags;
     
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] readdir: %s\n", path);
     }
     
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
+    
     filler(buf, ".", NULL, 0, 0);
     filler(buf, "..", NULL, 0, 0);
     
-    pthread_mutex_lock(&g_context->ftp_lock);
-    
     ftp_item_t *items = NULL;
     int count = 0;
     int items_need_free = 0;
     
-    cache_entry_t *cached = cache_get(g_context, path);
-    if (cached) {
-        count = cached->item_count;
-        if (count > 0) {
-            items = malloc(count * sizeof(ftp_item_t));
-            if (items) {
-                memcpy(items, cached->items, count * sizeof(ftp_item_t));
-                items_need_free = 1;
-            }
-        }
+    if (cache_copy(ctx, path, &items, &count) == 0) {
+        items_need_free = 1;
     } else {
-        if (ftp_list_dir(g_context, path, &items, &count) == 0) {
-            cache_put(g_context, path, items, count);
-            // cache_put takes ownership of items, DO NOT free here
-            items_need_free = 0;
+        int ret = ftp_list_dir(ctx, path, &items, &count);
+        if (ret == 0) {
+            // cache_put takes ownership of items, and another thread may
+            // replace or drop them at once: read a copy
+            cache_put(ctx, path, items, count);
+            items = NULL;
+            if (cache_copy_stale(ctx, path, &items, &count) != 0) {
+                return -EIO;
+            }
+            items_need_free = 1;
+        } else if (ret == -EHOSTDOWN && cache_copy_stale(ctx, path, &items, &count) == 0) {
+            // Server unreachable: the last known listing beats an error
+            items_need_free = 1;
         } else {
-            pthread_mutex_unlock(&g_context->ftp_lock);
-            return -EIO;
+            return ret == -EHOSTDOWN ? -EHOSTDOWN : -EIO;
+        }
+    }
+    
+    // The mount table's directories hide the host's entries of the same name
+    bool merged = (ctx == root && strcmp(path, "/") == 0 && root->shard_count > 0);
+    if (merged) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_mode = S_IFDIR | 0755;
+        for (int i = 0; i < root->shard_count; i++) {
+            filler(buf, root->shards[i].name, &st, 0, 0);
         }
     }
     
     if (items) {
         for (int i = 0; i < count; i++) {
+            if (merged && shard_is_name(root, items[i].name)) {
+                continue;
+            }
             struct stat st;
             memset(&st, 0, sizeof(st));
             st.st_mode = items[i].mode;
@@ -291,59 +523,38 @@ static int cftpfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         }
     }
     
-    pthread_mutex_unlock(&g_context->ftp_lock);
-    
     return 0;
 }
 
 static int cftpfs_open(const char *path, struct fuse_file_info *fi) {
-    if (options.debug) {
-        fprintf(stderr, "[DEBUG] open: %s (flags: %d)\n", path, fi->flags);
-    }
+    cftpfs_context_t *root = mount_root();
     
-    if ((fi->flags & O_ACCMODE) == O_RDONLY) {
-        (void)path;  // Avoid unused parameter warning
-        return 0;
+    if (root->debug) {
+        fprintf(stderr, "[DEBUG] open: %s (flags: %d)\n", path, fi->flags);
     }
     
-    pthread_mutex_lock(&g_context->handles_lock);
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
     
-    file_handle_t *fh = handle_create(g_context, path, fi->flags);
+    // Read-only opens get a handle too, so concurrent readers of one path
+    // share a single download instead of fetching the file on every read.
+    // Content is fetched lazily on first read or write: opens that are
+    // closed without I/O (probes, stat-then-close) cost no transfer.
+    file_handle_t *fh = handle_create(ctx, path, fi->flags);
     if (!fh) {
-        pthread_mutex_unlock(&g_context->handles_lock);
-        return -EMFILE;
-    }
-    
-    int handle_id = -1;
-    for (int i = 0; i < MAX_HANDLES; i++) {
-        if (g_context->file_handles[i] == NULL) {
-            g_context->file_handles[i] = fh;
-            handle_id = i;
-            break;
-        }
+        return -errno;
     }
     
-    if (handle_id < 0) {
-        pthread_mutex_destroy(&fh->lock);
-        if (strlen(fh->temp_path) > 0) {
-            unlink(fh->temp_path);
+    if (fi->flags & O_TRUNC) {
+        int ret = open_file_truncate(ctx, fh->of, 0);
+        if (ret < 0) {
+            handle_release(ctx, fh->id);
+            return ret;
         }
-        free(fh);
-        pthread_mutex_unlock(&g_context->handles_lock);
-        return -EMFILE;
+    } else if (fi->flags & O_CREAT) {
+        open_file_mark_new(ctx, fh->of);
     }
     
-    if (!(fi->flags & O_CREAT) || (fi->flags & O_TRUNC)) {
-        pthread_mutex_lock(&g_context->ftp_lock);
-        ftp_download(g_context, path, fh->temp_path);
-        pthread_mutex_unlock(&g_context->ftp_lock);
-    } else {
-        fh->is_new = true;
-    }
-    
-    pthread_mutex_unlock(&g_context->handles_lock);
-    
-    fi->fh = handle_id;
+    fi->fh = fh->id;
     
     return 0;
 }
@@ -351,7 +562,9 @@ static int cftpfs_open(const char *path, struct fuse_file_info *fi) {
 static int cftpfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     (void) mode;
     
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] create: %s\n", path);
     }
     
@@ -360,83 +573,90 @@ static int cftpfs_create(const char *path, mode_t mode, struct fuse_file_info *f
 
 static int cftpfs_read(const char *path, char *buf, size_t size, off_t offset,
                        struct fuse_file_info *fi) {
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] read: %s (size: %zu, offset: %ld)\n", path, size, offset);
     }
     
-    int fd;
-    char temp_path[MAX_PATH_LEN];
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
     
-    if (fi->fh < MAX_HANDLES && g_context->file_handles[fi->fh]) {
-        file_handle_t *fh = g_context->file_handles[fi->fh];
-        strncpy(temp_path, fh->temp_path, MAX_PATH_LEN - 1);
-        temp_path[MAX_PATH_LEN - 1] = '\0';
-    } else {
-        snprintf(temp_path, MAX_PATH_LEN, "%s/read_%p_%lu", 
-                 g_context->temp_dir, (void*)pthread_self(), time(NULL));
-        
-        pthread_mutex_lock(&g_context->ftp_lock);
-        if (ftp_download(g_context, path, temp_path) != 0) {
-            pthread_mutex_unlock(&g_context->ftp_lock);
+    file_handle_t *fh = handle_get(ctx, fi->fh);
+    
+    if (fh) {
+        if (open_file_load(ctx, fh->of, false) != 0) {
             return -EIO;
         }
-        pthread_mutex_unlock(&g_context->ftp_lock);
+        pthread_mutex_lock(&fh->of->lock);
+        ssize_t bytes_read = staging_read(&fh->of->data, buf, size, offset);
+        pthread_mutex_unlock(&fh->of->lock);
+        return bytes_read;
     }
     
-    fd = open(temp_path, O_RDONLY);
-    if (fd < 0) {
-        return -errno;
-    }
+    staging_t st;
+    staging_init(&st);
     
-    if (lseek(fd, offset, SEEK_SET) < 0) {
-        close(fd);
-        return -errno;
+    if (ftp_download(ctx, path, &st, NULL) != 0) {
+        staging_free(ctx, &st);
+        return -EIO;
     }
     
-    ssize_t bytes_read = read(fd, buf, size);
-    close(fd);
-    
-    if (!(fi->fh < MAX_HANDLES && g_context->file_handles[fi->fh])) {
-        unlink(temp_path);
-    }
+    ssize_t bytes_read = staging_read(&st, buf, size, offset);
+    staging_free(ctx, &st);
     
-    return (bytes_read >= 0) ? bytes_read : -errno;
+    return bytes_read;
 }
 
 static int cftpfs_write(const char *path, const char *buf, size_t size,
                         off_t offset, struct fuse_file_info *fi) {
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] write: %s (size: %zu, offset: %ld)\n", path, size, offset);
     }
     
-    if (fi->fh >= MAX_HANDLES || !g_context->file_handles[fi->fh]) {
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
+    
+    file_handle_t *fh = handle_get(ctx, fi->fh);
+    if (!fh) {
         return -EBADF;
     }
     
-    file_handle_t *fh = g_context->file_handles[fi->fh];
-    pthread_mutex_lock(&fh->lock);
+    open_file_t *of = fh->of;
     
-    int fd = open(fh->temp_path, O_WRONLY | O_CREAT, 0644);
-    if (fd < 0) {
-        pthread_mutex_unlock(&fh->lock);
-        return -errno;
+    // Partial writes need the existing content; a missing file starts empty
+    int ret = open_file_load(ctx, of, true);
+    if (ret != 0) {
+        return ret;
     }
     
-    if (lseek(fd, offset, SEEK_SET) < 0) {
-        close(fd);
-        pthread_mutex_unlock(&fh->lock);
-        return -errno;
+    if (offset < 0) {
+        return -EINVAL;
+    }
+    
+    // Admission to the staging quota can wait a long time for other
+    // handles; do it without of->lock, so that reads and releases of the
+    // file do not wait along
+    pthread_mutex_lock(&of->lock);
+    size_t shortfall;
+    while ((shortfall = staging_shortfall(ctx, &of->data, (size_t)offset + size)) > 0) {
+        pthread_mutex_unlock(&of->lock);
+        ret = staging_admit(ctx, shortfall);
+        if (ret < 0) {
+            return ret;
+        }
+        pthread_mutex_lock(&of->lock);
+        staging_credit(&of->data, shortfall);
     }
     
-    ssize_t bytes_written = write(fd, buf, size);
+    ssize_t bytes_written = staging_write(ctx, &of->data, buf, size, offset);
     if (bytes_written > 0) {
-        fh->dirty = true;
+        of->dirty = true;
     }
     
-    close(fd);
-    pthread_mutex_unlock(&fh->lock);
+    pthread_mutex_unlock(&of->lock);
     
-    return (bytes_written >= 0) ? bytes_written : -errno;
+    return bytes_written;
 }
 
 static int cftpfs_flush(const char *path, struct fuse_file_info *fi) {
@@ -455,56 +675,82 @@ static int cftpfs_fsync(const char *path, int isdatasync, struct fuse_file_info
 }
 
 static int cftpfs_release(const char *path, struct fuse_file_info *fi) {
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] release: %s\n", path);
     }
     
-    if (fi->fh >= MAX_HANDLES || !g_context->file_handles[fi->fh]) {
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
+    
+    file_handle_t *fh = handle_get(ctx, fi->fh);
+    if (!fh) {
         return 0;
     }
     
-    file_handle_t *fh = g_context->file_handles[fi->fh];
-    
-    pthread_mutex_lock(&fh->lock);
-    
-    if (fh->dirty || fh->is_new) {
-        pthread_mutex_lock(&g_context->ftp_lock);
-        ftp_upload(g_context, fh->temp_path, path);
-        pthread_mutex_unlock(&g_context->ftp_lock);
+    open_file_t *of = fh->of;
+    pthread_mutex_lock(&of->lock);
+    
+    // Content is shared, so whichever handle releases first uploads the
+    // changes made through any of them
+    if (of->dirty || of->is_new) {
+        int ret = ftp_upload(ctx, &of->data, path);
+        bool journaled = false;
+        if (ret == 0) {
+            journal_forget(ctx, path);
+        } else if (ret == -EHOSTDOWN &&
+                   journal_add(ctx, path, &of->data, of->remote_mtime, of->is_new) == 0) {
+            // Saved offline: the listing shows it until the journal replays
+            cache_note_file(ctx, path, of->data.size, time(NULL));
+            journaled = true;
+            ret = 0;
+        }
+        if (ret == 0) {
+            // Failed uploads stay dirty, so the content is never cached as clean
+            of->dirty = false;
+            of->is_new = false;
+        }
         
-        char *parent = strdup(path);
-        char *last_slash = strrchr(parent, '/');
+        char *parent = journaled ? NULL : strdup(path);
+        char *last_slash = parent ? strrchr(parent, '/') : NULL;
         if (last_slash && last_slash != parent) {
             *last_slash = '\0';
-            cache_invalidate(g_context, parent);
+            cache_invalidate(ctx, parent);
         }
         free(parent);
     }
     
-    pthread_mutex_unlock(&fh->lock);
+    pthread_mutex_unlock(&of->lock);
     
-    pthread_mutex_lock(&g_context->handles_lock);
-    handle_release(g_context, fi->fh);
-    pthread_mutex_unlock(&g_context->handles_lock);
+    handle_release(ctx, fi->fh);
     
     return 0;
 }
 
 static int cftpfs_unlink(const char *path) {
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] unlink: %s\n", path);
     }
     
-    pthread_mutex_lock(&g_context->ftp_lock);
-    int ret = ftp_delete(g_context, path);
-    pthread_mutex_unlock(&g_context->ftp_lock);
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
+    
+    // Offline, only file content can be saved for later (journal.c)
+    if (breaker_open(ctx)) {
+        return -EROFS;
+    }
+    
+    int ret = ftp_delete(ctx, path);
     
     if (ret == 0) {
+        journal_forget(ctx, path);
+        open_file_invalidate(ctx, path);
         char *parent = strdup(path);
         char *last_slash = strrchr(parent, '/');
         if (last_slash && last_slash != parent) {
             *last_slash = '\0';
-            cache_invalidate(g_context, parent);
+            cache_invalidate(ctx, parent);
         }
         free(parent);
     }
@@ -515,20 +761,25 @@ static int cftpfs_unlink(const char *path) {
 static int cftpfs_mkdir(const char *path, mode_t mode) {
     (void) mode;
     
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] mkdir: %s\n", path);
     }
     
-    pthread_mutex_lock(&g_context->ftp_lock);
-    int ret = ftp_mkdir(g_context, path);
-    pthread_mutex_unlock(&g_context->ftp_lock);
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
+    if (breaker_open(ctx)) {
+        return -EROFS;
+    }
+    
+    int ret = ftp_mkdir(ctx, path);
     
     if (ret == 0) {
         char *parent = strdup(path);
         char *last_slash = strrchr(parent, '/');
         if (last_slash && last_slash != parent) {
             *last_slash = '\0';
-            cache_invalidate(g_context, parent);
+            cache_invalidate(ctx, parent);
         }
         free(parent);
     }
@@ -537,20 +788,30 @@ static int cftpfs_mkdir(const char *path, mode_t mode) {
 }
 
 static int cftpfs_rmdir(const char *path) {
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] rmdir: %s\n", path);
     }
     
-    pthread_mutex_lock(&g_context->ftp_lock);
-    int ret = ftp_rmdir(g_context, path);
-    pthread_mutex_unlock(&g_context->ftp_lock);
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
+    
+    // The root of a backend is where it is attached, not a directory of its own
+    if (strcmp(path, "/") == 0) {
+        return -EBUSY;
+    }
+    if (breaker_open(ctx)) {
+        return -EROFS;
+    }
+    
+    int ret = ftp_rmdir(ctx, path);
     
     if (ret == 0) {
         char *parent = strdup(path);
         char *last_slash = strrchr(parent, '/');
         if (last_slash && last_slash != parent) {
             *last_slash = '\0';
-            cache_invalidate(g_context, parent);
+            cache_invalidate(ctx, parent);
         }
         free(parent);
     }
@@ -561,16 +822,30 @@ static int cftpfs_rmdir(const char *path) {
 static int cftpfs_rename(const char *from, const char *to, unsigned int flags) {
     (void) flags;
     
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] rename: %s -> %s\n", from, to);
     }
     
-    pthread_mutex_lock(&g_context->ftp_lock);
-    int ret = ftp_rename(g_context, from, to);
-    pthread_mutex_unlock(&g_context->ftp_lock);
+    // FTP cannot move files between servers; mv falls back to copying
+    cftpfs_context_t *ctx = shard_route(root, from, &from);
+    if (shard_route(root, to, &to) != ctx) {
+        return -EXDEV;
+    }
+    if (strcmp(from, "/") == 0 || strcmp(to, "/") == 0) {
+        return -EBUSY;
+    }
+    if (breaker_open(ctx)) {
+        return -EROFS;
+    }
+    
+    int ret = ftp_rename(ctx, from, to);
     
     if (ret == 0) {
-        cache_invalidate(g_context, "/");
+        cache_invalidate(ctx, "/");
+        open_file_invalidate(ctx, from);
+        open_file_invalidate(ctx, to);
     }
     
     return ret;
@@ -579,33 +854,45 @@ static int cftpfs_rename(const char *from, const char *to, unsigned int flags) {
 static int cftpfs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
     (void) fi;
     
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] truncate: %s (size: %ld)\n", path, size);
     }
     
-    char temp_path[MAX_PATH_LEN];
-    snprintf(temp_path, MAX_PATH_LEN, "%s/trunc_%p_%lu", 
-             g_context->temp_dir, (void*)pthread_self(), time(NULL));
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
     
-    pthread_mutex_lock(&g_context->ftp_lock);
+    // If the path is open, truncate the shared content; release uploads it
+    open_file_t *of = open_file_lookup(ctx, path);
+    if (of) {
+        int ret = open_file_truncate(ctx, of, size);
+        open_file_release(ctx, of);
+        return ret;
+    }
     
-    if (ftp_download(g_context, path, temp_path) == 0) {
-        truncate(temp_path, size);
-        ftp_upload(g_context, temp_path, path);
-        unlink(temp_path);
-    } else {
-        int fd = open(temp_path, O_WRONLY | O_CREAT, 0644);
-        if (fd >= 0) {
-            ftruncate(fd, size);
-            close(fd);
-            ftp_upload(g_context, temp_path, path);
-            unlink(temp_path);
-        }
+    if (breaker_open(ctx)) {
+        return -EROFS;
     }
     
-    pthread_mutex_unlock(&g_context->ftp_lock);
+    staging_t st;
+    staging_init(&st);
     
-    return 0;
+    // A missing file is created with the requested size, but a file that
+    // could not be fetched must not be replaced
+    int ret = ftp_download(ctx, path, &st, NULL);
+    if (ret != 0 && ret != -ENOENT) {
+        staging_free(ctx, &st);
+        return ret;
+    }
+    ret = staging_truncate(ctx, &st, size);
+    if (ret == 0) {
+        ftp_upload(ctx, &st, path);
+        open_file_invalidate(ctx, path);
+    }
+    
+    staging_free(ctx, &st);
+    
+    return ret;
 }
 
 static int cftpfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
@@ -631,26 +918,148 @@ static int cftpfs_utimens(const char *path, const struct timespec tv[2],
     return 0;
 }
 
+// Copies an attribute value out, or returns its length when size is 0
+static int xattr_reply(const char *text, int len, char *value, size_t size) {
+    if (size == 0) {
+        return len;
+    }
+    if ((size_t)len > size) {
+        return -ERANGE;
+    }
+    memcpy(value, text, len);
+    return len;
+}
+
+// The bandwidth limits are exposed as an extended attribute of the mount
+// root, so they can be changed without remounting:
+//   setfattr -n user.cftpfs.rate_limit -v "download=5M" /mnt/ftp
+// A mount table directory carries the limits of its own backend.
+// Any path can be pinned in the content cache (see pin.c):
+//   setfattr -n user.cftpfs.pin -v 1 /mnt/ftp/reference
+static int cftpfs_setxattr(const char *path, const char *name, const char *value,
+                           size_t size, int flags) {
+    (void) flags;
+    
+    cftpfs_context_t *root = mount_root();
+    cftpfs_context_t *ctx = shard_route(root, path, &path);
+    if (strcmp(name, FTP_PIN_XATTR) == 0) {
+        if (size != 1 || (value[0] != '0' && value[0] != '1')) {
+            return -EINVAL;
+        }
+        if (value[0] == '0') {
+            int ret = pin_remove(ctx, path);
+            return ret == -ENODATA ? 0 : ret;
+        }
+        int ret = pin_add(ctx, path);
+        // The mount root covers the mount table's directories as well
+        if (ctx == root && strcmp(path, "/") == 0) {
+            for (int i = 0; i < root->shard_count; i++) {
+                int shard_ret = pin_add(root->shards[i].ctx, "/");
+                ret = ret < 0 ? ret : shard_ret;
+            }
+        }
+        return ret;
+    }
+    if (strcmp(path, "/") != 0 || strcmp(name, FTP_RATE_XATTR) != 0) {
+        return -ENOTSUP;
+    }
+    char spec[256];
+    if (size >= sizeof(spec)) {
+        return -EINVAL;
+    }
+    memcpy(spec, value, size);
+    spec[size] = '\0';
+    return rate_set(ctx, spec);
+}
+
+static int cftpfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+    cftpfs_context_t *ctx = shard_route(mount_root(), path, &path);
+    
+    char text[256];
+    int len;
+    if (strcmp(name, FTP_PIN_XATTR) == 0) {
+        if (!pin_set(ctx, path)) {
+            return -ENODATA;
+        }
+        len = snprintf(text, sizeof(text), "1");
+    } else if (strcmp(name, FTP_CACHED_XATTR) == 0) {
+        len = pin_format(ctx, path, text, sizeof(text));
+        if (len < 0) {
+            return len;
+        }
+    } else if (strcmp(path, "/") == 0 && strcmp(name, FTP_RATE_XATTR) == 0) {
+        len = rate_format(ctx, text, sizeof(text));
+    } else {
+        return -ENODATA;
+    }
+    return xattr_reply(text, len, value, size);
+}
+
+static int cftpfs_listxattr(const char *path, char *list, size_t size) {
+    cftpfs_context_t *ctx = shard_route(mount_root(), path, &path);
+    
+    char names[sizeof(FTP_CACHED_XATTR) + sizeof(FTP_PIN_XATTR) + sizeof(FTP_RATE_XATTR)];
+    size_t len = 0;
+    memcpy(names, FTP_CACHED_XATTR, sizeof(FTP_CACHED_XATTR));
+    len += sizeof(FTP_CACHED_XATTR);
+    if (pin_set(ctx, path)) {
+        memcpy(names + len, FTP_PIN_XATTR, sizeof(FTP_PIN_XATTR));
+        len += sizeof(FTP_PIN_XATTR);
+    }
+    if (strcmp(path, "/") == 0) {
+        memcpy(names + len, FTP_RATE_XATTR, sizeof(FTP_RATE_XATTR));
+        len += sizeof(FTP_RATE_XATTR);
+    }
+    return xattr_reply(names, len, list, size);
+}
+
+// Removing the rate attribute lifts every limit
+static int cftpfs_removexattr(const char *path, const char *name) {
+    cftpfs_context_t *ctx = shard_route(mount_root(), path, &path);
+    
+    if (strcmp(name, FTP_PIN_XATTR) == 0) {
+        return pin_remove(ctx, path);
+    }
+    if (strcmp(path, "/") != 0 || strcmp(name, FTP_RATE_XATTR) != 0) {
+        return -ENODATA;
+    }
+    return rate_set(ctx, "");
+}
+
 static void* cftpfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
     (void) conn;
     (void) cfg;
     
-    if (options.debug) {
+    cftpfs_context_t *root = mount_root();
+    
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] init\n");
     }
     
-    return g_context;
+    // Log in the connection pools now rather than on the first request
+    keepalive_start(root);
+    for (int i = 0; i < root->shard_count; i++) {
+        keepalive_start(root->shards[i].ctx);
+    }
+    handoff_start();
+    
+    return root;
 }
 
 static void cftpfs_destroy(void *private_data) {
-    (void) private_data;
+    cftpfs_context_t *root = (cftpfs_context_t *)private_data;
     
-    if (options.debug) {
+    if (root->debug) {
         fprintf(stderr, "[DEBUG] destroy\n");
     }
+    
+    for (int i = 0; i < root->shard_count; i++) {
+        keepalive_stop(root->shards[i].ctx);
+    }
+    keepalive_stop(root);
 }
 
-static const struct fuse_operations cftpfs_oper = {
+const struct fuse_operations cftpfs_oper = {
     .getattr     = cftpfs_getattr,
     .readdir     = cftpfs_readdir,
     .open        = cftpfs_open,
@@ -668,55 +1077,250 @@ static const struct fuse_operations cftpfs_oper = {
     .chmod       = cftpfs_chmod,
     .chown       = cftpfs_chown,
     .utimens     = cftpfs_utimens,
+    .setxattr    = cftpfs_setxattr,
+    .getxattr    = cftpfs_getxattr,
+    .listxattr   = cftpfs_listxattr,
+    .removexattr = cftpfs_removexattr,
     .init        = cftpfs_init,
     .destroy     = cftpfs_destroy,
 };
 
+// Creates the context of a backend: the mount's host when shard is NULL,
+// otherwise a mount table entry, which takes whatever it does not set from
+// the mount's options. Returns NULL, after reporting why, on failure.
+static cftpfs_context_t* context_create(const struct options *opts, const shard_t *shard,
+                                        cftpfs_shared_t *shared) {
+    cftpfs_context_t *ctx = calloc(1, sizeof(cftpfs_context_t));
+    if (!ctx) {
+        fprintf(stderr, "Error: Could not allocate memory\n");
+        return NULL;
+    }
+    
+    const char *user = opts->user;
+    const char *password = opts->password;
+    const char *resolve = opts->resolve;
+    if (shard) {
+        if (shard->user[0] || shard->password[0]) {
+            user = shard->user[0] ? shard->user : opts->user;
+            password = shard->password;
+        }
+        resolve = shard->resolve;
+    }
+    snprintf(ctx->host, sizeof(ctx->host), "%s", shard ? shard->host : opts->host);
+    ctx->port = shard ? shard->port : opts->port;
+    snprintf(ctx->user, sizeof(ctx->user), "%s", user);
+    snprintf(ctx->password, sizeof(ctx->password), "%s", password);
+    snprintf(ctx->encoding, sizeof(ctx->encoding), "%s", opts->encoding);
+    ctx->debug = opts->debug;
+    ctx->cache_timeout = opts->cache_timeout;
+    ctx->staging_mem_max = opts->mem_staging;
+    ctx->shared = shared;
+    ctx->native_ftp = opts->native_ftp;
+    ctx->tls = opts->tls;
+    if (opts->cacert) {
+        snprintf(ctx->cacert, sizeof(ctx->cacert), "%s", opts->cacert);
+    }
+    if (resolve) {
+        snprintf(ctx->resolve, sizeof(ctx->resolve), "%s", resolve);
+    }
+    mirror_init(ctx);
+    int mirror_count = shard ? shard->mirror_count : opts->mirror_count;
+    for (int m = 0; m < mirror_count; m++) {
+        const char *mirror = shard ? shard->mirrors[m] : opts->mirrors[m];
+        if (mirror_add(ctx, mirror, ctx->port) < 0) {
+            fprintf(stderr, "Error: invalid mirror: %s\n", mirror);
+            free(ctx);
+            return NULL;
+        }
+        printf("Mirror: %s:%d\n", ctx->servers[m + 1].host, ctx->servers[m + 1].port);
+    }
+    ctx->tcp_buffer = opts->tcp_bdp;
+    if (opts->tcp_congestion) {
+        snprintf(ctx->tcp_congestion, sizeof(ctx->tcp_congestion), "%s", opts->tcp_congestion);
+    }
+    
+    rate_init(ctx);
+    if (opts->rate_limit && rate_set(ctx, opts->rate_limit) < 0) {
+        fprintf(stderr, "Error: invalid --rate-limit: %s\n", opts->rate_limit);
+        free(ctx);
+        return NULL;
+    }
+    
+    // One third of the connections (at least one) serve metadata only.
+    // Without a fixed count the bulk lane gets slots up to the ceiling, and
+    // the autotuner decides how many of them are used.
+    bool automatic = (opts->connections == 0);
+    int connections = automatic ? opts->max_connections : opts->connections;
+    int meta_connections = ((automatic ? FTP_CONNECTIONS_DEFAULT : opts->connections) + 2) / 3;
+    if (lanes_init(ctx, meta_connections, connections - meta_connections) < 0) {
+        fprintf(stderr, "Error: Could not allocate memory\n");
+        free(ctx);
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->cache_lock, NULL);
+    retry_init(ctx);
+    autotune_init(ctx, automatic);
+    intern_init(ctx);
+    open_files_init(ctx);
+    pin_init(ctx);
+    handles_init(ctx);
+    
+    int serial = shared_register(shared, ctx);
+    if (serial < 0) {
+        fprintf(stderr, "Error: Could not allocate memory\n");
+        free(ctx);
+        return NULL;
+    }
+    
+    // Create temporary directory
+    snprintf(ctx->temp_dir, MAX_PATH_LEN, "%s%d_%lu_%d", 
+             TEMP_DIR_PREFIX, getpid(), time(NULL), serial);
+    if (mkdir(ctx->temp_dir, 0700) < 0) {
+        fprintf(stderr, "Error: Could not create temporary directory %s\n", ctx->temp_dir);
+        shared_unregister(shared, ctx);
+        free(ctx);
+        return NULL;
+    }
+    
+    if (ftp_init(ctx) < 0) {
+        fprintf(stderr, "Error: Could not initialize the FTP client\n");
+        shared_unregister(shared, ctx);
+        rmdir(ctx->temp_dir);
+        free(ctx);
+        return NULL;
+    }
+    
+    // Initialize cache
+    cache_init(ctx);
+    journal_init(ctx);
+    
+    return ctx;
+}
+
+static void context_destroy(cftpfs_context_t *ctx) {
+    shared_unregister(ctx->shared, ctx);
+    cache_clear(ctx);
+    journal_cleanup(ctx);
+    handles_cleanup(ctx);
+    open_files_cleanup(ctx);
+    pin_cleanup(ctx);
+    intern_cleanup(ctx);
+    ftp_disconnect(ctx);
+    ftp_cleanup(ctx);
+    autotune_cleanup(ctx);
+    lanes_cleanup(ctx);
+    retry_cleanup(ctx);
+    mirror_cleanup(ctx);
+    rate_cleanup(ctx);
+    
+    // Clean temporary directory
+    char cmd[MAX_PATH_LEN + 50];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", ctx->temp_dir);
+    system(cmd);
+    
+    pthread_mutex_destroy(&ctx->cache_lock);
+    
+    free(ctx);
+}
+
+// Creates the contexts of one mount: the host's, which is returned, and
+// one per entry of its mount table. NULL, after reporting why, on failure.
+static cftpfs_context_t* mount_build(const struct options *opts, cftpfs_shared_t *shared) {
+    cftpfs_context_t *root = context_create(opts, NULL, shared);
+    if (!root || !opts->mount_table) {
+        return root;
+    }
+    
+    int port = opts->tls == FTP_TLS_IMPLICIT ? FTPS_PORT_DEFAULT : FTP_PORT_DEFAULT;
+    int loaded = shard_load(root, opts->mount_table, port);
+    for (int i = 0; loaded == 0 && i < root->shard_count; i++) {
+        shard_t *shard = &root->shards[i];
+        printf("Mount: /%s on %s:%d\n", shard->name, shard->host, shard->port);
+        shard->ctx = context_create(opts, shard, shared);
+        if (!shard->ctx) {
+            loaded = -1;
+        }
+    }
+    if (loaded < 0) {
+        mount_destroy(root);
+        return NULL;
+    }
+    return root;
+}
+
+// Tears down the mount table's backends, then the host's
+void mount_destroy(cftpfs_context_t *root) {
+    handoff_withdraw(root);
+    for (int i = 0; i < root->shard_count; i++) {
+        if (root->shards[i].ctx) {
+            context_destroy(root->shards[i].ctx);
+        }
+    }
+    shard_cleanup(root);
+    context_destroy(root);
+}
+
+// Creates a mount from its command line ("HOST MOUNTPOINT [options]", after
+// argv[0]) for the daemon, and copies its mountpoint out. The staging and
+// content cache limits are the daemon's, shared by all of its mounts.
+cftpfs_context_t* mount_create(int argc, char *argv[], cftpfs_shared_t *shared,
+                               char *mountpoint, size_t size) {
+    struct options opts;
+    if (parse_args(argc, argv, &opts) < 0) {
+        return NULL;
+    }
+    if (opts.daemon_config || opts.handoff || strlen(opts.mountpoint) >= size) {
+        fprintf(stderr, "Error: invalid mount: %s\n", opts.mountpoint);
+        return NULL;
+    }
+    strcpy(mountpoint, opts.mountpoint);
+    return mount_build(&opts, shared);
+}
+
 int main(int argc, char *argv[]) {
     // Parse arguments manually
-    if (parse_args(argc, argv) < 0) {
+    if (parse_args(argc, argv, &options) < 0) {
         show_help_text(argv[0]);
         return 1;
     }
     
+    // Initialize cURL
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    
+    cftpfs_shared_t shared;
+    shared_init(&shared, options.content_cache, options.staging_quota);
+    
+    if (options.daemon_config) {
+        int ret = daemon_run(options.daemon_config, options.control, options.handoff,
+                             &shared, options.foreground);
+        shared_cleanup(&shared);
+        curl_global_cleanup();
+        return ret;
+    }
+    
     printf("cFtpfs v%s - Mounting %s on %s\n", CFTPFS_VERSION, options.host, options.mountpoint);
     printf("User: %s, Port: %d\n", options.user, options.port);
     
     // Initialize context
-    g_context = calloc(1, sizeof(cftpfs_context_t));
+    g_context = mount_build(&options, &shared);
     if (!g_context) {
-        fprintf(stderr, "Error: Could not allocate memory\n");
+        shared_cleanup(&shared);
+        curl_global_cleanup();
         return 1;
     }
     
-    strncpy(g_context->host, options.host, sizeof(g_context->host) - 1);
-    g_context->port = options.port;
-    strncpy(g_context->user, options.user, sizeof(g_context->user) - 1);
-    strncpy(g_context->password, options.password, sizeof(g_context->password) - 1);
-    strncpy(g_context->encoding, options.encoding, sizeof(g_context->encoding) - 1);
-    g_context->debug = options.debug;
-    g_context->cache_timeout = options.cache_timeout;
-    g_context->next_handle = 1;
-    
-    pthread_mutex_init(&g_context->ftp_lock, NULL);
-    pthread_mutex_init(&g_context->cache_lock, NULL);
-    pthread_mutex_init(&g_context->handles_lock, NULL);
-    
-    // Create temporary directory
-    snprintf(g_context->temp_dir, MAX_PATH_LEN, "%s%d_%lu", 
-             TEMP_DIR_PREFIX, getpid(), time(NULL));
-    if (mkdir(g_context->temp_dir, 0700) < 0) {
-        fprintf(stderr, "Error: Could not create temporary directory %s\n", g_context->temp_dir);
-        free(g_context);
-        return 1;
+    // Hot restart: the caches of the running process, which then unmounts
+    if (options.handoff) {
+        if (handoff_receive(options.handoff, options.mountpoint, g_context) < 0 ||
+            handoff_listen(options.handoff, false) < 0) {
+            mount_destroy(g_context);
+            shared_cleanup(&shared);
+            curl_global_cleanup();
+            return 1;
+        }
+        handoff_offer(g_context, options.mountpoint);
     }
     
-    // Initialize cURL
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    
-    // Initialize cache
-    cache_init(g_context);
-    
     // Create FUSE arguments
     struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
     fuse_opt_add_arg(&args, argv[0]);
@@ -725,7 +1329,6 @@ int main(int argc, char *argv[]) {
     if (options.foreground) {
         fuse_opt_add_arg(&args, "-f");
     }
-    fuse_opt_add_arg(&args, "-s");
     
     // Optimization: Configure kernel cache timeouts
     char opt_buf[64];
@@ -738,19 +1341,12 @@ int main(int argc, char *argv[]) {
     
     // Cleanup
     // NOTE: Do not call fuse_opt_free_args, fuse_main handles args memory
-    cache_clear(g_context);
+    if (options.handoff) {
+        handoff_shutdown(options.handoff);
+    }
+    mount_destroy(g_context);
+    shared_cleanup(&shared);
     curl_global_cleanup();
     
-    // Clean temporary directory
-    char cmd[MAX_PATH_LEN + 50];
-    snprintf(cmd, sizeof(cmd), "rm -rf %s", g_context->temp_dir);
-    system(cmd);
-    
-    pthread_mutex_destroy(&g_context->ftp_lock);
-    pthread_mutex_destroy(&g_context->cache_lock);
-    pthread_mutex_destroy(&g_context->handles_lock);
-    
-    free(g_context);
-    
     return ret;
-}
\ No newline at end of file
+}
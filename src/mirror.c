@@ -0,0 +1,162 @@
+/**
+ * mirror.c - Mirror endpoints: reads spread out, writes on the primary
+ *
+ * Besides its host, a mount can name mirrors that serve the same tree
+ * (--mirror). Listings, downloads and SIZE/MDTM checks go to the endpoint
+ * expected to answer first: the lowest command latency, scaled by the
+ * operations already running there. Parallel transfers thus spread over
+ * every endpoint, and their throughput adds up. Operations that change
+ * the tree always go to the primary. Reads stay there too while a change
+ * is in progress and for FTP_MIRROR_LAG seconds afterwards, since the
+ * mirrors may not have it yet.
+ *
+ * When a mirror cannot be reached, reads skip it and the failed one moves
+ * to another endpoint at once. The keepalive thread checks it again with a
+ * NOOP once its cooldown ends, so reads never wait on a dead mirror. The
+ * cooldown doubles while the mirror stays down. The primary's health is
+ * the circuit breaker's (retry.c); while the breaker is open, reads go to
+ * the mirrors only.
+ */
+
+#include "cftpfs.h"
+
+static void server_reset(ftp_server_t *srv) {
+    srv->rtt = 0;
+    srv->active = 0;
+    srv->failures = 0;
+    srv->cooldown = FTP_BREAKER_COOLDOWN_MIN;
+    srv->down_until = 0;
+}
+
+// The primary endpoint is host:port; called before any mirror_add
+void mirror_init(cftpfs_context_t *ctx) {
+    pthread_mutex_init(&ctx->mirror_lock, NULL);
+    ctx->mirror_write_at = 0;
+    ctx->mirror_writes = 0;
+    ctx->mirror_next = 0;
+    ctx->server_count = 1;
+    strcpy(ctx->servers[0].host, ctx->host);
+    ctx->servers[0].port = ctx->port;
+    server_reset(&ctx->servers[0]);
+}
+
+void mirror_cleanup(cftpfs_context_t *ctx) {
+    pthread_mutex_destroy(&ctx->mirror_lock);
+}
+
+// Adds a mirror given as "host", "host:port" or "[ipv6]:port"; without a
+// port it listens on the primary's. Returns -1 if spec is malformed or
+// there are already FTP_SERVERS_MAX endpoints.
+int mirror_add(cftpfs_context_t *ctx, const char *spec, int default_port) {
+    if (ctx->server_count >= FTP_SERVERS_MAX) {
+        return -1;
+    }
+    ftp_server_t *srv = &ctx->servers[ctx->server_count];
+    srv->port = default_port;
+    if (parse_endpoint(spec, srv->host, sizeof(srv->host), &srv->port) < 0) {
+        return -1;
+    }
+    server_reset(srv);
+    ctx->server_count++;
+    return 0;
+}
+
+// Returns the endpoint to run an operation on: the primary for anything
+// that is not read-only, otherwise the healthy endpoint with the lowest
+// expected wait. Latency is sampled from keepalive NOOPs and single
+// commands; an endpoint without a sample yet scores lowest. Ties go round
+// robin. Returns the primary when no mirror can take the read, and the
+// circuit breaker decides.
+int mirror_pick(cftpfs_context_t *ctx, bool read_only) {
+    if (!read_only || ctx->server_count == 1) {
+        return 0;
+    }
+    bool primary_down = breaker_open(ctx);
+
+    pthread_mutex_lock(&ctx->mirror_lock);
+    int best = -1;
+    double best_wait = 0;
+    bool settled = ctx->mirror_writes == 0 && time(NULL) - ctx->mirror_write_at >= FTP_MIRROR_LAG;
+    int first = ctx->mirror_next++ % ctx->server_count;
+    for (int n = 0; n < ctx->server_count && (settled || primary_down); n++) {
+        int i = (first + n) % ctx->server_count;
+        ftp_server_t *srv = &ctx->servers[i];
+        if (i == 0 ? primary_down : srv->failures > 0) {
+            continue;
+        }
+        // The floor lets the operations in flight spread the load before
+        // any latency has been measured
+        double wait = (srv->rtt + 0.001) * (srv->active + 1);
+        if (best < 0 || wait < best_wait) {
+            best = i;
+            best_wait = wait;
+        }
+    }
+    pthread_mutex_unlock(&ctx->mirror_lock);
+    return best < 0 ? 0 : best;
+}
+
+// Counts an operation on the endpoint; a write keeps reads on the primary
+// until FTP_MIRROR_LAG seconds after mirror_end
+void mirror_begin(cftpfs_context_t *ctx, int server, bool write) {
+    pthread_mutex_lock(&ctx->mirror_lock);
+    ctx->servers[server].active++;
+    if (write) {
+        ctx->mirror_writes++;
+    }
+    pthread_mutex_unlock(&ctx->mirror_lock);
+}
+
+// Records the outcome of an operation started with mirror_begin. latency
+// is the response time of a single command, 0 if the operation was not
+// one. A mirror that could not be reached, or turned the login away, is
+// down until the keepalive thread finds it answering again.
+void mirror_end(cftpfs_context_t *ctx, int server, bool write, ftp_err_t err, double latency) {
+    ftp_server_t *srv = &ctx->servers[server];
+    bool failed = (err == FTP_ERR_TRANSIENT || err == FTP_ERR_UNREACHABLE || err == FTP_ERR_REFUSED);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&ctx->mirror_lock);
+    srv->active--;
+    if (write) {
+        ctx->mirror_writes--;
+        ctx->mirror_write_at = now;
+    }
+    if (latency > 0) {
+        srv->rtt = srv->rtt == 0 ? latency : 0.8 * srv->rtt + 0.2 * latency;
+    }
+    if (server > 0 && failed) {
+        if (srv->failures++ == 0) {
+            fprintf(stderr, "Warning: mirror %s:%d is not responding, reading from the others\n",
+                    srv->host, srv->port);
+        } else if (srv->cooldown < FTP_BREAKER_COOLDOWN_MAX) {
+            srv->cooldown = srv->cooldown * 2 > FTP_BREAKER_COOLDOWN_MAX ? FTP_BREAKER_COOLDOWN_MAX
+                                                                       : srv->cooldown * 2;
+        }
+        srv->down_until = now + srv->cooldown;
+    } else if (server > 0 && err != FTP_ERR_CANCELLED) {
+        if (srv->failures > 0) {
+            fprintf(stderr, "Mirror %s:%d is reachable again\n", srv->host, srv->port);
+        }
+        srv->failures = 0;
+        srv->cooldown = FTP_BREAKER_COOLDOWN_MIN;
+    }
+    pthread_mutex_unlock(&ctx->mirror_lock);
+}
+
+// True while reads skip the mirror; the primary is never down here
+bool mirror_down(cftpfs_context_t *ctx, int server) {
+    pthread_mutex_lock(&ctx->mirror_lock);
+    bool down = server > 0 && ctx->servers[server].failures > 0;
+    pthread_mutex_unlock(&ctx->mirror_lock);
+    return down;
+}
+
+// True once a down mirror's cooldown has passed and it should be checked
+bool mirror_probe_due(cftpfs_context_t *ctx, int server) {
+    pthread_mutex_lock(&ctx->mirror_lock);
+    ftp_server_t *srv = &ctx->servers[server];
+    bool due = srv->failures > 0 && time(NULL) >= srv->down_until;
+    pthread_mutex_unlock(&ctx->mirror_lock);
+    return due;
+}
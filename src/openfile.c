@@ -0,0 +1,644 @@
+/**
+ * openfile.c - Shared open-file objects
+ *
+ * Every handle open on a path references the same open_file_t, so
+ * concurrent opens of one path share a single download and a single local
+ * copy. Objects are keyed by interned path pointer. When the last handle
+ * releases an object with clean content it is kept on an LRU list (the
+ * content cache), so reopening a file within cache_timeout does not
+ * download it again. The cache's size limit is shared with the other
+ * contexts of the process; past it, the content cached longest ago in any
+ * of them is dropped, unless the newcomer is opened less often than what
+ * it would displace (shared.c). Past cache_timeout the
+ * content is kept if MDTM and SIZE on the server still match; expired files
+ * of one directory are checked together in a single ftp_batch.
+ *
+ * A download abandoned part way (interrupted, or cut off) keeps what it
+ * received. The next load of the path, also after reopening it, resumes
+ * from there if MDTM shows the file unchanged.
+ *
+ * Pinned content (pin.c) is never evicted.
+ *
+ * While the server is unreachable, cached content is served however old.
+ * A file saved offline is loaded from the upload journal (journal.c) until
+ * the journal has replayed it.
+ */
+
+#include "cftpfs.h"
+
+static inline size_t open_file_bucket(const char *interned) {
+    return ((uintptr_t)interned >> 4) % OPEN_FILE_BUCKETS;
+}
+
+static void open_file_free(cftpfs_context_t *ctx, open_file_t *of) {
+    staging_free(ctx, &of->data);
+    pthread_cond_destroy(&of->cond);
+    pthread_mutex_destroy(&of->lock);
+    path_unintern(ctx, of->path);
+    free(of);
+}
+
+// LRU helpers, called with open_files_lock held
+static void lru_unlink(cftpfs_context_t *ctx, open_file_t *of) {
+    if (of->lru_prev) {
+        of->lru_prev->lru_next = of->lru_next;
+    } else {
+        ctx->content_lru_head = of->lru_next;
+    }
+    if (of->lru_next) {
+        of->lru_next->lru_prev = of->lru_prev;
+    } else {
+        ctx->content_lru_tail = of->lru_prev;
+    }
+    of->lru_prev = of->lru_next = NULL;
+    of->cached = false;
+    ctx->content_cached_bytes -= of->data.size;
+    shared_content_charge(ctx->shared, of, false);
+}
+
+static void lru_push(cftpfs_context_t *ctx, open_file_t *of) {
+    of->lru_prev = NULL;
+    of->lru_next = ctx->content_lru_head;
+    if (ctx->content_lru_head) {
+        ctx->content_lru_head->lru_prev = of;
+    } else {
+        ctx->content_lru_tail = of;
+    }
+    ctx->content_lru_head = of;
+    of->cached = true;
+    of->pinned = pin_covers(ctx, of->path);
+    ctx->content_cached_bytes += of->data.size;
+    shared_content_charge(ctx->shared, of, true);
+}
+
+// Removes an object from the table; open_files_lock must be held
+static void table_unlink(cftpfs_context_t *ctx, open_file_t *of) {
+    open_file_t **pp = &ctx->open_files[open_file_bucket(of->path)];
+    while (*pp && *pp != of) {
+        pp = &(*pp)->next;
+    }
+    if (*pp) {
+        *pp = of->next;
+    }
+}
+
+// Drops a cached (refs == 0) object; open_files_lock must be held
+static void cached_drop(cftpfs_context_t *ctx, open_file_t *of) {
+    lru_unlink(ctx, of);
+    table_unlink(ctx, of);
+    open_file_free(ctx, of);
+}
+
+void open_files_init(cftpfs_context_t *ctx) {
+    memset(ctx->open_files, 0, sizeof(ctx->open_files));
+    ctx->content_lru_head = NULL;
+    ctx->content_lru_tail = NULL;
+    ctx->content_cached_bytes = 0;
+    pthread_mutex_init(&ctx->open_files_lock, NULL);
+}
+
+void open_files_cleanup(cftpfs_context_t *ctx) {
+    pthread_mutex_lock(&ctx->open_files_lock);
+
+    for (size_t i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        open_file_t *of = ctx->open_files[i];
+        while (of) {
+            open_file_t *next = of->next;
+            if (of->cached) {
+                shared_content_charge(ctx->shared, of, false);
+            }
+            open_file_free(ctx, of);
+            of = next;
+        }
+        ctx->open_files[i] = NULL;
+    }
+    ctx->content_lru_head = NULL;
+    ctx->content_lru_tail = NULL;
+    ctx->content_cached_bytes = 0;
+
+    pthread_mutex_unlock(&ctx->open_files_lock);
+    pthread_mutex_destroy(&ctx->open_files_lock);
+}
+
+static open_file_t* open_file_find(cftpfs_context_t *ctx, const char *interned) {
+    for (open_file_t *of = ctx->open_files[open_file_bucket(interned)]; of; of = of->next) {
+        if (of->path == interned) {
+            return of;
+        }
+    }
+    return NULL;
+}
+
+static bool cached_expired(cftpfs_context_t *ctx, open_file_t *of) {
+    int timeout = ctx->cache_timeout > 0 ? ctx->cache_timeout : CACHE_TIMEOUT_DEFAULT;
+    return time(NULL) - of->loaded_at > timeout;
+}
+
+// Content that disagrees with the size in the (fresh) directory listing has
+// certainly changed
+static bool cached_changed(cftpfs_context_t *ctx, open_file_t *of) {
+    ftp_item_t item;
+    return cache_lookup_item(ctx, of->path, &item) == 0 && (size_t)item.size != of->data.size;
+}
+
+static bool same_parent(const char *a, const char *b) {
+    const char *sa = strrchr(a, '/');
+    const char *sb = strrchr(b, '/');
+    return sa && sb && sa - a == sb - b && strncmp(a, b, sa - a) == 0;
+}
+
+// Checks expired content against the server with SIZE and MDTM. Expired
+// cached files in the same directory go into the same batch, so browsing a
+// directory after cache_timeout costs one round trip instead of one per
+// file. Returns 1 if of's content is still current, 0 if it changed, and
+// -EHOSTDOWN if the server could not be asked.
+static int open_file_revalidate(cftpfs_context_t *ctx, open_file_t *of) {
+    const char *paths[REVALIDATE_BATCH_MAX];
+    size_t sizes[REVALIDATE_BATCH_MAX];
+    time_t mtimes[REVALIDATE_BATCH_MAX];
+    time_t loaded[REVALIDATE_BATCH_MAX];
+    bool current[REVALIDATE_BATCH_MAX];
+
+    paths[0] = of->path;
+    sizes[0] = of->data.size;
+    mtimes[0] = of->remote_mtime;
+    loaded[0] = of->loaded_at;
+    int n = 1;
+
+    pthread_mutex_lock(&ctx->open_files_lock);
+    for (open_file_t *c = ctx->content_lru_head; c && n < REVALIDATE_BATCH_MAX; c = c->lru_next) {
+        if (!c->loaded || c->remote_mtime == 0 || !cached_expired(ctx, c) || !same_parent(c->path, of->path)) {
+            continue;
+        }
+        // Hold the path so it outlives the object if that is evicted meanwhile
+        const char *p = path_intern(ctx, c->path);
+        if (!p) {
+            break;
+        }
+        paths[n] = p;
+        sizes[n] = c->data.size;
+        mtimes[n] = c->remote_mtime;
+        loaded[n] = c->loaded_at;
+        n++;
+    }
+    pthread_mutex_unlock(&ctx->open_files_lock);
+
+    ftp_batch_cmd_t cmds[REVALIDATE_BATCH_MAX * 2];
+    for (int i = 0; i < n; i++) {
+        cmds[2 * i].verb = "SIZE";
+        cmds[2 * i].path = paths[i];
+        cmds[2 * i + 1].verb = "MDTM";
+        cmds[2 * i + 1].path = paths[i];
+    }
+
+    int ret = ftp_batch(ctx, cmds, n * 2);
+
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        time_t mtime;
+        current[i] = ret == 0 &&
+                     cmds[2 * i].code == 213 &&
+                     strtoull(cmds[2 * i].reply + 4, NULL, 10) == sizes[i] &&
+                     parse_mdtm_reply(cmds[2 * i + 1].reply, &mtime) == 0 &&
+                     mtime == mtimes[i];
+        kept += current[i];
+    }
+
+    time_t now = time(NULL);
+    pthread_mutex_lock(&ctx->open_files_lock);
+    for (int i = 1; i < n; i++) {
+        open_file_t *c = open_file_find(ctx, paths[i]);
+        // Leave alone anything reopened or reloaded while the batch ran
+        if (ret == 0 && c && c->cached && c->loaded_at == loaded[i]) {
+            if (current[i]) {
+                c->loaded_at = now;
+            } else {
+                cached_drop(ctx, c);
+            }
+        }
+        path_unintern(ctx, paths[i]);
+    }
+    pthread_mutex_unlock(&ctx->open_files_lock);
+
+    if (ctx->debug) {
+        fprintf(stderr, "[DEBUG] content cache revalidate: %s (%d/%d current)\n", of->path, kept, n);
+    }
+    if (ret == -EHOSTDOWN) {
+        return ret;
+    }
+    return current[0];
+}
+
+open_file_t* open_file_acquire(cftpfs_context_t *ctx, const char *path) {
+    const char *interned = path_intern(ctx, path);
+    if (!interned) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    shared_sketch_record(ctx, interned);
+
+    pthread_mutex_lock(&ctx->open_files_lock);
+
+    open_file_t *of = open_file_find(ctx, interned);
+    if (of && of->cached) {
+        lru_unlink(ctx, of);
+        bool expired = cached_expired(ctx, of);
+        if (!of->loaded) {
+            // Partial content of an abandoned download, see open_file_load
+        } else if (cached_changed(ctx, of) || (expired && of->remote_mtime == 0 && !breaker_open(ctx))) {
+            // Stale: reuse the object but fetch the content again
+            staging_free(ctx, &of->data);
+            staging_init(&of->data);
+            of->loaded = false;
+            of->remote_mtime = 0;
+        } else if (expired) {
+            // Probably still current: confirmed with MDTM/SIZE on first I/O
+            of->revalidate = true;
+        } else if (ctx->debug) {
+            fprintf(stderr, "[DEBUG] content cache hit: %s\n", interned);
+        }
+    }
+    if (of) {
+        of->refs++;
+        pthread_mutex_unlock(&ctx->open_files_lock);
+        // The object already holds its own reference to the path
+        path_unintern(ctx, interned);
+        return of;
+    }
+
+    of = calloc(1, sizeof(open_file_t));
+    if (!of) {
+        pthread_mutex_unlock(&ctx->open_files_lock);
+        path_unintern(ctx, interned);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    of->path = interned;
+    of->refs = 1;
+    staging_init(&of->data);
+
+    pthread_mutex_init(&of->lock, NULL);
+    pthread_cond_init(&of->cond, NULL);
+
+    size_t b = open_file_bucket(interned);
+    of->next = ctx->open_files[b];
+    ctx->open_files[b] = of;
+
+    pthread_mutex_unlock(&ctx->open_files_lock);
+    return of;
+}
+
+open_file_t* open_file_lookup(cftpfs_context_t *ctx, const char *path) {
+    const char *interned = path_intern(ctx, path);
+    if (!interned) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ctx->open_files_lock);
+    open_file_t *of = open_file_find(ctx, interned);
+    if (of && of->cached) {
+        // Only objects with live handles are of interest to callers
+        of = NULL;
+    }
+    if (of) {
+        of->refs++;
+    }
+    pthread_mutex_unlock(&ctx->open_files_lock);
+
+    path_unintern(ctx, interned);
+    return of;
+}
+
+int open_file_load(cftpfs_context_t *ctx, open_file_t *of, bool missing_ok) {
+    pthread_mutex_lock(&of->lock);
+
+    // Another handle is already downloading this path: wait for it, and
+    // keep it going should the request that started it be interrupted
+    while (of->loading) {
+        of->data.shared = true;
+        pthread_cond_wait(&of->cond, &of->lock);
+    }
+    if (of->loaded && !of->revalidate) {
+        pthread_mutex_unlock(&of->lock);
+        return 0;
+    }
+    of->loading = true;
+    of->data.shared = false;
+    bool revalidate = of->revalidate;
+    pthread_mutex_unlock(&of->lock);
+
+    // Saved offline and not uploaded yet: the server's copy is older
+    if (journal_pending(ctx, of->path)) {
+        int ret = 0;
+        if (!revalidate) {
+            staging_truncate(ctx, &of->data, 0);
+            ret = journal_read(ctx, of->path, &of->data);
+        }
+        pthread_mutex_lock(&of->lock);
+        of->loading = false;
+        of->revalidate = false;
+        of->loaded = (ret == 0);
+        of->load_error = ret;
+        of->loaded_at = time(NULL);
+        pthread_cond_broadcast(&of->cond);
+        pthread_mutex_unlock(&of->lock);
+        return ret;
+    }
+
+    if (revalidate) {
+        int current = open_file_revalidate(ctx, of);
+
+        pthread_mutex_lock(&of->lock);
+        of->revalidate = false;
+        if (current != 0) {
+            // While the server is unreachable the cached copy is served
+            // as is, still expired, so the next open checks again
+            of->loading = false;
+            if (current > 0) {
+                of->loaded_at = time(NULL);
+            }
+            pthread_cond_broadcast(&of->cond);
+            pthread_mutex_unlock(&of->lock);
+            return 0;
+        }
+        // Changed on the server: drop the old copy and download again
+        staging_free(ctx, &of->data);
+        staging_init(&of->data);
+        of->loaded = false;
+        of->remote_mtime = 0;
+        pthread_mutex_unlock(&of->lock);
+    }
+
+    // Admission control: a file that will land on disk waits for its full
+    // size to fit in the temp_dir quota before the transfer starts
+    int ret = 0;
+    ftp_item_t item;
+    if (cache_lookup_item(ctx, of->path, &item) == 0 && (size_t)item.size > ctx->staging_mem_max) {
+        ret = staging_reserve(ctx, &of->data, item.size);
+    }
+
+    // Content left by an earlier attempt is resumed if still current
+    time_t mtime = of->data.size > 0 ? of->remote_mtime : 0;
+    if (ret == 0) {
+        ret = ftp_download(ctx, of->path, &of->data, &mtime);
+    }
+
+    pthread_mutex_lock(&of->lock);
+    if (ret == -ENOENT && missing_ok) {
+        // Writable opens of a missing file start out empty. Any other
+        // failure (no quota, an unreachable server, an interrupted or
+        // broken download) says nothing about whether the file exists, and
+        // starting empty would overwrite it on release.
+        staging_truncate(ctx, &of->data, 0);
+        mtime = 0;
+        ret = 0;
+    }
+    of->loading = false;
+    of->loaded = (ret == 0);
+    of->load_error = ret;
+    of->loaded_at = time(NULL);
+    of->remote_mtime = mtime;
+    pthread_cond_broadcast(&of->cond);
+    pthread_mutex_unlock(&of->lock);
+
+    return ret;
+}
+
+void open_file_mark_new(cftpfs_context_t *ctx, open_file_t *of) {
+    pthread_mutex_lock(&of->lock);
+    while (of->loading) {
+        pthread_cond_wait(&of->cond, &of->lock);
+    }
+    if (!of->loaded) {
+        if (staging_truncate(ctx, &of->data, 0) == 0) {
+            of->loaded = true;
+            of->loaded_at = time(NULL);
+        }
+    }
+    of->is_new = true;
+    pthread_mutex_unlock(&of->lock);
+}
+
+int open_file_truncate(cftpfs_context_t *ctx, open_file_t *of, off_t size) {
+    // Truncating to zero discards the remote content, so it is never fetched
+    if (size > 0) {
+        int ret = open_file_load(ctx, of, true);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    pthread_mutex_lock(&of->lock);
+    while (of->loading) {
+        pthread_cond_wait(&of->cond, &of->lock);
+    }
+    int ret = staging_truncate(ctx, &of->data, size);
+    if (ret == 0) {
+        if (!of->loaded) {
+            of->loaded_at = time(NULL);
+        }
+        of->loaded = true;
+        of->dirty = true;
+        // Local content now wins over whatever is on the server
+        of->revalidate = false;
+    }
+    pthread_mutex_unlock(&of->lock);
+    return ret;
+}
+
+void open_file_release(cftpfs_context_t *ctx, open_file_t *of) {
+    if (!of) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->open_files_lock);
+
+    if (--of->refs > 0) {
+        pthread_mutex_unlock(&ctx->open_files_lock);
+        return;
+    }
+
+    // No handle is left, so nobody else holds of->lock. Partial content is
+    // kept as well, for the next open to resume.
+    bool partial = !of->loaded && of->data.size > 0 && of->remote_mtime != 0;
+    bool fits = of->data.size <= ctx->shared->content_cache_max || pin_covers(ctx, of->path);
+    if ((of->loaded || partial) && !of->dirty && !of->is_new && fits) {
+        lru_push(ctx, of);
+        uint64_t seq = of->cached_seq;
+        unsigned freq = of->pinned ? 0 : shared_sketch_estimate(ctx, of->path);
+        pthread_mutex_unlock(&ctx->open_files_lock);
+        // Other contexts' locks may be needed to make room
+        if (freq > 0) {
+            shared_content_admit(ctx->shared, ctx, seq, freq);
+        } else {
+            shared_content_trim(ctx->shared);
+        }
+        return;
+    }
+
+    table_unlink(ctx, of);
+    pthread_mutex_unlock(&ctx->open_files_lock);
+
+    open_file_free(ctx, of);
+}
+
+void open_file_invalidate(cftpfs_context_t *ctx, const char *path) {
+    const char *interned = path_intern(ctx, path);
+    if (!interned) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->open_files_lock);
+    open_file_t *of = open_file_find(ctx, interned);
+    if (of && of->cached) {
+        cached_drop(ctx, of);
+    }
+    pthread_mutex_unlock(&ctx->open_files_lock);
+
+    path_unintern(ctx, interned);
+}
+
+// Drops the cached content stamped seq, unless reopened or pinned since
+bool open_file_evict(cftpfs_context_t *ctx, uint64_t seq) {
+    bool evicted = false;
+
+    pthread_mutex_lock(&ctx->open_files_lock);
+    for (open_file_t *of = ctx->content_lru_tail; of; of = of->lru_prev) {
+        if (of->pinned || of->cached_seq != seq) {
+            continue;
+        }
+        if (ctx->debug) {
+            fprintf(stderr, "[DEBUG] content cache evict: %s (%zu bytes)\n", of->path, of->data.size);
+        }
+        cached_drop(ctx, of);
+        evicted = true;
+        break;
+    }
+    pthread_mutex_unlock(&ctx->open_files_lock);
+
+    return evicted;
+}
+
+// Finds the content this context has cached longest ago (only content
+// spilled to disk if disk_only), pinned content and the content stamped
+// skip aside, and how often its path is opened; false if there is none
+bool open_file_oldest(cftpfs_context_t *ctx, bool disk_only, uint64_t skip, uint64_t *seq, unsigned *freq) {
+    bool found = false;
+
+    pthread_mutex_lock(&ctx->open_files_lock);
+    for (open_file_t *of = ctx->content_lru_tail; of; of = of->lru_prev) {
+        if (!of->pinned && of->cached_seq != skip && (!disk_only || of->data.fd >= 0)) {
+            *seq = of->cached_seq;
+            *freq = shared_sketch_estimate(ctx, of->path);
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ctx->open_files_lock);
+
+    return found;
+}
+
+// Takes every cached object out of the table, oldest first, linked through
+// lru_next; each is then freed with open_file_discard (see handoff.c)
+open_file_t* open_file_take_cached(cftpfs_context_t *ctx) {
+    open_file_t *taken = NULL;
+
+    pthread_mutex_lock(&ctx->open_files_lock);
+    // From the newest, so that the oldest ends up first
+    while (ctx->content_lru_head) {
+        open_file_t *of = ctx->content_lru_head;
+        lru_unlink(ctx, of);
+        table_unlink(ctx, of);
+        of->lru_next = taken;
+        taken = of;
+    }
+    pthread_mutex_unlock(&ctx->open_files_lock);
+
+    return taken;
+}
+
+void open_file_discard(cftpfs_context_t *ctx, open_file_t *of) {
+    open_file_free(ctx, of);
+}
+
+// Adds content cached by another process as the newest in the content
+// cache, taking over data. Returns -EEXIST if path already has an object.
+int open_file_adopt(cftpfs_context_t *ctx, const char *path, staging_t *data, bool loaded,
+                    time_t loaded_at, time_t remote_mtime) {
+    const char *interned = path_intern(ctx, path);
+    if (!interned) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&ctx->open_files_lock);
+    if (open_file_find(ctx, interned)) {
+        pthread_mutex_unlock(&ctx->open_files_lock);
+        path_unintern(ctx, interned);
+        return -EEXIST;
+    }
+    open_file_t *of = calloc(1, sizeof(open_file_t));
+    if (!of) {
+        pthread_mutex_unlock(&ctx->open_files_lock);
+        path_unintern(ctx, interned);
+        return -ENOMEM;
+    }
+
+    of->path = interned;
+    of->data = *data;
+    of->loaded = loaded;
+    of->loaded_at = loaded_at;
+    of->remote_mtime = remote_mtime;
+    pthread_mutex_init(&of->lock, NULL);
+    pthread_cond_init(&of->cond, NULL);
+
+    size_t b = open_file_bucket(interned);
+    of->next = ctx->open_files[b];
+    ctx->open_files[b] = of;
+    lru_push(ctx, of);
+    pthread_mutex_unlock(&ctx->open_files_lock);
+
+    staging_init(data);
+    return 0;
+}
+
+// Brings the pinned flag of cached content up to date with the pins
+void open_file_repin(cftpfs_context_t *ctx) {
+    pthread_mutex_lock(&ctx->open_files_lock);
+    for (open_file_t *of = ctx->content_lru_head; of; of = of->lru_next) {
+        of->pinned = pin_covers(ctx, of->path);
+    }
+    pthread_mutex_unlock(&ctx->open_files_lock);
+}
+
+// Adds up the content held for path, or for every file below it if
+// subtree, open or cached: the bytes, the files held in full and those
+// held in part
+void open_file_residency(cftpfs_context_t *ctx, const char *path, bool subtree,
+                         size_t *bytes, int *full, int *partial) {
+    size_t len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+    *bytes = 0;
+    *full = *partial = 0;
+
+    pthread_mutex_lock(&ctx->open_files_lock);
+    for (size_t i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        for (open_file_t *of = ctx->open_files[i]; of; of = of->next) {
+            bool match = subtree ? strncmp(of->path, path, len) == 0 && of->path[len] == '/'
+                                 : strcmp(of->path, path) == 0;
+            if (!match || of->loading) {
+                continue;
+            }
+            if (of->loaded) {
+                (*full)++;
+            } else if (of->data.size > 0) {
+                (*partial)++;
+            } else {
+                continue;
+            }
+            *bytes += of->data.size;
+        }
+    }
+    pthread_mutex_unlock(&ctx->open_files_lock);
+}
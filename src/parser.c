@@ -107,8 +107,9 @@ int parse_unix_listing(const char *line, ftp_item_t *item) {
         }
         // Use current year
         time_t now = time(NULL);
-        struct tm *tm_now = localtime(&now);
-        year = tm_now->tm_year + 1900;
+        struct tm tm_now;
+        localtime_r(&now, &tm_now);
+        year = tm_now.tm_year + 1900;
     } else {
         // Year format: 2023
         while (*p && isdigit((unsigned char)*p)) {
@@ -246,4 +247,123 @@ int parse_ftp_listing(const char *line, ftp_item_t *item) {
     }
     
     return -1;
-}
\ No newline at end of file
+}
+
+int parse_listing_buffer(const char *data, ftp_item_t **items, int *count) {
+    // Parse listing - make copy of buffer because strtok_r modifies the string.
+    // Listings are parsed on several threads at once, so not strtok.
+    char *data_copy = strdup(data);
+    if (!data_copy) {
+        return -1;
+    }
+    
+    // First pass: count lines (servers terminate them with CRLF)
+    *count = 0;
+    char *save;
+    char *line = strtok_r(data_copy, "\r\n", &save);
+    while (line) {
+        (*count)++;
+        line = strtok_r(NULL, "\r\n", &save);
+    }
+    
+    *items = calloc(*count > 0 ? *count : 1, sizeof(ftp_item_t));
+    if (!*items) {
+        free(data_copy);
+        return -1;
+    }
+    
+    // Second pass: parse (restore copy first)
+    strcpy(data_copy, data);
+    int idx = 0;
+    line = strtok_r(data_copy, "\r\n", &save);
+    while (line && idx < *count) {
+        if (parse_ftp_listing(line, &(*items)[idx]) == 0) {
+            idx++;
+        }
+        line = strtok_r(NULL, "\r\n", &save);
+    }
+    
+    *count = idx;
+    free(data_copy);
+    
+    return 0;
+}
+
+// Parses "213 YYYYMMDDhhmmss[.sss]" (RFC 3659, always UTC)
+int parse_mdtm_reply(const char *reply, time_t *mtime) {
+    if (strncmp(reply, "213 ", 4) != 0) {
+        return -1;
+    }
+    
+    struct tm tm = {0};
+    if (sscanf(reply + 4, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    
+    *mtime = timegm(&tm);
+    return *mtime == (time_t)-1 ? -1 : 0;
+}
+
+// Parses a byte count with an optional K/M/G suffix
+int parse_size(const char *str, size_t *out) {
+    char *end;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str) {
+        return -1;
+    }
+    switch (toupper((unsigned char)*end)) {
+        case 'G': value *= 1024;  // fall through
+        case 'M': value *= 1024;  // fall through
+        case 'K': value *= 1024; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *out = (size_t)value;
+    return 0;
+}
+
+// Parses "host", "host:port" or "[ipv6]:port" into host; port is left
+// unchanged when spec has none
+int parse_endpoint(const char *spec, char *host, size_t size, int *port) {
+    const char *start = spec;
+    const char *number = NULL;
+    size_t len;
+    if (spec[0] == '[') {
+        const char *end = strchr(spec, ']');
+        if (!end || (end[1] && end[1] != ':')) {
+            return -1;
+        }
+        start = spec + 1;
+        len = end - start;
+        number = end[1] ? end + 2 : NULL;
+    } else {
+        // A bare IPv6 address has more than one colon and no port
+        const char *colon = strrchr(spec, ':');
+        if (colon && strchr(spec, ':') == colon) {
+            len = colon - spec;
+            number = colon + 1;
+        } else {
+            len = strlen(spec);
+        }
+    }
+    if (len == 0 || len >= size) {
+        return -1;
+    }
+    if (number) {
+        char *end;
+        long value = strtol(number, &end, 10);
+        if (*end || value <= 0 || value > 65535) {
+            return -1;
+        }
+        *port = (int)value;
+    }
+    memcpy(host, start, len);
+    host[len] = '\0';
+    return 0;
+}
@@ -0,0 +1,253 @@
+/**
+ * pin.c - Pinned content
+ *
+ * Setting FTP_PIN_XATTR on a file downloads it into the content cache and
+ * keeps it there: eviction, for the cache's size limit as well as for the
+ * staging quota, passes over it. Set on a directory, it fetches every file
+ * below it, and files added there later are kept once they have been read.
+ * Pinned content still counts against both limits, leaving that much less
+ * room for the rest. It is revalidated like any cached content, so a file
+ * changed on the server is fetched again on its next open.
+ *
+ * FTP_CACHED_XATTR reports how much of a file, or of the files below a
+ * directory, the content cache holds.
+ *
+ * Pins are kept per context, as paths, for as long as it is mounted.
+ */
+
+#include "cftpfs.h"
+
+void pin_init(cftpfs_context_t *ctx) {
+    ctx->pins = NULL;
+    ctx->pin_count = 0;
+    pthread_mutex_init(&ctx->pin_lock, NULL);
+}
+
+void pin_cleanup(cftpfs_context_t *ctx) {
+    for (int i = 0; i < ctx->pin_count; i++) {
+        free(ctx->pins[i]);
+    }
+    free(ctx->pins);
+    ctx->pins = NULL;
+    ctx->pin_count = 0;
+    pthread_mutex_destroy(&ctx->pin_lock);
+}
+
+// True if path is below dir, or is dir
+static bool path_within(const char *path, const char *dir) {
+    size_t len = strlen(dir);
+    if (strcmp(dir, "/") == 0) {
+        return true;
+    }
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Index of the pin set on exactly path, -1 if none; pin_lock held
+static int pin_find(cftpfs_context_t *ctx, const char *path) {
+    for (int i = 0; i < ctx->pin_count; i++) {
+        if (strcmp(ctx->pins[i], path) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// True if path or a directory above it is pinned
+bool pin_covers(cftpfs_context_t *ctx, const char *path) {
+    bool covered = false;
+    pthread_mutex_lock(&ctx->pin_lock);
+    for (int i = 0; i < ctx->pin_count && !covered; i++) {
+        covered = path_within(path, ctx->pins[i]);
+    }
+    pthread_mutex_unlock(&ctx->pin_lock);
+    return covered;
+}
+
+bool pin_set(cftpfs_context_t *ctx, const char *path) {
+    pthread_mutex_lock(&ctx->pin_lock);
+    bool set = pin_find(ctx, path) >= 0;
+    pthread_mutex_unlock(&ctx->pin_lock);
+    return set;
+}
+
+// The listing of a directory, from the cache when fresh. The caller frees
+// *items.
+static int pin_list(cftpfs_context_t *ctx, const char *path, ftp_item_t **items, int *count) {
+    if (cache_copy(ctx, path, items, count) == 0) {
+        return 0;
+    }
+    int ret = ftp_list_dir(ctx, path, items, count);
+    if (ret == 0) {
+        // cache_put takes ownership of items
+        cache_put(ctx, path, *items, *count);
+        return cache_copy_stale(ctx, path, items, count) == 0 ? 0 : -EIO;
+    }
+    if (ret == -EHOSTDOWN && cache_copy_stale(ctx, path, items, count) == 0) {
+        return 0;
+    }
+    return ret;
+}
+
+// Finds path in its parent's listing; the root is a directory
+static int pin_lookup(cftpfs_context_t *ctx, const char *path, ftp_item_t *out) {
+    if (strcmp(path, "/") == 0) {
+        memset(out, 0, sizeof(*out));
+        out->type = FTP_TYPE_DIR;
+        return 0;
+    }
+    char parent[MAX_PATH_LEN];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char *slash = strrchr(parent, '/');
+    if (!slash || slash[1] == '\0') {
+        return -ENOENT;
+    }
+    const char *name = path + (slash - parent) + 1;
+    if (slash == parent) {
+        slash++;
+    }
+    *slash = '\0';
+
+    ftp_item_t *items;
+    int count;
+    int ret = pin_list(ctx, parent, &items, &count);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = -ENOENT;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(items[i].name, name) == 0) {
+            *out = items[i];
+            ret = 0;
+            break;
+        }
+    }
+    free(items);
+    return ret;
+}
+
+static int pin_fetch_file(cftpfs_context_t *ctx, const char *path) {
+    open_file_t *of = open_file_acquire(ctx, path);
+    if (!of) {
+        return -errno;
+    }
+    int ret = open_file_load(ctx, of, false);
+    // Released clean, it goes into the content cache as pinned
+    open_file_release(ctx, of);
+    return ret;
+}
+
+// Fetches path, and everything below it if it is a directory. Goes on past
+// files that fail and returns the first error.
+static int pin_fetch(cftpfs_context_t *ctx, const char *path, ftp_item_type_t type) {
+    if (type == FTP_TYPE_FILE) {
+        return pin_fetch_file(ctx, path);
+    }
+    if (type != FTP_TYPE_DIR) {
+        // Links are not followed
+        return 0;
+    }
+
+    ftp_item_t *items;
+    int count;
+    int ret = pin_list(ctx, path, &items, &count);
+    if (ret < 0) {
+        return ret;
+    }
+    for (int i = 0; i < count; i++) {
+        if (strcmp(items[i].name, ".") == 0 || strcmp(items[i].name, "..") == 0) {
+            continue;
+        }
+        char child[MAX_PATH_LEN];
+        int len = snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") == 0 ? "" : path, items[i].name);
+        if (len < 0 || (size_t)len >= sizeof(child)) {
+            ret = ret < 0 ? ret : -ENAMETOOLONG;
+            continue;
+        }
+        int child_ret = pin_fetch(ctx, child, items[i].type);
+        if (child_ret < 0 && ret == 0) {
+            ret = child_ret;
+        }
+    }
+    free(items);
+    return ret;
+}
+
+// Pins path and downloads what it covers into the content cache. Returns
+// once everything is fetched; the pin stays even if some of it failed.
+int pin_add(cftpfs_context_t *ctx, const char *path) {
+    ftp_item_t item;
+    int ret = pin_lookup(ctx, path, &item);
+    if (ret < 0) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&ctx->pin_lock);
+    if (pin_find(ctx, path) < 0) {
+        char *copy = strdup(path);
+        char **grown = copy ? realloc(ctx->pins, (ctx->pin_count + 1) * sizeof(*grown)) : NULL;
+        if (!grown) {
+            pthread_mutex_unlock(&ctx->pin_lock);
+            free(copy);
+            return -ENOMEM;
+        }
+        ctx->pins = grown;
+        ctx->pins[ctx->pin_count++] = copy;
+    }
+    pthread_mutex_unlock(&ctx->pin_lock);
+
+    // Content cached before is kept from now on, too
+    open_file_repin(ctx);
+
+    ret = pin_fetch(ctx, path, item.type);
+    if (ctx->debug) {
+        fprintf(stderr, "[DEBUG] pin: %s (%s)\n", path, ret == 0 ? "fetched" : strerror(-ret));
+    }
+    return ret;
+}
+
+// Lifts a pin set on path; the content stays cached but may be evicted
+int pin_remove(cftpfs_context_t *ctx, const char *path) {
+    pthread_mutex_lock(&ctx->pin_lock);
+    int i = pin_find(ctx, path);
+    if (i >= 0) {
+        free(ctx->pins[i]);
+        ctx->pins[i] = ctx->pins[--ctx->pin_count];
+    }
+    pthread_mutex_unlock(&ctx->pin_lock);
+    if (i < 0) {
+        return -ENODATA;
+    }
+
+    open_file_repin(ctx);
+    // What was held over the limit can go now
+    shared_content_trim(ctx->shared);
+    return 0;
+}
+
+// Formats FTP_CACHED_XATTR. A file reads state=full or state=partial, with
+// the bytes held and, when partial, the size in the listing; or state=none.
+// A directory reads the number of files below it held in full and in part,
+// and their bytes. Either ends with pinned=1 while covered by a pin.
+int pin_format(cftpfs_context_t *ctx, const char *path, char *out, size_t size) {
+    ftp_item_t item;
+    int ret = pin_lookup(ctx, path, &item);
+    if (ret < 0) {
+        return ret;
+    }
+    bool dir = (item.type == FTP_TYPE_DIR);
+    size_t bytes;
+    int full, partial;
+    open_file_residency(ctx, path, dir, &bytes, &full, &partial);
+
+    char text[256];
+    if (dir) {
+        snprintf(text, sizeof(text), "files=%d,partial=%d,bytes=%zu", full, partial, bytes);
+    } else if (full) {
+        snprintf(text, sizeof(text), "state=full,bytes=%zu", bytes);
+    } else if (partial) {
+        snprintf(text, sizeof(text), "state=partial,bytes=%zu,size=%lld", bytes, (long long)item.size);
+    } else {
+        snprintf(text, sizeof(text), "state=none");
+    }
+    return snprintf(out, size, "%s%s", text, pin_covers(ctx, path) ? ",pinned=1" : "");
+}
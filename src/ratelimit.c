@@ -0,0 +1,195 @@
+/**
+ * ratelimit.c - Bandwidth limits for transfers (token buckets)
+ *
+ * Transfers are charged, as their data passes through the transfer
+ * callbacks, to token buckets for all traffic, for their direction and for
+ * their class: file content (bulk) or directory listings (meta). A bucket
+ * fills at its rate up to one second's worth; a transfer that leaves one of
+ * its buckets in debt sleeps until the debt is paid off.
+ *
+ * Listings are interactive: they are charged to the total and direction
+ * buckets like everything else, but only wait on the meta bucket. A `cp`
+ * saturating the limit therefore slows down to make room for them rather
+ * than keeping `ls` waiting.
+ *
+ * Limits are set with --rate-limit and can be changed while mounted
+ * through the FTP_RATE_XATTR attribute of the mount root.
+ */
+
+#include "cftpfs.h"
+
+#define RATE_SLEEP_MAX 0.25  // Seconds, so a raised limit takes effect quickly
+
+static const char *const rate_names[RATE_BUCKET_COUNT] = {
+    "total", "download", "upload", "bulk", "meta"
+};
+
+void rate_init(cftpfs_context_t *ctx) {
+    pthread_mutex_init(&ctx->rate_lock, NULL);
+    for (int i = 0; i < RATE_BUCKET_COUNT; i++) {
+        ctx->rate_buckets[i].rate = 0;
+        ctx->rate_buckets[i].tokens = 0;
+        clock_gettime(CLOCK_MONOTONIC, &ctx->rate_buckets[i].last);
+    }
+}
+
+void rate_cleanup(cftpfs_context_t *ctx) {
+    pthread_mutex_destroy(&ctx->rate_lock);
+}
+
+// Called with rate_lock held
+static void rate_refill(rate_bucket_t *b, const struct timespec *now) {
+    double elapsed = (now->tv_sec - b->last.tv_sec) + (now->tv_nsec - b->last.tv_nsec) / 1e9;
+    b->last = *now;
+    if (b->rate > 0 && elapsed > 0) {
+        b->tokens += b->rate * elapsed;
+        if (b->tokens > b->rate) {
+            b->tokens = b->rate;
+        }
+    }
+}
+
+// Parses one limit: a size with K/M/G suffix, "0" or "unlimited" for none
+static int rate_parse_value(const char *str, double *out) {
+    size_t value;
+    if (strcmp(str, "unlimited") == 0) {
+        value = 0;
+    } else if (parse_size(str, &value) < 0) {
+        return -1;
+    }
+    if (value > 0 && value < FTP_RATE_MIN) {
+        value = FTP_RATE_MIN;
+    }
+    *out = (double)value;
+    return 0;
+}
+
+// Replaces every limit with those in spec: a comma-separated list of
+// name=rate pairs, where a bare rate is the total limit ("10M",
+// "download=8M,meta=1M"). Buckets not named become unlimited.
+int rate_set(cftpfs_context_t *ctx, const char *spec) {
+    double rates[RATE_BUCKET_COUNT] = {0};
+    char copy[256];
+    if (strlen(spec) >= sizeof(copy)) {
+        return -EINVAL;
+    }
+    strcpy(copy, spec);
+
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ", \t\n", &save); item; item = strtok_r(NULL, ", \t\n", &save)) {
+        int bucket = RATE_TOTAL;
+        char *value = strchr(item, '=');
+        if (value) {
+            *value++ = '\0';
+            for (bucket = 0; bucket < RATE_BUCKET_COUNT; bucket++) {
+                if (strcmp(item, rate_names[bucket]) == 0) {
+                    break;
+                }
+            }
+            if (bucket == RATE_BUCKET_COUNT) {
+                return -EINVAL;
+            }
+        } else {
+            value = item;
+        }
+        if (rate_parse_value(value, &rates[bucket]) < 0) {
+            return -EINVAL;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&ctx->rate_lock);
+    for (int i = 0; i < RATE_BUCKET_COUNT; i++) {
+        ctx->rate_buckets[i].rate = rates[i];
+        ctx->rate_buckets[i].tokens = 0;
+        ctx->rate_buckets[i].last = now;
+    }
+    pthread_mutex_unlock(&ctx->rate_lock);
+
+    if (ctx->debug) {
+        char text[256];
+        rate_format(ctx, text, sizeof(text));
+        fprintf(stderr, "[DEBUG] bandwidth limits: %s\n", text);
+    }
+    return 0;
+}
+
+// Writes the current limits in the format rate_set accepts, "unlimited"
+// when there are none. Returns the length, as snprintf.
+int rate_format(cftpfs_context_t *ctx, char *out, size_t size) {
+    double rates[RATE_BUCKET_COUNT];
+    pthread_mutex_lock(&ctx->rate_lock);
+    for (int i = 0; i < RATE_BUCKET_COUNT; i++) {
+        rates[i] = ctx->rate_buckets[i].rate;
+    }
+    pthread_mutex_unlock(&ctx->rate_lock);
+
+    char text[256] = "";
+    size_t len = 0;
+    for (int i = 0; i < RATE_BUCKET_COUNT; i++) {
+        if (rates[i] == 0) {
+            continue;
+        }
+        unsigned long long value = (unsigned long long)rates[i];
+        const char *suffix = "";
+        if (value % (1024 * 1024) == 0) {
+            value /= 1024 * 1024;
+            suffix = "M";
+        } else if (value % 1024 == 0) {
+            value /= 1024;
+            suffix = "K";
+        }
+        len += snprintf(text + len, sizeof(text) - len, "%s%s=%llu%s",
+                        len ? "," : "", rate_names[i], value, suffix);
+    }
+    return snprintf(out, size, "%s", len ? text : "unlimited");
+}
+
+// Charges bytes that a transfer on the given lane has just moved, and
+// sleeps while a bucket it waits on is in debt. An interrupted request
+// stops waiting; the transfer's own checks then abort it.
+void rate_take(cftpfs_context_t *ctx, ftp_lane_id_t lane, bool upload, size_t bytes) {
+    rate_bucket_id_t own = (lane == FTP_LANE_META) ? RATE_META : RATE_BULK;
+    rate_bucket_id_t charged[] = { RATE_TOTAL, upload ? RATE_UPLOAD : RATE_DOWNLOAD, own };
+    int waited_from = (lane == FTP_LANE_META) ? 2 : 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&ctx->rate_lock);
+    for (int i = 0; i < 3; i++) {
+        rate_bucket_t *b = &ctx->rate_buckets[charged[i]];
+        if (b->rate > 0) {
+            rate_refill(b, &now);
+            b->tokens -= bytes;
+        }
+    }
+
+    for (;;) {
+        double wait = 0;
+        for (int i = waited_from; i < 3; i++) {
+            rate_bucket_t *b = &ctx->rate_buckets[charged[i]];
+            if (b->rate > 0) {
+                rate_refill(b, &now);
+                if (b->tokens < 0 && -b->tokens / b->rate > wait) {
+                    wait = -b->tokens / b->rate;
+                }
+            }
+        }
+        if (wait == 0 || fuse_interrupted()) {
+            break;
+        }
+        pthread_mutex_unlock(&ctx->rate_lock);
+
+        if (wait > RATE_SLEEP_MAX) {
+            wait = RATE_SLEEP_MAX;
+        }
+        struct timespec ts = { 0, (long)(wait * 1e9) };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&ctx->rate_lock);
+    }
+    pthread_mutex_unlock(&ctx->rate_lock);
+}
@@ -0,0 +1,133 @@
+/**
+ * retry.c - Retry policy and circuit breaker for FTP operations
+ *
+ * Failed operations are classified (ftp_err_t) from the libcurl result or
+ * the FTP reply code. Refusals the server may lift (4xx) and lost
+ * connections are retried with jittered exponential backoff; 5xx replies
+ * and local errors are not.
+ *
+ * Consecutive connection failures open the circuit breaker: while the
+ * server is considered down every operation fails at once with -EHOSTDOWN,
+ * and the mount works offline: callers serve what they have cached instead,
+ * and saved files wait in the upload journal (journal.c). After a cooldown one
+ * operation is let through as a probe; its outcome closes the breaker or
+ * reopens it with a longer cooldown.
+ */
+
+#include "cftpfs.h"
+
+void retry_init(cftpfs_context_t *ctx) {
+    pthread_mutex_init(&ctx->breaker_lock, NULL);
+    ctx->breaker_state = BREAKER_CLOSED;
+    ctx->breaker_failures = 0;
+    ctx->breaker_cooldown = FTP_BREAKER_COOLDOWN_MIN;
+    srandom((unsigned)time(NULL) ^ (unsigned)getpid());
+}
+
+void retry_cleanup(cftpfs_context_t *ctx) {
+    pthread_mutex_destroy(&ctx->breaker_lock);
+}
+
+// Codes below 100 stand for "no reply at all" (connection lost)
+ftp_err_t ftp_reply_class(int code) {
+    if (code < 100) {
+        return FTP_ERR_TRANSIENT;
+    }
+    if (code >= 400 && code < 500) {
+        return FTP_ERR_BUSY;
+    }
+    return FTP_ERR_PERMANENT;
+}
+
+// A lost connection leaves it unknown whether a command took effect, so
+// only operations that are safe to repeat are retried after one. 4xx
+// replies mean the action was not taken, and an unreachable or refusing
+// server never saw the command.
+bool retry_allowed(ftp_err_t err, bool idempotent) {
+    switch (err) {
+        case FTP_ERR_BUSY:
+        case FTP_ERR_UNREACHABLE:
+        case FTP_ERR_REFUSED:
+            return true;
+        case FTP_ERR_TRANSIENT:
+            return idempotent;
+        default:
+            return false;
+    }
+}
+
+// Sleeps before retry number `attempt` (0-based). Full jitter: a random
+// delay up to the exponential bound, so clients that failed together do
+// not come back together.
+void retry_backoff(cftpfs_context_t *ctx, int attempt) {
+    long bound = FTP_RETRY_BASE_MS << (attempt < 16 ? attempt : 16);
+    if (bound > FTP_RETRY_CAP_MS) {
+        bound = FTP_RETRY_CAP_MS;
+    }
+    long ms = random() % (bound + 1);
+
+    if (ctx->debug) {
+        fprintf(stderr, "[DEBUG] retry %d in %ldms\n", attempt + 1, ms);
+    }
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+// Returns false if the operation must fail fast because the server is
+// considered down. Once the cooldown has passed the first caller becomes the
+// probe; everyone else keeps failing fast until its result is recorded.
+bool breaker_allow(cftpfs_context_t *ctx) {
+    pthread_mutex_lock(&ctx->breaker_lock);
+    bool allow = true;
+    if (ctx->breaker_state == BREAKER_HALF_OPEN) {
+        allow = false;
+    } else if (ctx->breaker_state == BREAKER_OPEN) {
+        allow = time(NULL) >= ctx->breaker_until;
+        if (allow) {
+            ctx->breaker_state = BREAKER_HALF_OPEN;
+        }
+    }
+    pthread_mutex_unlock(&ctx->breaker_lock);
+    return allow;
+}
+
+// Records the outcome of an operation let through by breaker_allow. Any
+// reply from the server, even a refusal, shows that it is up.
+void breaker_record(cftpfs_context_t *ctx, ftp_err_t err) {
+    bool failed = (err == FTP_ERR_TRANSIENT || err == FTP_ERR_UNREACHABLE);
+
+    pthread_mutex_lock(&ctx->breaker_lock);
+    if (!failed) {
+        if (ctx->breaker_state != BREAKER_CLOSED) {
+            fprintf(stderr, "FTP server %s:%d is reachable again\n", ctx->host, ctx->port);
+        }
+        ctx->breaker_state = BREAKER_CLOSED;
+        ctx->breaker_failures = 0;
+        ctx->breaker_cooldown = FTP_BREAKER_COOLDOWN_MIN;
+    } else if (ctx->breaker_state == BREAKER_HALF_OPEN) {
+        // The probe failed: stay open, and wait longer before the next one
+        ctx->breaker_cooldown *= 2;
+        if (ctx->breaker_cooldown > FTP_BREAKER_COOLDOWN_MAX) {
+            ctx->breaker_cooldown = FTP_BREAKER_COOLDOWN_MAX;
+        }
+        ctx->breaker_state = BREAKER_OPEN;
+        ctx->breaker_until = time(NULL) + ctx->breaker_cooldown;
+    } else if (++ctx->breaker_failures >= FTP_BREAKER_THRESHOLD && ctx->breaker_state == BREAKER_CLOSED) {
+        fprintf(stderr, "Warning: FTP server %s:%d is not responding, working offline for %ds\n",
+                ctx->host, ctx->port, ctx->breaker_cooldown);
+        ctx->breaker_state = BREAKER_OPEN;
+        ctx->breaker_until = time(NULL) + ctx->breaker_cooldown;
+    }
+    pthread_mutex_unlock(&ctx->breaker_lock);
+}
+
+// True while operations on the server would fail fast, without taking the
+// probe's turn the way breaker_allow does. Reads then use a mirror.
+bool breaker_open(cftpfs_context_t *ctx) {
+    pthread_mutex_lock(&ctx->breaker_lock);
+    bool open = ctx->breaker_state == BREAKER_HALF_OPEN ||
+                (ctx->breaker_state == BREAKER_OPEN && time(NULL) < ctx->breaker_until);
+    pthread_mutex_unlock(&ctx->breaker_lock);
+    return open;
+}
@@ -0,0 +1,167 @@
+/**
+ * shard.c - Mount table: top-level directories served by other servers
+ *
+ * One mount can span several FTP servers (--mount-table). Each line of the
+ * table names a directory at the root of the mount and the server whose
+ * tree appears under it:
+ *
+ *   # directory  host[:port]        [user=U] [password=P] [resolve=A] [mirror=H]...
+ *   /projects    ftp2.example.com   user=alice password=secret
+ *   /archive     [2001:db8::7]:2121 mirror=archive2.example.com
+ *
+ * Every other path is served by the host on the command line. Each backend
+ * gets a context of its own, created by main from the entry and the
+ * command-line settings: connections, caches, staging, keepalive and
+ * circuit breaker are per server, so a slow or failing one does not hold
+ * up the others, while all of them share the process and its FUSE threads.
+ * Paths are routed by their first component before anything else happens;
+ * the root listing merges the backends' directories into the host's.
+ */
+
+#include "cftpfs.h"
+
+#define SHARD_LINE_MAX 2048
+
+// Fills one key=value option of an entry; returns -1 for an unknown key or
+// a value that does not fit
+static int shard_option(shard_t *shard, char *option) {
+    char *value = strchr(option, '=');
+    if (!value) {
+        return -1;
+    }
+    *value++ = '\0';
+    char *field = NULL;
+    size_t size = 0;
+    if (strcmp(option, "user") == 0) {
+        field = shard->user;
+        size = sizeof(shard->user);
+    } else if (strcmp(option, "password") == 0) {
+        field = shard->password;
+        size = sizeof(shard->password);
+    } else if (strcmp(option, "resolve") == 0) {
+        field = shard->resolve;
+        size = sizeof(shard->resolve);
+    } else if (strcmp(option, "mirror") == 0 && shard->mirror_count < FTP_SERVERS_MAX - 1) {
+        field = shard->mirrors[shard->mirror_count++];
+        size = sizeof(shard->mirrors[0]);
+    }
+    if (!field || strlen(value) >= size) {
+        return -1;
+    }
+    strcpy(field, value);
+    return 0;
+}
+
+// Parses one non-empty line into shard
+static int shard_parse(cftpfs_context_t *root, char *line, shard_t *shard, int default_port) {
+    char *save = NULL;
+    char *dir = strtok_r(line, " \t\r\n", &save);
+    char *endpoint = strtok_r(NULL, " \t\r\n", &save);
+    if (!dir || !endpoint || dir[0] != '/') {
+        return -1;
+    }
+    const char *name = dir + 1;
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '/') {
+        len--;
+    }
+    if (len == 0 || len >= sizeof(shard->name) || memchr(name, '/', len) ||
+        (len == 1 && name[0] == '.') || (len == 2 && strncmp(name, "..", 2) == 0)) {
+        return -1;
+    }
+    memcpy(shard->name, name, len);
+    shard->name[len] = '\0';
+    shard->name_len = len;
+    if (shard_is_name(root, shard->name)) {
+        return -1;
+    }
+
+    shard->port = default_port;
+    if (parse_endpoint(endpoint, shard->host, sizeof(shard->host), &shard->port) < 0) {
+        return -1;
+    }
+    for (char *option = strtok_r(NULL, " \t\r\n", &save); option; option = strtok_r(NULL, " \t\r\n", &save)) {
+        if (shard_option(shard, option) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reads the mount table into root->shards. Backends listen on default_port
+// unless their entry says otherwise. Returns -1, after reporting the line,
+// if the file cannot be read or has an invalid entry.
+int shard_load(cftpfs_context_t *root, const char *file, int default_port) {
+    FILE *fp = fopen(file, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: cannot read mount table %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    char line[SHARD_LINE_MAX];
+    int number = 0;
+    int ret = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        number++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        if (line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+
+        shard_t *grown = realloc(root->shards, (root->shard_count + 1) * sizeof(shard_t));
+        if (!grown) {
+            fprintf(stderr, "Error: Could not allocate memory\n");
+            ret = -1;
+            break;
+        }
+        root->shards = grown;
+        shard_t *shard = &root->shards[root->shard_count];
+        memset(shard, 0, sizeof(*shard));
+        if (shard_parse(root, line, shard, default_port) < 0) {
+            fprintf(stderr, "Error: %s:%d: invalid mount table entry\n", file, number);
+            ret = -1;
+            break;
+        }
+        root->shard_count++;
+    }
+    fclose(fp);
+    return ret;
+}
+
+// Frees the table; the backends' contexts are main's to tear down
+void shard_cleanup(cftpfs_context_t *root) {
+    free(root->shards);
+    root->shards = NULL;
+    root->shard_count = 0;
+}
+
+// Returns the context serving path and sets *rest to the path on that
+// backend: "/projects/a" is "/a" there, "/projects" its root
+cftpfs_context_t* shard_route(cftpfs_context_t *root, const char *path, const char **rest) {
+    *rest = path;
+    for (int i = 0; i < root->shard_count; i++) {
+        shard_t *shard = &root->shards[i];
+        if (strncmp(path + 1, shard->name, shard->name_len) != 0) {
+            continue;
+        }
+        const char *tail = path + 1 + shard->name_len;
+        if (*tail == '/' || *tail == '\0') {
+            *rest = *tail ? tail : "/";
+            return shard->ctx;
+        }
+    }
+    return root;
+}
+
+// True if name, at the root of the mount, is a backend's directory
+bool shard_is_name(cftpfs_context_t *root, const char *name) {
+    for (int i = 0; i < root->shard_count; i++) {
+        if (strcmp(root->shards[i].name, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,236 @@
+/**
+ * shared.c - Resources shared by the contexts of one process
+ *
+ * A context holds what one server needs: its connections, caches and open
+ * files. A mount with a mount table has several, and a daemon (daemon.c)
+ * has several per mount. They share the content cache's size limit, the
+ * staging quota and the keepalive thread (keepalive.c). A busy mount can
+ * therefore use room an idle one does not need, and dozens of mounts cost
+ * a single keepalive thread.
+ *
+ * The content cache behaves as one LRU. Each context keeps its own list,
+ * but every entry is stamped when it is cached. Past the limit, the entry
+ * with the oldest stamp in any context is dropped first.
+ *
+ * Admission keeps a scan (find, a backup, grep -r) from flushing it: a
+ * count-min sketch estimates how often each path has been opened lately,
+ * and content that only fits by evicting something is cached only if it is
+ * opened more often than each entry it would displace (TinyLFU). A file
+ * read once is then dropped at close instead, and gets in once it is
+ * opened more often than the oldest content. Every counter is halved each
+ * CONTENT_SKETCH_PERIOD opens, so what was popular long ago fades.
+ *
+ * Content pinned in a context (pin.c) is passed over. Past the limit,
+ * pinned content stays and the rest of the cache makes room for it.
+ *
+ * Lock order: shared->lock, then a context's open_files_lock, then
+ * content_lock, quota_lock or pin_lock.
+ */
+
+#include "cftpfs.h"
+
+void shared_init(cftpfs_shared_t *shared, size_t content_cache_max, size_t staging_quota) {
+    memset(shared, 0, sizeof(*shared));
+    pthread_mutex_init(&shared->lock, NULL);
+    shared->content_cache_max = content_cache_max;
+    pthread_mutex_init(&shared->content_lock, NULL);
+    shared->staging_quota = staging_quota;
+    quota_init(shared);
+    pthread_mutex_init(&shared->keepalive_lock, NULL);
+    pthread_cond_init(&shared->keepalive_cond, NULL);
+}
+
+// Called once every context is gone
+void shared_cleanup(cftpfs_shared_t *shared) {
+    keepalive_shutdown(shared);
+    pthread_cond_destroy(&shared->keepalive_cond);
+    pthread_mutex_destroy(&shared->keepalive_lock);
+    free(shared->keepalive_contexts);
+    quota_cleanup(shared);
+    pthread_mutex_destroy(&shared->content_lock);
+    pthread_mutex_destroy(&shared->lock);
+    free(shared->contexts);
+}
+
+// Adds a context, whose shared field must already point here. Returns a
+// number unique in the process, -1 if out of memory.
+int shared_register(cftpfs_shared_t *shared, cftpfs_context_t *ctx) {
+    pthread_mutex_lock(&shared->lock);
+    cftpfs_context_t **grown = realloc(shared->contexts, (shared->context_count + 1) * sizeof(*grown));
+    if (!grown) {
+        pthread_mutex_unlock(&shared->lock);
+        return -1;
+    }
+    shared->contexts = grown;
+    shared->contexts[shared->context_count++] = ctx;
+    int serial = shared->context_serial++;
+    pthread_mutex_unlock(&shared->lock);
+    return serial;
+}
+
+void shared_unregister(cftpfs_shared_t *shared, cftpfs_context_t *ctx) {
+    pthread_mutex_lock(&shared->lock);
+    for (int i = 0; i < shared->context_count; i++) {
+        if (shared->contexts[i] == ctx) {
+            shared->contexts[i] = shared->contexts[--shared->context_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shared->lock);
+}
+
+// Accounts for content entering (add) or leaving the content cache; called
+// with the owning context's open_files_lock held
+void shared_content_charge(cftpfs_shared_t *shared, open_file_t *of, bool add) {
+    pthread_mutex_lock(&shared->content_lock);
+    if (add) {
+        shared->content_cached_bytes += of->data.size;
+        of->cached_seq = ++shared->content_clock;
+    } else {
+        shared->content_cached_bytes -= of->data.size;
+    }
+    pthread_mutex_unlock(&shared->content_lock);
+}
+
+// Two independent hashes of a context's path, from which every row's
+// index is derived (Kirsch-Mitzenmacher)
+static void sketch_hash(cftpfs_context_t *ctx, const char *path, uint32_t *h1, uint32_t *h2) {
+    uint64_t h = 1469598103934665603ULL ^ (uintptr_t)ctx;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    *h1 = (uint32_t)h;
+    *h2 = (uint32_t)(h >> 32) | 1;
+}
+
+// Counts an open of path
+void shared_sketch_record(cftpfs_context_t *ctx, const char *path) {
+    cftpfs_shared_t *shared = ctx->shared;
+    uint32_t h1, h2;
+    sketch_hash(ctx, path, &h1, &h2);
+
+    pthread_mutex_lock(&shared->content_lock);
+    // Conservative update: only the smallest counters grow, which keeps
+    // the estimate of paths sharing a counter closer to the truth
+    unsigned min = CONTENT_SKETCH_MAX;
+    for (int r = 0; r < CONTENT_SKETCH_ROWS; r++) {
+        unsigned c = shared->content_sketch[r][(h1 + r * h2) & (CONTENT_SKETCH_WIDTH - 1)];
+        min = c < min ? c : min;
+    }
+    for (int r = 0; r < CONTENT_SKETCH_ROWS && min < CONTENT_SKETCH_MAX; r++) {
+        uint8_t *c = &shared->content_sketch[r][(h1 + r * h2) & (CONTENT_SKETCH_WIDTH - 1)];
+        if (*c == min) {
+            (*c)++;
+        }
+    }
+    if (++shared->content_sketch_samples >= CONTENT_SKETCH_PERIOD) {
+        for (int r = 0; r < CONTENT_SKETCH_ROWS; r++) {
+            for (int i = 0; i < CONTENT_SKETCH_WIDTH; i++) {
+                shared->content_sketch[r][i] >>= 1;
+            }
+        }
+        shared->content_sketch_samples /= 2;
+    }
+    pthread_mutex_unlock(&shared->content_lock);
+}
+
+// How often path has been opened lately, at least 1 once it was opened
+unsigned shared_sketch_estimate(cftpfs_context_t *ctx, const char *path) {
+    cftpfs_shared_t *shared = ctx->shared;
+    uint32_t h1, h2;
+    sketch_hash(ctx, path, &h1, &h2);
+
+    pthread_mutex_lock(&shared->content_lock);
+    unsigned min = CONTENT_SKETCH_MAX;
+    for (int r = 0; r < CONTENT_SKETCH_ROWS; r++) {
+        unsigned c = shared->content_sketch[r][(h1 + r * h2) & (CONTENT_SKETCH_WIDTH - 1)];
+        min = c < min ? c : min;
+    }
+    pthread_mutex_unlock(&shared->content_lock);
+    return min > 0 ? min : 1;
+}
+
+// Finds the oldest cached content of any context, other than the content
+// stamped skip; shared->lock held
+static cftpfs_context_t* find_oldest(cftpfs_shared_t *shared, bool disk_only, uint64_t skip,
+                                     uint64_t *oldest_seq, unsigned *oldest_freq) {
+    cftpfs_context_t *oldest = NULL;
+    for (int i = 0; i < shared->context_count; i++) {
+        uint64_t seq;
+        unsigned freq;
+        if (open_file_oldest(shared->contexts[i], disk_only, skip, &seq, &freq) &&
+            (!oldest || seq < *oldest_seq)) {
+            oldest = shared->contexts[i];
+            *oldest_seq = seq;
+            *oldest_freq = freq;
+        }
+    }
+    return oldest;
+}
+
+// Drops the oldest cached content of any context; shared->lock held. False
+// if there is none. Content reopened just now is left alone.
+static bool evict_oldest(cftpfs_shared_t *shared, bool disk_only) {
+    uint64_t seq;
+    unsigned freq;
+    cftpfs_context_t *oldest = find_oldest(shared, disk_only, 0, &seq, &freq);
+    if (!oldest) {
+        return false;
+    }
+    open_file_evict(oldest, seq);
+    return true;
+}
+
+static bool content_over(cftpfs_shared_t *shared) {
+    pthread_mutex_lock(&shared->content_lock);
+    bool over = shared->content_cached_bytes > shared->content_cache_max;
+    pthread_mutex_unlock(&shared->content_lock);
+    return over;
+}
+
+// Brings the content cache back within its limit. No context lock may be
+// held, since content is dropped wherever it is oldest.
+void shared_content_trim(cftpfs_shared_t *shared) {
+    pthread_mutex_lock(&shared->lock);
+    while (content_over(shared) && evict_oldest(shared, false)) {
+    }
+    pthread_mutex_unlock(&shared->lock);
+}
+
+// Makes room for content ctx has just cached with stamp seq, whose path has
+// been opened freq times, by dropping the oldest content of any context.
+// Should an entry to be dropped be opened at least as often, the newcomer
+// is dropped instead. No context lock may be held.
+void shared_content_admit(cftpfs_shared_t *shared, cftpfs_context_t *ctx, uint64_t seq, unsigned freq) {
+    pthread_mutex_lock(&shared->lock);
+    bool candidate = true;
+    while (content_over(shared)) {
+        uint64_t victim_seq = 0;
+        unsigned victim_freq = 0;
+        cftpfs_context_t *victim = find_oldest(shared, false, candidate ? seq : 0, &victim_seq, &victim_freq);
+        if (candidate && (!victim || victim_freq >= freq)) {
+            if (ctx->debug && victim) {
+                fprintf(stderr, "[DEBUG] content cache admission: refused (opened %u times, oldest %u)\n",
+                        freq, victim_freq);
+            }
+            // Reopened or dropped meanwhile if this fails; either way it
+            // is no longer ours to refuse
+            open_file_evict(ctx, seq);
+            candidate = false;
+        } else if (victim) {
+            open_file_evict(victim, victim_seq);
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shared->lock);
+}
+
+// Drops the oldest cached content to free staging space (only content
+// spilled to disk if disk_only); false if nothing could be dropped
+bool shared_evict_clean(cftpfs_shared_t *shared, bool disk_only) {
+    pthread_mutex_lock(&shared->lock);
+    bool evicted = evict_oldest(shared, disk_only);
+    pthread_mutex_unlock(&shared->lock);
+    return evicted;
+}
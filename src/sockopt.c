@@ -0,0 +1,47 @@
+/**
+ * sockopt.c - Socket options for FTP connections
+ *
+ * Control connections carry short commands and replies and get
+ * TCP_NODELAY. Connections that carry file content can be given socket
+ * buffers sized to the link's bandwidth-delay product (--tcp-bdp): a single
+ * stream needs a window that large to fill a long, fast link, and the
+ * kernel's buffer autotuning may top out below it. They can also use a
+ * different congestion control algorithm (--tcp-congestion).
+ *
+ * Options are applied before connect(), so the window scale offered in
+ * the handshake already accounts for the larger buffers.
+ */
+
+#include "cftpfs.h"
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// SO_RCVBUFFORCE/SO_SNDBUFFORCE go past net.core.[rw]mem_max, but need
+// CAP_NET_ADMIN; without it the buffer is capped there
+static void sock_buffer(int fd, int force, int option, int size) {
+    if (setsockopt(fd, SOL_SOCKET, force, &size, sizeof(size)) < 0) {
+        setsockopt(fd, SOL_SOCKET, option, &size, sizeof(size));
+    }
+}
+
+void sock_tune(cftpfs_context_t *ctx, int fd, bool transfer) {
+    if (!transfer) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        return;
+    }
+
+    if (ctx->tcp_buffer > 0) {
+        // The kernel doubles the value for its own bookkeeping
+        int size = ctx->tcp_buffer > INT_MAX / 2 ? INT_MAX / 2 : (int)ctx->tcp_buffer;
+        sock_buffer(fd, SO_RCVBUFFORCE, SO_RCVBUF, size);
+        sock_buffer(fd, SO_SNDBUFFORCE, SO_SNDBUF, size);
+    }
+    if (ctx->tcp_congestion[0] &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, ctx->tcp_congestion, strlen(ctx->tcp_congestion)) < 0 &&
+        ctx->debug) {
+        fprintf(stderr, "[DEBUG] TCP congestion control %s: %s\n", ctx->tcp_congestion, strerror(errno));
+    }
+}
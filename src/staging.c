@@ -0,0 +1,315 @@
+/**
+ * staging.c - Local staging of file content
+ *
+ * Content starts out in a heap buffer and is only moved to a temp file in
+ * ctx->temp_dir once it grows past ctx->staging_mem_max. Small files (the
+ * common case for config files and source code) never touch the disk, and
+ * uploads copy straight out of the buffer.
+ *
+ * Disk usage is charged against the staging quota, which every context of
+ * the process shares. When a spill or a growing temp file would exceed it,
+ * the oldest clean cached content of any context is evicted first; if
+ * that is not enough the caller waits for other handles to release space,
+ * and gets ENOSPC after STAGING_ADMISSION_TIMEOUT.
+ */
+
+#include "cftpfs.h"
+
+void quota_init(cftpfs_shared_t *shared) {
+    shared->staging_disk_used = 0;
+    pthread_mutex_init(&shared->quota_lock, NULL);
+    pthread_cond_init(&shared->quota_cond, NULL);
+}
+
+void quota_cleanup(cftpfs_shared_t *shared) {
+    pthread_cond_destroy(&shared->quota_cond);
+    pthread_mutex_destroy(&shared->quota_lock);
+}
+
+static int quota_acquire(cftpfs_context_t *ctx, size_t bytes, bool wait) {
+    cftpfs_shared_t *shared = ctx->shared;
+    if (shared->staging_quota && bytes > shared->staging_quota) {
+        // Could never be admitted, do not make it wait
+        return -ENOSPC;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += STAGING_ADMISSION_TIMEOUT;
+
+    pthread_mutex_lock(&shared->quota_lock);
+    while (shared->staging_quota && shared->staging_disk_used + bytes > shared->staging_quota) {
+        pthread_mutex_unlock(&shared->quota_lock);
+        bool evicted = shared_evict_clean(shared, true);
+        pthread_mutex_lock(&shared->quota_lock);
+        if (evicted) {
+            continue;
+        }
+        if (!wait) {
+            pthread_mutex_unlock(&shared->quota_lock);
+            return -ENOSPC;
+        }
+
+        if (ctx->debug) {
+            fprintf(stderr, "[DEBUG] staging: waiting for %zu bytes (%zu/%zu used)\n",
+                    bytes, shared->staging_disk_used, shared->staging_quota);
+        }
+        if (pthread_cond_timedwait(&shared->quota_cond, &shared->quota_lock, &deadline) == ETIMEDOUT &&
+            shared->staging_disk_used + bytes > shared->staging_quota) {
+            pthread_mutex_unlock(&shared->quota_lock);
+            return -ENOSPC;
+        }
+    }
+    shared->staging_disk_used += bytes;
+    pthread_mutex_unlock(&shared->quota_lock);
+    return 0;
+}
+
+static void quota_release(cftpfs_context_t *ctx, size_t bytes) {
+    if (bytes == 0) {
+        return;
+    }
+    cftpfs_shared_t *shared = ctx->shared;
+    pthread_mutex_lock(&shared->quota_lock);
+    shared->staging_disk_used -= bytes;
+    pthread_cond_broadcast(&shared->quota_cond);
+    pthread_mutex_unlock(&shared->quota_lock);
+}
+
+// Charges the staging area for `disk_bytes` on disk, waiting for admission
+// if needed. Charges only grow until staging_free.
+int staging_reserve(cftpfs_context_t *ctx, staging_t *st, size_t disk_bytes) {
+    if (disk_bytes <= st->disk_charged) {
+        return 0;
+    }
+    int ret = quota_acquire(ctx, disk_bytes - st->disk_charged, !st->no_wait);
+    if (ret == 0) {
+        st->disk_charged = disk_bytes;
+    }
+    return ret;
+}
+
+// Quota a write ending at `end` still needs on disk, 0 if it stays in
+// memory or is already charged; st locked
+size_t staging_shortfall(cftpfs_context_t *ctx, const staging_t *st, size_t end) {
+    if (st->fd < 0 && end <= ctx->staging_mem_max) {
+        return 0;
+    }
+    size_t disk = end > st->size ? end : st->size;
+    return disk > st->disk_charged ? disk - st->disk_charged : 0;
+}
+
+// Waits for `bytes` of quota without touching any staging area, so that
+// no lock is held during admission. staging_credit hands it to one.
+int staging_admit(cftpfs_context_t *ctx, size_t bytes) {
+    return bytes > 0 ? quota_acquire(ctx, bytes, true) : 0;
+}
+
+// Adds quota taken by staging_admit to st's charge; st locked
+void staging_credit(staging_t *st, size_t bytes) {
+    st->disk_charged += bytes;
+}
+
+// Allocates nothing: the buffer appears on first write, the temp file
+// (and its name) only on spill
+void staging_init(staging_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->fd = -1;
+}
+
+void staging_free(cftpfs_context_t *ctx, staging_t *st) {
+    free(st->data);
+    st->data = NULL;
+    st->capacity = 0;
+    st->size = 0;
+    if (st->fd >= 0) {
+        close(st->fd);
+        st->fd = -1;
+    }
+    if (st->temp_path) {
+        unlink(st->temp_path);
+        free(st->temp_path);
+        st->temp_path = NULL;
+    }
+    quota_release(ctx, st->disk_charged);
+    st->disk_charged = 0;
+}
+
+// Moves the memory tier into a new temp file
+static int staging_spill(cftpfs_context_t *ctx, staging_t *st) {
+    char temp_path[MAX_PATH_LEN];
+    int len = snprintf(temp_path, sizeof(temp_path), "%s/st_%d_%ld_%p",
+                       ctx->temp_dir, getpid(), (long)time(NULL), (void*)st);
+    if (len < 0 || (size_t)len >= sizeof(temp_path)) {
+        return -ENAMETOOLONG;
+    }
+
+    int fd = open(temp_path, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    size_t done = 0;
+    while (done < st->size) {
+        ssize_t n = write(fd, st->data + done, st->size - done);
+        if (n < 0) {
+            int err = errno;
+            close(fd);
+            unlink(temp_path);
+            return -err;
+        }
+        done += n;
+    }
+
+    st->temp_path = strdup(temp_path);
+    if (!st->temp_path) {
+        close(fd);
+        unlink(temp_path);
+        return -ENOMEM;
+    }
+
+    if (ctx->debug) {
+        fprintf(stderr, "[DEBUG] staging: spilled %zu bytes to %s\n", st->size, temp_path);
+    }
+
+    free(st->data);
+    st->data = NULL;
+    st->capacity = 0;
+    st->fd = fd;
+    return 0;
+}
+
+// Makes room for `needed` bytes in the memory tier
+static int staging_reserve_mem(staging_t *st, size_t needed, size_t limit) {
+    if (needed <= st->capacity) {
+        return 0;
+    }
+
+    size_t new_capacity = st->capacity ? st->capacity : STAGING_INITIAL_CAPACITY;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    if (new_capacity > limit) {
+        new_capacity = limit;
+    }
+
+    char *data = realloc(st->data, new_capacity);
+    if (!data) {
+        return -ENOMEM;
+    }
+    st->data = data;
+    st->capacity = new_capacity;
+    return 0;
+}
+
+ssize_t staging_read(staging_t *st, char *buf, size_t size, off_t offset) {
+    if (offset < 0) {
+        return -EINVAL;
+    }
+    if ((size_t)offset >= st->size) {
+        return 0;
+    }
+    if (size > st->size - offset) {
+        size = st->size - offset;
+    }
+
+    if (st->fd >= 0) {
+        ssize_t n = pread(st->fd, buf, size, offset);
+        return n >= 0 ? n : -errno;
+    }
+
+    memcpy(buf, st->data + offset, size);
+    return size;
+}
+
+ssize_t staging_write(cftpfs_context_t *ctx, staging_t *st, const char *buf,
+                      size_t size, off_t offset) {
+    if (offset < 0) {
+        return -EINVAL;
+    }
+    size_t end = (size_t)offset + size;
+
+    if (st->fd >= 0 || end > ctx->staging_mem_max) {
+        int ret = staging_reserve(ctx, st, end > st->size ? end : st->size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (st->fd < 0 && end > ctx->staging_mem_max) {
+        int ret = staging_spill(ctx, st);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (st->fd >= 0) {
+        ssize_t n = pwrite(st->fd, buf, size, offset);
+        if (n < 0) {
+            return -errno;
+        }
+        if ((size_t)offset + n > st->size) {
+            st->size = offset + n;
+        }
+        return n;
+    }
+
+    int ret = staging_reserve_mem(st, end, ctx->staging_mem_max);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((size_t)offset > st->size) {
+        // Writing past EOF leaves a hole that reads back as zeros
+        memset(st->data + st->size, 0, offset - st->size);
+    }
+    memcpy(st->data + offset, buf, size);
+    if (end > st->size) {
+        st->size = end;
+    }
+    return size;
+}
+
+int staging_truncate(cftpfs_context_t *ctx, staging_t *st, off_t size) {
+    if (size < 0) {
+        return -EINVAL;
+    }
+
+    if (st->fd >= 0 || (size_t)size > ctx->staging_mem_max) {
+        int ret = staging_reserve(ctx, st, (size_t)size > st->size ? (size_t)size : st->size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (st->fd < 0 && (size_t)size > ctx->staging_mem_max) {
+        int ret = staging_spill(ctx, st);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (st->fd >= 0) {
+        if (ftruncate(st->fd, size) < 0) {
+            return -errno;
+        }
+        st->size = size;
+        return 0;
+    }
+
+    int ret = staging_reserve_mem(st, size, ctx->staging_mem_max);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((size_t)size > st->size) {
+        memset(st->data + st->size, 0, size - st->size);
+    }
+    st->size = size;
+    return 0;
+}
+
+// Whether the transfer filling st (NULL for transfers into anything else)
+// should stop: the request that started it was interrupted and no other
+// request is waiting for the content
+bool staging_abandoned(const staging_t *st) {
+    return fuse_interrupted() && !(st && st->shared);
+}
@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+#
+# Stand-in FTP server for the local tests: serves ROOT read-only to any
+# login on 127.0.0.1:PORT, passive mode only. With RATE (bytes per second)
+# all transfers of the server share that bandwidth, like a link that
+# saturates, so that spreading reads over several servers shows.
+#
+# Usage: ftpd_standin.py PORT ROOT [RATE]
+
+import os
+import socket
+import socketserver
+import stat
+import sys
+import threading
+import time
+
+PORT = int(sys.argv[1])
+ROOT = os.path.realpath(sys.argv[2])
+RATE = float(sys.argv[3]) if len(sys.argv) > 3 else 0.0
+CHUNK = 16 * 1024
+
+pace_lock = threading.Lock()
+pace_next = [0.0]
+
+
+def pace(n):
+    # Reserves the server's link for n bytes and waits for the slot
+    if not RATE:
+        return
+    with pace_lock:
+        now = time.time()
+        start = max(now, pace_next[0])
+        pace_next[0] = start + n / RATE
+    if start > now:
+        time.sleep(start - now)
+
+
+def resolve(cwd, arg):
+    path = os.path.normpath(os.path.join(cwd, arg or "."))
+    if not path.startswith("/"):
+        path = "/" + path
+    return path, os.path.join(ROOT, path.lstrip("/"))
+
+
+def list_line(name, st):
+    kind = "d" if stat.S_ISDIR(st.st_mode) else "-"
+    when = time.strftime("%b %d %H:%M", time.localtime(st.st_mtime))
+    return "%srw-r--r-- 1 ftp ftp %d %s %s\r\n" % (kind, st.st_size, when, name)
+
+
+class Session(socketserver.StreamRequestHandler):
+    def reply(self, text):
+        self.wfile.write((text + "\r\n").encode())
+        self.wfile.flush()
+
+    def passive(self):
+        if self.pasv:
+            self.pasv.close()
+        self.pasv = socket.socket()
+        self.pasv.bind(("127.0.0.1", 0))
+        self.pasv.listen(1)
+        return self.pasv.getsockname()[1]
+
+    def transfer(self, send):
+        if not self.pasv:
+            self.reply("425 Use PASV first")
+            return
+        self.reply("150 Opening data connection")
+        data, _ = self.pasv.accept()
+        self.pasv.close()
+        self.pasv = None
+        try:
+            send(data)
+        finally:
+            data.close()
+        self.reply("226 Transfer complete")
+
+    def handle(self):
+        self.pasv = None
+        cwd = "/"
+        offset = 0
+        self.reply("220 stand-in ready")
+        for raw in self.rfile:
+            line = raw.decode(errors="replace").rstrip("\r\n")
+            verb, _, arg = line.partition(" ")
+            verb = verb.upper()
+            path, real = resolve(cwd, arg)
+            if verb == "USER":
+                self.reply("331 Any password")
+            elif verb == "PASS":
+                self.reply("230 Logged in")
+            elif verb in ("TYPE", "MODE", "STRU", "OPTS"):
+                self.reply("200 OK")
+            elif verb == "NOOP":
+                self.reply("200 OK")
+            elif verb == "SYST":
+                self.reply("215 UNIX Type: L8")
+            elif verb == "FEAT":
+                self.reply("211-Features:\r\n EPSV\r\n MDTM\r\n SIZE\r\n REST STREAM\r\n211 End")
+            elif verb == "PWD":
+                self.reply('257 "%s"' % cwd)
+            elif verb == "CWD":
+                if os.path.isdir(real):
+                    cwd = path
+                    self.reply("250 OK")
+                else:
+                    self.reply("550 No such directory")
+            elif verb == "CDUP":
+                cwd = os.path.dirname(cwd.rstrip("/")) or "/"
+                self.reply("250 OK")
+            elif verb == "EPSV":
+                self.reply("229 Entering Extended Passive Mode (|||%d|)" % self.passive())
+            elif verb == "PASV":
+                port = self.passive()
+                self.reply("227 Entering Passive Mode (127,0,0,1,%d,%d)" % (port >> 8, port & 255))
+            elif verb == "SIZE":
+                if os.path.isfile(real):
+                    self.reply("213 %d" % os.path.getsize(real))
+                else:
+                    self.reply("550 No such file")
+            elif verb == "MDTM":
+                if os.path.exists(real):
+                    self.reply("213 " + time.strftime("%Y%m%d%H%M%S", time.gmtime(os.path.getmtime(real))))
+                else:
+                    self.reply("550 No such file")
+            elif verb == "REST":
+                offset = int(arg or 0)
+                self.reply("350 Restarting")
+            elif verb in ("LIST", "NLST"):
+                target = real if arg and not arg.startswith("-") else os.path.join(ROOT, cwd.lstrip("/"))
+                if not os.path.isdir(target):
+                    self.reply("550 No such directory")
+                    continue
+                text = "".join(list_line(n, os.stat(os.path.join(target, n))) for n in sorted(os.listdir(target)))
+                self.transfer(lambda data: data.sendall(text.encode()))
+            elif verb == "RETR":
+                if not os.path.isfile(real):
+                    self.reply("550 No such file")
+                    continue
+                start, offset = offset, 0
+
+                def send(data, real=real, start=start):
+                    with open(real, "rb") as f:
+                        f.seek(start)
+                        while True:
+                            chunk = f.read(CHUNK)
+                            if not chunk:
+                                break
+                            pace(len(chunk))
+                            data.sendall(chunk)
+                try:
+                    self.transfer(send)
+                except OSError:
+                    self.reply("426 Transfer aborted")
+            elif verb == "ABOR":
+                self.reply("226 Nothing to abort")
+            elif verb == "QUIT":
+                self.reply("221 Bye")
+                break
+            elif verb in ("STOR", "APPE", "DELE", "MKD", "RMD", "RNFR", "RNTO"):
+                self.reply("550 Read-only stand-in")
+            else:
+                self.reply("502 Not implemented")
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+if __name__ == "__main__":
+    Server(("127.0.0.1", PORT), Session).serve_forever()
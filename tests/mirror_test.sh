@@ -0,0 +1,107 @@
+#!/bin/bash
+#
+# Mirror load spreading and failover (--mirror), against three local
+# stand-in servers (ftpd_standin.py) serving the same tree, each capped at
+# 2 MB/s. Reads six 2 MB files in parallel through a mount of:
+#
+#   1. the host alone                 expect about 2 MB/s
+#   2. the host and two mirrors       expect 4-6 MB/s
+#   3. the same, one mirror killed    every file still intact
+#      half a second in
+#
+# and checks every file read against the original. Needs FUSE
+# (fusermount3) and python3.
+#
+# Usage: tests/mirror_test.sh [CFTPFS_BINARY] [--native-ftp]
+
+set -e
+
+BIN=$(realpath "${1:-./cftpfs}")
+ENGINE=$2
+HERE=$(dirname "$(realpath "$0")")
+PORT=${MIRROR_TEST_PORT:-21410}
+RATE=2000000
+FILES=6
+
+WORK=$(mktemp -d)
+ROOT=$WORK/root
+MNT=$WORK/mnt
+mkdir -p "$ROOT" "$MNT"
+PIDS=()
+
+cleanup() {
+    fusermount3 -u "$MNT" 2>/dev/null || true
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+now() {
+    date +%s.%N
+}
+
+# Mounts the host with the given options and waits until it answers
+mount_it() {
+    "$BIN" 127.0.0.1 "$MNT" -p "$PORT" --connections 9 $ENGINE "$@" -f > "$WORK/mount.log" 2>&1 &
+    MOUNT_PID=$!
+    for _ in $(seq 50); do
+        mountpoint -q "$MNT" && ls "$MNT" > /dev/null 2>&1 && return 0
+        sleep 0.1
+    done
+    echo "FAIL: mount did not come up"; cat "$WORK/mount.log"; exit 1
+}
+
+unmount_it() {
+    fusermount3 -u "$MNT"
+    wait "$MOUNT_PID" || true
+}
+
+# Reads every file in parallel; prints MB/s and checks the content
+read_all() {
+    local start end
+    start=$(now)
+    for i in $(seq $FILES); do
+        cat "$MNT/f$i" > "$WORK/out$i" &
+    done
+    wait
+    end=$(now)
+    for i in $(seq $FILES); do
+        if ! cmp -s "$ROOT/f$i" "$WORK/out$i"; then
+            echo "FAIL: f$i read back different"; exit 1
+        fi
+    done
+    python3 -c "print('%.2f' % ($FILES * 2.0 / ($end - $start)))"
+}
+
+for i in $(seq $FILES); do
+    head -c 2000000 /dev/urandom > "$ROOT/f$i"
+done
+for n in 0 1 2; do
+    python3 "$HERE/ftpd_standin.py" $((PORT + n)) "$ROOT" $RATE &
+    PIDS+=($!)
+done
+sleep 1
+
+mount_it
+host=$(read_all)
+unmount_it
+echo "host only:            $host MB/s"
+
+MIRRORS=(--mirror 127.0.0.1:$((PORT + 1)) --mirror 127.0.0.1:$((PORT + 2)))
+mount_it "${MIRRORS[@]}"
+spread=$(read_all)
+unmount_it
+echo "host and two mirrors: $spread MB/s"
+
+mount_it "${MIRRORS[@]}"
+(sleep 0.5; kill "${PIDS[2]}") &
+failover=$(read_all)
+unmount_it
+echo "one mirror killed:    $failover MB/s, every file intact"
+
+if ! python3 -c "import sys; sys.exit(0 if $spread > 1.5 * $host else 1)"; then
+    echo "FAIL: mirrors did not spread the reads"; exit 1
+fi
+echo "PASS"